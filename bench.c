@@ -0,0 +1,613 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * chet2p-bench: starts a set of headless chet2p nodes on loopback,
+ * drives them through their stdin at a given rate and reports delivery
+ * throughput, end to end latency and per node cpu and memory as json.
+ *
+ * Every message carries the time it was issued; latency runs from the
+ * bench writing the command to the receiving node printing the message,
+ * so it covers input handling, the network path and the display path.
+ *
+ * With -T the schedule comes from a capture (see capture.h) instead:
+ * every message the captured node sent or received is issued again at
+ * its original offset, scaled by -S, between the nodes standing in for
+ * its ends.  The captured node is node0, its k-th peer node (k + 1) mod
+ * n.  Payloads keep the original text after the latency marker.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "histogram.h"
+#include "node.h"
+
+#define BENCH_NODES 32
+#define BENCH_PORT 21000
+#define BENCH_LINE 512
+#define BENCH_FDS 4096
+
+typedef struct {
+	int index;
+	char id[16];
+	pid_t pid;
+	int in;
+	int out;
+	char rbuf[BENCH_LINE * 8];
+	size_t rlen;
+	unsigned long alive;
+	unsigned long sent;
+	unsigned long received;
+	unsigned long execs;
+	unsigned long errors;
+	unsigned long restarts;
+	double cpu_start;
+	double cpu;
+	long rss;
+	long rss_peak;
+} bnode_t;
+
+static int nnodes = 4;
+static double rate = 1000;
+static int size = 64;
+static int duration = 10;
+static int bcast_pct;
+static int exec_pct;
+static int churn;
+static const char *binary = "./chet2p";
+static const char *node_args = "-l 0";
+static const char *trace_path;
+static double trace_speed = 1;
+
+static char peersfile[] = "/tmp/chet2p-bench-XXXXXX";
+static bnode_t nodes[BENCH_NODES];
+static bnode_t *by_fd[BENCH_FDS];
+static pthread_mutex_t nodes_mutex = PTHREAD_MUTEX_INITIALIZER;
+static histogram_t latency;
+static int epfd;
+static int reading = 1;
+
+static uint64_t
+bench_clock()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+static void
+write_peers()
+{
+	FILE *f;
+	int fd, i;
+
+	fd = mkstemp(peersfile);
+	f = fdopen(fd, "w");
+	for (i = 0; i < nnodes; i++)
+		fprintf(f, "node%d 127.0.0.1 %d %d\n", i,
+			BENCH_PORT + 10 * i, BENCH_PORT + 10 * i + 1);
+	fclose(f);
+}
+
+static void
+node_spawn(bnode_t *node)
+{
+	struct epoll_event ev;
+	char cmd[BENCH_LINE];
+	int in[2], out[2];
+
+	pipe(in);
+	pipe(out);
+
+	snprintf(cmd, BENCH_LINE, "exec %s -H %s %s %s", binary, node_args,
+		peersfile, node->id);
+
+	node->pid = fork();
+	if (node->pid == 0) {
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		execl("/bin/sh", "sh", "-c", cmd, NULL);
+		_exit(127);
+	}
+
+	close(in[0]);
+	close(out[1]);
+	node->in = in[1];
+	node->out = out[0];
+	node->rlen = 0;
+	node->alive = 0;
+	fcntl(node->out, F_SETFL, O_NONBLOCK);
+
+	by_fd[node->out] = node;
+	ev.events = EPOLLIN;
+	ev.data.fd = node->out;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, node->out, &ev);
+}
+
+/* asks node to leave, kills it if it takes too long */
+static void
+node_stop(bnode_t *node)
+{
+	int i;
+
+	write(node->in, "leave\n", 6);
+	close(node->in);
+	node->in = -1;
+
+	for (i = 0; i < 100; i++) {
+		if (waitpid(node->pid, NULL, WNOHANG) == node->pid)
+			return;
+		usleep(50000);
+	}
+
+	kill(node->pid, SIGKILL);
+	waitpid(node->pid, NULL, 0);
+}
+
+static void
+node_line(bnode_t *node, const char *line)
+{
+	unsigned long seq, ts;
+	char id[16];
+	int peer;
+
+	if (line[0] == '>')
+		return;
+
+	if (line[0] == '[') {
+		if (strncmp(line, "[ERR]", 5) == 0)
+			node->errors++;
+		else if (strstr(line, "] exec "))
+			node->execs++;
+		else if (sscanf(line, "[NOTICE] node%d changed status to", &peer) == 1 &&
+			 peer >= 0 && peer < nnodes) {
+			if (strstr(line, "not alive"))
+				node->alive &= ~(1UL << peer);
+			else
+				node->alive |= 1UL << peer;
+		}
+		return;
+	}
+
+	if (sscanf(line, "%15s b%lu:%lu:", id, &seq, &ts) == 3) {
+		histogram_record(&latency, bench_clock() - ts);
+		node->received++;
+	}
+}
+
+static void
+node_read(bnode_t *node)
+{
+	char *line, *eol;
+	ssize_t nbytes;
+
+	while ((nbytes = read(node->out, node->rbuf + node->rlen,
+			sizeof(node->rbuf) - node->rlen - 1)) > 0) {
+		node->rlen += nbytes;
+		node->rbuf[node->rlen] = '\0';
+
+		line = node->rbuf;
+		while ((eol = strchr(line, '\n'))) {
+			*eol = '\0';
+			node_line(node, line);
+			line = eol + 1;
+		}
+
+		node->rlen -= line - node->rbuf;
+		memmove(node->rbuf, line, node->rlen);
+
+		/* an overlong line, drop it */
+		if (node->rlen == sizeof(node->rbuf) - 1)
+			node->rlen = 0;
+	}
+
+	if (nbytes == 0 || (nbytes < 0 && errno != EAGAIN)) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, node->out, NULL);
+		by_fd[node->out] = NULL;
+		close(node->out);
+	}
+}
+
+static void *
+reader(void *data)
+{
+	struct epoll_event events[BENCH_NODES];
+	int nevents, i;
+
+	while (__atomic_load_n(&reading, __ATOMIC_RELAXED)) {
+		nevents = epoll_wait(epfd, events, BENCH_NODES, 100);
+
+		pthread_mutex_lock(&nodes_mutex);
+		for (i = 0; i < nevents; i++) {
+			if (by_fd[events[i].data.fd])
+				node_read(by_fd[events[i].data.fd]);
+		}
+		pthread_mutex_unlock(&nodes_mutex);
+	}
+
+	return NULL;
+}
+
+static int
+all_alive()
+{
+	unsigned long all = (1UL << nnodes) - 1;
+	int i, ready = 1;
+
+	pthread_mutex_lock(&nodes_mutex);
+	for (i = 0; i < nnodes; i++) {
+		if ((nodes[i].alive | (1UL << i)) != all)
+			ready = 0;
+	}
+	pthread_mutex_unlock(&nodes_mutex);
+
+	return ready;
+}
+
+/* cpu seconds and resident kb from /proc */
+static void
+node_usage(bnode_t *node, double *cpu, long *rss, long *rss_peak)
+{
+	char path[64], line[BENCH_LINE], *p;
+	unsigned long utime, stime;
+	FILE *f;
+
+	*cpu = 0;
+	*rss = *rss_peak = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", node->pid);
+	if ((f = fopen(path, "r"))) {
+		/* comm may hold spaces, fields restart after its ')' */
+		if (fgets(line, sizeof(line), f) && (p = strrchr(line, ')')) &&
+		    sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			   &utime, &stime) == 2)
+			*cpu = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+		fclose(f);
+	}
+
+	snprintf(path, sizeof(path), "/proc/%d/status", node->pid);
+	if ((f = fopen(path, "r"))) {
+		while (fgets(line, sizeof(line), f)) {
+			sscanf(line, "VmRSS: %ld", rss);
+			sscanf(line, "VmHWM: %ld", rss_peak);
+		}
+		fclose(f);
+	}
+}
+
+static void
+issue(bnode_t *src, unsigned long seq)
+{
+	char line[BENCH_LINE], payload[BENCH_LINE];
+	int dst, len, roll;
+
+	len = snprintf(payload, BENCH_LINE, "b%lu:%lu:", seq, (unsigned long)bench_clock());
+	while (len < size && len < BENCH_LINE - 1)
+		payload[len++] = 'x';
+	payload[len] = '\0';
+
+	dst = (src->index + 1 + rand() % (nnodes - 1)) % nnodes;
+	roll = rand() % 100;
+
+	if (roll < exec_pct)
+		len = snprintf(line, BENCH_LINE, "exec node%d /bin/true\n", dst);
+	else if (roll < exec_pct + bcast_pct)
+		len = snprintf(line, BENCH_LINE, "bcast %s\n", payload);
+	else
+		len = snprintf(line, BENCH_LINE, "msg node%d %s\n", dst, payload);
+
+	if (src->in >= 0 && write(src->in, line, len) == len)
+		src->sent++;
+}
+
+/* the node standing in for a captured peer */
+static int
+trace_node(int peer)
+{
+	return (1 + peer) % nnodes;
+}
+
+/* one captured message, from whichever end sent it; 0 if skipped */
+static int
+issue_record(const capture_record_t *record, unsigned long seq)
+{
+	char line[BENCH_LINE], payload[BENCH_LINE];
+	const char *text = record->data;
+	bnode_t *src;
+	int dst, len, n;
+
+	if (record->type == CAP_TCP_OUT && record->peer >= 0) {
+		src = &nodes[0];
+		dst = trace_node(record->peer);
+	}
+	else if (record->type == CAP_TCP_IN && record->peer >= 0) {
+		src = &nodes[trace_node(record->peer)];
+		dst = 0;
+	}
+	else if (record->type == CAP_UDP_OUT && strncmp(text, "bcast ", 6) == 0) {
+		/* a multicast broadcast: bcast <id> <epoch> <seq> <message> */
+		src = &nodes[0];
+		dst = -1;
+		n = 0;
+		sscanf(text, "bcast %*s %*s %*s %n", &n);
+		text += n;
+	}
+	else {
+		return 0;
+	}
+
+	/* chat is captured as a msg frame, older traces have it bare */
+	if (strncmp(text, "msg ", 4) == 0)
+		text += 4;
+
+	if (dst == src->index)
+		dst = (dst + 1) % nnodes;
+
+	len = snprintf(payload, 201, "b%lu:%lu:%s", seq, (unsigned long)bench_clock(), text);
+	if (len > 200)
+		len = 200;
+
+	if (strncmp(record->data, "exec ", 5) == 0)
+		len = snprintf(line, BENCH_LINE, "exec node%d /bin/true\n", dst);
+	else if (dst < 0)
+		len = snprintf(line, BENCH_LINE, "bcast %.*s\n", len, payload);
+	else
+		len = snprintf(line, BENCH_LINE, "msg node%d %.*s\n", dst, len, payload);
+
+	if (src->in >= 0 && write(src->in, line, len) == len)
+		src->sent++;
+	return 1;
+}
+
+static void
+restart_one()
+{
+	bnode_t *node = &nodes[1 + rand() % (nnodes - 1)];
+
+	node_stop(node);
+	node->restarts++;
+	pthread_mutex_lock(&nodes_mutex);
+	node_spawn(node);
+	pthread_mutex_unlock(&nodes_mutex);
+}
+
+static void
+report(double elapsed)
+{
+	unsigned long sent = 0, received = 0, errors = 0;
+	bnode_t *node;
+	int i;
+
+	for (i = 0; i < nnodes; i++) {
+		sent += nodes[i].sent;
+		received += nodes[i].received;
+		errors += nodes[i].errors;
+	}
+
+	printf("{\n");
+	printf("  \"config\": {\"nodes\": %d, \"rate\": %.0f, \"size\": %d, "
+		"\"duration\": %d, \"bcast_pct\": %d, \"exec_pct\": %d, "
+		"\"churn\": %d, \"args\": \"%s\"},\n",
+		nnodes, rate, size, duration, bcast_pct, exec_pct, churn, node_args);
+	if (trace_path)
+		printf("  \"trace\": {\"path\": \"%s\", \"speed\": %g},\n",
+			trace_path, trace_speed);
+	printf("  \"elapsed_s\": %.3f,\n", elapsed);
+	printf("  \"sent\": %lu,\n", sent);
+	printf("  \"received\": %lu,\n", received);
+	printf("  \"errors\": %lu,\n", errors);
+	printf("  \"throughput_msgs_s\": %.1f,\n", received / elapsed);
+	printf("  \"latency_us\": {\"p50\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu},\n",
+		(unsigned long)histogram_percentile(&latency, 50),
+		(unsigned long)histogram_percentile(&latency, 99),
+		(unsigned long)histogram_percentile(&latency, 99.9),
+		(unsigned long)histogram_percentile(&latency, 100));
+	printf("  \"nodes\": [\n");
+	for (i = 0; i < nnodes; i++) {
+		node = &nodes[i];
+		printf("    {\"id\": \"%s\", \"sent\": %lu, \"received\": %lu, "
+			"\"execs\": %lu, \"errors\": %lu, \"restarts\": %lu, "
+			"\"cpu_s\": %.2f, \"cpu_pct\": %.1f, \"rss_kb\": %ld, \"rss_peak_kb\": %ld}%s\n",
+			node->id, node->sent, node->received, node->execs, node->errors,
+			node->restarts, node->cpu, 100 * node->cpu / elapsed,
+			node->rss, node->rss_peak, i < nnodes - 1 ? "," : "");
+	}
+	printf("  ]\n}\n");
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-n nodes] [-r msgs/s] [-s size] [-d seconds] "
+		"[-B bcast%%] [-E exec%%] [-C churn_seconds] [-x chet2p] [-a node_args] "
+		"[-T capture [-S speed]]\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	uint64_t start, now, next_churn, stable;
+	unsigned long issued = 0, due, errors;
+	capture_reader_t trace;
+	capture_record_t record;
+	int replaying = 0;
+	pthread_t reader_tid;
+	double cpu;
+	long rss, rss_peak;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "n:r:s:d:B:E:C:x:a:T:S:")) != -1) {
+		switch (opt) {
+		case 'n': nnodes = atoi(optarg); break;
+		case 'r': rate = atof(optarg); break;
+		case 's': size = atoi(optarg); break;
+		case 'd': duration = atoi(optarg); break;
+		case 'B': bcast_pct = atoi(optarg); break;
+		case 'E': exec_pct = atoi(optarg); break;
+		case 'C': churn = atoi(optarg); break;
+		case 'x': binary = optarg; break;
+		case 'a': node_args = optarg; break;
+		case 'T': trace_path = optarg; break;
+		/* 0 is as fast as possible */
+		case 'S': trace_speed = atof(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (nnodes < 2 || nnodes > BENCH_NODES || rate <= 0 || duration < 1 ||
+	    size > 200 || bcast_pct + exec_pct > 100 || trace_speed < 0)
+		usage(argv[0]);
+
+	if (trace_path) {
+		if (capture_read_open(&trace, trace_path) != 0) {
+			fprintf(stderr, "%s is not a capture\n", trace_path);
+			exit(EXIT_FAILURE);
+		}
+		replaying = capture_next(&trace, &record) == 0;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	srand(getpid());
+	write_peers();
+
+	epfd = epoll_create1(0);
+	pthread_mutex_lock(&nodes_mutex);
+	for (i = 0; i < nnodes; i++) {
+		nodes[i].index = i;
+		snprintf(nodes[i].id, sizeof(nodes[i].id), "node%d", i);
+		node_spawn(&nodes[i]);
+	}
+	pthread_mutex_unlock(&nodes_mutex);
+
+	pthread_create(&reader_tid, NULL, reader, NULL);
+
+	/*
+	 * every node's first probe may time out on peers that weren't bound
+	 * yet, so views only count once they stayed whole for a full round
+	 */
+	start = bench_clock();
+	stable = 0;
+	for (;;) {
+		now = bench_clock();
+		if (!all_alive())
+			stable = 0;
+		else if (stable == 0)
+			stable = now;
+		else if (now - stable >= (NODE_PROBE_MS + NODE_TIMEOUT_MS) * 1000ULL)
+			break;
+
+		if (now - start > 30000000) {
+			fprintf(stderr, "nodes did not see each other alive, giving up\n");
+			for (i = 0; i < nnodes; i++)
+				node_stop(&nodes[i]);
+			unlink(peersfile);
+			exit(EXIT_FAILURE);
+		}
+		usleep(100000);
+	}
+
+	/* connect races while starting up are not part of the run */
+	pthread_mutex_lock(&nodes_mutex);
+	for (i = 0; i < nnodes; i++) {
+		nodes[i].errors = 0;
+		node_usage(&nodes[i], &nodes[i].cpu_start, &rss, &rss_peak);
+	}
+	pthread_mutex_unlock(&nodes_mutex);
+
+	start = bench_clock();
+	next_churn = start + churn * 1000000ULL;
+
+	/* a trace runs to its end, the rate schedule for duration */
+	while (trace_path ? replaying : bench_clock() - start < duration * 1000000ULL) {
+		now = bench_clock();
+		while (replaying && (trace_speed == 0 ||
+				     record.ts <= (now - start) * trace_speed)) {
+			issued += issue_record(&record, issued);
+			replaying = capture_next(&trace, &record) == 0;
+		}
+
+		due = (now - start) * rate / 1000000;
+		while (!trace_path && issued < due) {
+			issue(&nodes[issued % nnodes], issued);
+			issued++;
+		}
+
+		if (churn && now >= next_churn) {
+			restart_one();
+			next_churn += churn * 1000000ULL;
+		}
+
+		usleep(1000);
+	}
+
+	/* let in flight messages land */
+	sleep(1);
+	now = bench_clock();
+
+	for (i = 0; i < nnodes; i++) {
+		node_usage(&nodes[i], &cpu, &nodes[i].rss, &nodes[i].rss_peak);
+		nodes[i].cpu = cpu - nodes[i].cpu_start;
+		if (nodes[i].cpu < 0)
+			nodes[i].cpu = cpu;
+	}
+
+	for (i = 0; i < nnodes; i++)
+		node_stop(&nodes[i]);
+
+	__atomic_store_n(&reading, 0, __ATOMIC_RELAXED);
+	pthread_join(reader_tid, NULL);
+	unlink(peersfile);
+	if (trace_path)
+		capture_read_close(&trace);
+
+	/* with churn, sends to a restarting node are expected to fail */
+	errors = 0;
+	for (i = 0; i < nnodes; i++)
+		errors += nodes[i].errors;
+	if (errors && !churn) {
+		fprintf(stderr, "%lu errors during the run, no results\n", errors);
+		exit(EXIT_FAILURE);
+	}
+
+	report((now - start) / 1e6);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BITSET_H
+#define _BITSET_H
+
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Dense sets of peer indices, one bit per peer in 64 bit words.  Set
+ * operations go a word (or a 128 bit SSE2 register) at a time, walking
+ * the members costs one ctz per member plus one test per word.
+ */
+
+#define BITSET_WORDS(n) (((n) + 63) / 64)
+
+static inline void
+bitset_set(uint64_t *set, int i)
+{
+	set[i / 64] |= 1ULL << (i % 64);
+}
+
+static inline void
+bitset_clear(uint64_t *set, int i)
+{
+	set[i / 64] &= ~(1ULL << (i % 64));
+}
+
+static inline int
+bitset_test(const uint64_t *set, int i)
+{
+	return (set[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void
+bitset_zero(uint64_t *set, int nwords)
+{
+	memset(set, 0, nwords * sizeof(uint64_t));
+}
+
+/* dst = a & b, dst may be either of them */
+static inline void
+bitset_and(uint64_t *dst, const uint64_t *a, const uint64_t *b, int nwords)
+{
+	int i = 0;
+
+#ifdef __SSE2__
+	for (; i + 2 <= nwords; i += 2)
+		_mm_storeu_si128((__m128i *)(dst + i),
+			_mm_and_si128(_mm_loadu_si128((const __m128i *)(a + i)),
+				_mm_loadu_si128((const __m128i *)(b + i))));
+#endif
+	for (; i < nwords; i++)
+		dst[i] = a[i] & b[i];
+}
+
+static inline int
+bitset_count(const uint64_t *set, int nwords)
+{
+	int i, n = 0;
+
+	for (i = 0; i < nwords; i++)
+		n += __builtin_popcountll(set[i]);
+
+	return n;
+}
+
+/* first member from i on, -1 if none */
+static inline int
+bitset_next(const uint64_t *set, int nwords, int i)
+{
+	int w = i / 64;
+	uint64_t word;
+
+	if (w >= nwords)
+		return -1;
+
+	word = set[w] & (~0ULL << (i % 64));
+	while (word == 0) {
+		if (++w == nwords)
+			return -1;
+		word = set[w];
+	}
+
+	return w * 64 + __builtin_ctzll(word);
+}
+
+#endif /* _BITSET_H */
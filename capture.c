@@ -0,0 +1,245 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+
+/* stdio buffer, writes reach the disk in chunks this big */
+#define CAPTURE_BUFFER (1024 * 1024)
+
+int capturing;
+
+static FILE *out;
+static char *out_buffer;
+static uint64_t last;
+/* records come from every thread, in one timestamp order */
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *types[CAP_TYPES] = {
+	"udp in", "udp out", "tcp in", "tcp out"
+};
+
+static uint64_t
+capture_clock()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+static void
+put_varint(FILE *f, uint64_t value)
+{
+	while (value >= 0x80) {
+		putc_unlocked((value & 0x7f) | 0x80, f);
+		value >>= 7;
+	}
+	putc_unlocked(value, f);
+}
+
+/* -1 on a truncated or overlong one */
+static int
+get_varint(FILE *f, uint64_t *value)
+{
+	int c, shift;
+
+	*value = 0;
+	for (shift = 0; shift < 64; shift += 7) {
+		if ((c = getc_unlocked(f)) == EOF)
+			return -1;
+
+		*value |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return 0;
+	}
+
+	return -1;
+}
+
+static void
+put_string(FILE *f, const char *s)
+{
+	size_t len = strlen(s);
+
+	put_varint(f, len);
+	fwrite_unlocked(s, 1, len, f);
+}
+
+static char *
+get_string(FILE *f)
+{
+	uint64_t len;
+	char *s;
+
+	if (get_varint(f, &len) != 0 || len > CAPTURE_DATA)
+		return NULL;
+
+	s = malloc(len + 1);
+	if (fread(s, 1, len, f) != len) {
+		free(s);
+		return NULL;
+	}
+	s[len] = '\0';
+
+	return s;
+}
+
+int
+capture_open(const char *path, const char *self, char **ids, int nids)
+{
+	int i;
+
+	out = fopen(path, "w");
+	if (out == NULL)
+		return -1;
+
+	out_buffer = malloc(CAPTURE_BUFFER);
+	setvbuf(out, out_buffer, _IOFBF, CAPTURE_BUFFER);
+
+	fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), out);
+	put_string(out, self);
+	put_varint(out, nids);
+	for (i = 0; i < nids; i++)
+		put_string(out, ids[i]);
+
+	last = capture_clock();
+	__atomic_store_n(&capturing, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void
+capture_close()
+{
+	if (!__atomic_load_n(&capturing, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&capture_mutex);
+	__atomic_store_n(&capturing, 0, __ATOMIC_RELAXED);
+	fclose(out);
+	free(out_buffer);
+	out = NULL;
+	pthread_mutex_unlock(&capture_mutex);
+}
+
+void
+capture(int type, int peer, const char *data, size_t len)
+{
+	uint64_t now;
+
+	if (!__atomic_load_n(&capturing, __ATOMIC_ACQUIRE))
+		return;
+
+	if (len > CAPTURE_DATA)
+		len = CAPTURE_DATA;
+
+	pthread_mutex_lock(&capture_mutex);
+	if (out) {
+		/* stamped under the mutex, so deltas never go negative */
+		now = capture_clock();
+		put_varint(out, now - last);
+		putc_unlocked(type, out);
+		put_varint(out, peer + 1);
+		put_varint(out, len);
+		fwrite_unlocked(data, 1, len, out);
+		last = now;
+	}
+	pthread_mutex_unlock(&capture_mutex);
+}
+
+int
+capture_read_open(capture_reader_t *reader, const char *path)
+{
+	char magic[sizeof(CAPTURE_MAGIC)];
+	uint64_t nids;
+	int i;
+
+	memset(reader, 0, sizeof(*reader));
+	reader->in = fopen(path, "r");
+	if (reader->in == NULL)
+		return -1;
+
+	if (fread(magic, 1, strlen(CAPTURE_MAGIC), reader->in) != strlen(CAPTURE_MAGIC) ||
+	    memcmp(magic, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) != 0 ||
+	    (reader->self = get_string(reader->in)) == NULL ||
+	    get_varint(reader->in, &nids) != 0 || nids > 65536) {
+		capture_read_close(reader);
+		return -1;
+	}
+
+	reader->ids = calloc(nids + 1, sizeof(char *));
+	for (i = 0; i < (int)nids; i++) {
+		if ((reader->ids[i] = get_string(reader->in)) == NULL) {
+			capture_read_close(reader);
+			return -1;
+		}
+		reader->nids++;
+	}
+
+	return 0;
+}
+
+int
+capture_next(capture_reader_t *reader, capture_record_t *record)
+{
+	uint64_t delta, peer, len;
+	int type;
+
+	if (get_varint(reader->in, &delta) != 0 ||
+	    (type = getc_unlocked(reader->in)) == EOF ||
+	    get_varint(reader->in, &peer) != 0 ||
+	    get_varint(reader->in, &len) != 0 ||
+	    type >= CAP_TYPES || peer > (uint64_t)reader->nids || len > CAPTURE_DATA ||
+	    fread(record->data, 1, len, reader->in) != len)
+		return -1;
+
+	reader->ts += delta;
+	record->ts = reader->ts;
+	record->type = type;
+	record->peer = (int)peer - 1;
+	record->len = len;
+	record->data[len] = '\0';
+
+	return 0;
+}
+
+void
+capture_read_close(capture_reader_t *reader)
+{
+	int i;
+
+	if (reader->in)
+		fclose(reader->in);
+
+	free(reader->self);
+	for (i = 0; i < reader->nids; i++)
+		free(reader->ids[i]);
+	free(reader->ids);
+	memset(reader, 0, sizeof(*reader));
+}
+
+const char *
+capture_type(int type)
+{
+	return type >= 0 && type < CAP_TYPES ? types[type] : "?";
+}
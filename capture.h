@@ -0,0 +1,104 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Wire capture.  With -w every heartbeat datagram and every chat message
+ * a node sends or receives is appended to a binary trace:
+ *
+ *     "CHETCAP1"
+ *     <self id> <npeers> <peer id>...      ids as <len> <bytes>
+ *     records, each
+ *         <usec since the previous one> <type> <peer + 1, 0 unknown>
+ *         <len> <bytes>
+ *
+ * every number a varint (7 bits a byte, low first).  Timestamps are
+ * monotonic, peers go by their index in the peers file.  Messages are
+ * kept as frames (msg <text>, chan, fwd, exec; see delivery.h) without
+ * their sequencing header or newline, protocol lines (acks, credits,
+ * links...) are left out.
+ *
+ * chet2p-replay and chet2p-bench -T read traces back.
+ */
+
+#define CAPTURE_MAGIC "CHETCAP1"
+/* longest record payload */
+#define CAPTURE_DATA 1024
+
+enum {
+	CAP_UDP_IN,
+	CAP_UDP_OUT,
+	CAP_TCP_IN,
+	CAP_TCP_OUT,
+	CAP_TYPES
+};
+
+typedef struct {
+	/* usec since the capture started */
+	uint64_t ts;
+	int type;
+	/* -1 unknown */
+	int peer;
+	size_t len;
+	char data[CAPTURE_DATA + 1];
+} capture_record_t;
+
+typedef struct {
+	FILE *in;
+	char *self;
+	char **ids;
+	int nids;
+	uint64_t ts;
+} capture_reader_t;
+
+/* set while a capture is open, checked before building records */
+extern int capturing;
+
+/* -1 on error, errno tells */
+int
+capture_open(const char *path, const char *self, char **ids, int nids);
+
+void
+capture_close();
+
+void
+capture(int type, int peer, const char *data, size_t len);
+
+/* -1 if path is not a trace */
+int
+capture_read_open(capture_reader_t *reader, const char *path);
+
+/* the next record, data nul terminated; -1 at the end */
+int
+capture_next(capture_reader_t *reader, capture_record_t *record);
+
+void
+capture_read_close(capture_reader_t *reader);
+
+/* "udp in" and so on */
+const char *
+capture_type(int type);
+
+#endif /* _CAPTURE_H */
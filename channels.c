@@ -0,0 +1,231 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "bitset.h"
+#include "channels.h"
+#include "chatgui.h"
+#include "chet2p.h"
+#include "membership.h"
+
+typedef struct {
+	char name[CHANNEL_NAME];
+	int joined;
+	/* subscribed peers, by index */
+	uint64_t *subs;
+} channel_t;
+
+/* name -> channel_t, entries live as long as the process */
+static GHashTable *channels;
+/* the same, in creation order */
+static channel_t *channel_list[CHANNEL_MAX];
+static int nchannels;
+
+/* the main thread joins and publishes, reactors apply peers' lines */
+static pthread_mutex_t channels_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* NULL if unknown and not to be created or out of room, lock held */
+static channel_t *
+channel_lookup(const char *name, int create)
+{
+	channel_t *channel;
+
+	if (channels == NULL)
+		channels = g_hash_table_new(g_str_hash, g_str_equal);
+
+	channel = g_hash_table_lookup(channels, name);
+	if (channel || !create || nchannels == CHANNEL_MAX)
+		return channel;
+
+	channel = calloc(1, sizeof(channel_t));
+	strcpy(channel->name, name);
+	channel->subs = calloc(BITSET_WORDS(npeers) + 1, sizeof(uint64_t));
+	g_hash_table_insert(channels, channel->name, channel);
+	channel_list[nchannels++] = channel;
+
+	return channel;
+}
+
+int
+channel_valid(const char *name)
+{
+	size_t len = strlen(name);
+
+	if (name[0] != '#' || len < 2 || len >= CHANNEL_NAME)
+		return -1;
+
+	return strpbrk(name, " \t\r\n") ? -1 : 0;
+}
+
+int
+channel_join(const char *name)
+{
+	channel_t *channel;
+	int rc = -1;
+
+	pthread_mutex_lock(&channels_mutex);
+	channel = channel_lookup(name, TRUE);
+	if (channel && !channel->joined) {
+		channel->joined = TRUE;
+		rc = 0;
+	}
+	pthread_mutex_unlock(&channels_mutex);
+
+	return rc;
+}
+
+int
+channel_part(const char *name)
+{
+	channel_t *channel;
+	int rc = -1;
+
+	pthread_mutex_lock(&channels_mutex);
+	channel = channel_lookup(name, FALSE);
+	if (channel && channel->joined) {
+		channel->joined = FALSE;
+		rc = 0;
+	}
+	pthread_mutex_unlock(&channels_mutex);
+
+	return rc;
+}
+
+int
+channel_joined(const char *name)
+{
+	channel_t *channel;
+	int joined;
+
+	pthread_mutex_lock(&channels_mutex);
+	channel = channel_lookup(name, FALSE);
+	joined = channel && channel->joined;
+	pthread_mutex_unlock(&channels_mutex);
+
+	return joined;
+}
+
+int
+channel_targets(const char *name, const uint64_t *alive, uint64_t *targets)
+{
+	channel_t *channel;
+	int nwords = BITSET_WORDS(npeers);
+
+	pthread_mutex_lock(&channels_mutex);
+	channel = channel_lookup(name, FALSE);
+	if (channel)
+		bitset_and(targets, channel->subs, alive, nwords);
+	else
+		bitset_zero(targets, nwords);
+	pthread_mutex_unlock(&channels_mutex);
+
+	return bitset_count(targets, nwords);
+}
+
+void
+channel_subscribe(peer_info_t *peer_info, const char *name, int on)
+{
+	channel_t *channel;
+	char line[LINESIZE];
+
+	if (channel_valid(name) != 0)
+		return;
+
+	pthread_mutex_lock(&channels_mutex);
+	channel = channel_lookup(name, on);
+	if (channel && on)
+		bitset_set(channel->subs, peer_info->index);
+	else if (channel)
+		bitset_clear(channel->subs, peer_info->index);
+	pthread_mutex_unlock(&channels_mutex);
+
+	if (channel == NULL && on) {
+		snprintf(line, LINESIZE, "%s joined %s, too many channels to track it",
+			peer_info->id, name);
+		chat_writeln(TRUE, LOG_WARNING, line);
+	}
+#ifdef DEBUG
+	else {
+		snprintf(line, LINESIZE, "%s %s %s", peer_info->id,
+			on ? "joined" : "left", name);
+		chat_writeln(TRUE, LOG_DEBUG, line);
+	}
+#endif
+}
+
+void
+channel_forget(peer_info_t *peer_info)
+{
+	int i;
+
+	pthread_mutex_lock(&channels_mutex);
+	for (i = 0; i < nchannels; i++)
+		bitset_clear(channel_list[i]->subs, peer_info->index);
+	pthread_mutex_unlock(&channels_mutex);
+}
+
+buf_t *
+channel_announce()
+{
+	char data[CHANNEL_MAX * (CHANNEL_NAME + 5)];
+	size_t len = 0;
+	int i;
+
+	pthread_mutex_lock(&channels_mutex);
+	for (i = 0; i < nchannels; i++) {
+		if (channel_list[i]->joined)
+			len += sprintf(data + len, "sub %s\n", channel_list[i]->name);
+	}
+	pthread_mutex_unlock(&channels_mutex);
+
+	return len ? buf_from(data, len) : NULL;
+}
+
+void
+channel_status()
+{
+	const membership_t *membership;
+	channel_t *channel;
+	uint64_t *targets;
+	char buff[BUFFSIZE];
+	int i, nwords = BITSET_WORDS(npeers);
+
+	membership = membership_read();
+	targets = calloc(nwords + 1, sizeof(uint64_t));
+
+	pthread_mutex_lock(&channels_mutex);
+	for (i = 0; i < nchannels; i++) {
+		channel = channel_list[i];
+		bitset_and(targets, channel->subs, membership->alive, nwords);
+		snprintf(buff, BUFFSIZE, "[%s] %d subscribers, %d alive%s",
+			channel->name, bitset_count(channel->subs, nwords),
+			bitset_count(targets, nwords),
+			channel->joined ? ", joined" : "");
+		chat_writeln(FALSE, LOG_INFO, buff);
+	}
+	pthread_mutex_unlock(&channels_mutex);
+
+	free(targets);
+}
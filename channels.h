@@ -0,0 +1,81 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _CHANNELS_H
+#define _CHANNELS_H
+
+#include <stdint.h>
+
+#include "peers.h"
+#include "pool.h"
+
+/*
+ * Named channels ("#name").  Every node tracks who subscribes to each
+ * channel as a bitset over peer indices; publishing sends only to the
+ * subscribers that are alive, so its cost follows the subscribers and
+ * not the size of the cluster.
+ *
+ * Subscriptions ride the peer connections, as protocol lines:
+ *
+ *     sub <#name>             joined, sent to every peer on join and after
+ *     unsub <#name>           each id, so reconnecting peers catch up
+ *     chan <#name> <message>  a message published to the channel
+ *
+ * A peer identifying itself again starts afresh and announces its own.
+ */
+
+#define CHANNEL_NAME 32
+/* channels known, ours and our peers' */
+#define CHANNEL_MAX 256
+
+/* -1 if the name is not a channel */
+int
+channel_valid(const char *name);
+
+/* 0 if that changed our subscription: -1 when already joined (or out
+ * of room), resp. not joined */
+int
+channel_join(const char *name);
+
+int
+channel_part(const char *name);
+
+int
+channel_joined(const char *name);
+
+/* alive subscribers of name into targets, returns how many */
+int
+channel_targets(const char *name, const uint64_t *alive, uint64_t *targets);
+
+/* a sub or unsub line from peer_info */
+void
+channel_subscribe(peer_info_t *peer_info, const char *name, int on);
+
+/* peer_info identified itself again, it resends its subscriptions */
+void
+channel_forget(peer_info_t *peer_info);
+
+/* sub lines for all we joined, NULL if none */
+buf_t *
+channel_announce();
+
+/* one line per channel, for the status command */
+void
+channel_status();
+
+#endif /* _CHANNELS_H */
@@ -17,10 +17,16 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "chatgui.h"
+#include "chet2p.h"
+#include "history.h"
+#include "trace.h"
+
+int headless;
 
 char *prionames[] =
   {
@@ -45,6 +51,13 @@ init_gui()
 	char prompt[] = "> ";
 	WINDOW *chatp_window, *inputp_window;
 
+	pthread_mutex_init(&chatw_mutex, NULL);
+
+	if (headless) {
+		setvbuf(stdout, NULL, _IOLBF, 0);
+		return;
+	}
+
 	if (isatty(STDIN_FILENO) || isatty(STDOUT_FILENO) || isatty(STDERR_FILENO)) {
 		printf("\033c\033(K\033[J\033[0m\033[?25h");
 	}
@@ -94,22 +107,63 @@ init_gui()
 	wrefresh(inputp_window);
 	input_window = derwin(inputp_window, input_height, input_width,
 			      0, strlen(prompt) + 1);
+}
 
-	pthread_mutex_init(&chatw_mutex, NULL);
+void
+end_gui()
+{
+	if (!headless)
+		endwin();
 }
 
 void
 chat_repaint()
 {
+	if (headless)
+		return;
+
+	TRACE_BEGIN(repaint);
 	wrefresh(chat_window);
 	wrefresh(input_window);
+	TRACE_END(repaint);
+}
+
+int
+chat_readline(char *line, int size)
+{
+	char *eol;
+
+	if (headless) {
+		if (fgets(line, size, stdin) == NULL)
+			return -1;
+
+		if ((eol = strchr(line, '\n')))
+			*eol = '\0';
+		return 0;
+	}
+
+	werase(input_window);
+	wgetnstr(input_window, line, size - 1 < INPUTLEN ? size - 1 : INPUTLEN);
+	return 0;
 }
 
 void
 chat_writeln(int prefix, int priority, const char *line)
 {
 	int color_pair;
+
+	TRACE_BEGIN(chatw_mutex);
 	pthread_mutex_lock(&chatw_mutex);
+	TRACE_END(chatw_mutex);
+
+	if (headless) {
+		if (prefix)
+			printf("[%s] %s\n", prionames[priority], line);
+		else
+			printf("%s\n", line);
+		pthread_mutex_unlock(&chatw_mutex);
+		return;
+	}
 
 	if (priority > LOG_WARNING)
 		color_pair = COLOR_PAIR(1);
@@ -133,7 +187,17 @@ chat_writeln(int prefix, int priority, const char *line)
 void
 chat_message(const msgdir_t msgdir, const char *peer_id, const char *message)
 {
+	TRACE_BEGIN(chatw_mutex);
 	pthread_mutex_lock(&chatw_mutex);
+	TRACE_END(chatw_mutex);
+
+	history_add(msgdir, peer_id, message);
+
+	if (headless) {
+		printf("%s%s %s\n", msgdir == MSGDIR_OUT ? "> " : "", peer_id, message);
+		pthread_mutex_unlock(&chatw_mutex);
+		return;
+	}
 
 	waddch(chat_window, '\n');
 	if (msgdir == MSGDIR_OUT) {
@@ -32,12 +32,22 @@ typedef enum {
 pthread_mutex_t chatw_mutex;
 WINDOW *chat_window, *input_window;
 
+/* plain lines on stdin/stdout instead of curses, for scripts and benches */
+extern int headless;
+
 void
 init_gui();
 
+void
+end_gui();
+
 void
 chat_repaint();
 
+/* reads a command line without its newline, -1 on end of input */
+int
+chat_readline(char *line, int size);
+
 void
 chat_writeln(int prefix, int priority, const char *line);
 
@@ -17,6 +17,8 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netinet/in.h>
@@ -29,20 +31,24 @@
 #include <glib.h>
 #include <ncurses.h>
 
+#include "capture.h"
 #include "commands.h"
 #include "chatgui.h"
 #include "chet2p.h"
+#include "history.h"
+#include "mcast.h"
+#include "membership.h"
+#include "metrics.h"
 #include "peers.h"
+#include "reactor.h"
+#include "snapshot.h"
+#include "trace.h"
 
 pthread_t heartbeat_tid;
-pthread_t chatserver_tid;
 pthread_t main_tid;
 
-int chatsrvsk;
 int heartbtsk;
 
-const static char *leave = "leave\n";
-
 void
 cleanup();
 
@@ -58,7 +64,8 @@ sigint_handler(int sig)
 	chat_writeln(TRUE, LOG_INFO, "Handling SIGINT");
 	cleanup();
 
-	pthread_exit(EXIT_SUCCESS);
+	/* threads that missed the deadline don't hold the process */
+	exit(EXIT_SUCCESS);
 }
 
 void *
@@ -70,8 +77,11 @@ heartbeat(void *data)
 	size_t read;
 	char *pong = "pong\n";
 	char line[BUFFSIZE];
+	peer_info_t *peer_info;
 	int retval;
 
+	TRACE_THREAD("heartbeat");
+
 	memset(&srvaddr, 0, sizeof(srvaddr));
 	memset(&peeraddr, 0, sizeof(peeraddr));
 
@@ -109,158 +119,23 @@ heartbeat(void *data)
 			ntohs(peeraddr.sin_port));
 		chat_writeln(TRUE, LOG_INFO, line);
 #endif
+		capture(CAP_UDP_IN, -1, buffer, buffer[read - 1] ? read : read - 1);
 		if (strncmp(buffer, "ping", BUFFSIZE) == 0) {
+			metric_add(MC_HEARTBEAT_PINGS, 1);
 #ifdef DEBUG
 			chat_writeln(TRUE, LOG_INFO, "sending pong");
 #endif
 			sendto(heartbtsk, pong, 5, 0,
 				(struct sockaddr *)&peeraddr, skaddrl);
+			capture(CAP_UDP_OUT, -1, pong, 4);
 		}
-	}
-
-	return NULL;
-}
-
-void *
-chatclient(void *data)
-{
-	int sockfd = *(int *)data;
-	free(data);
-
-	peer_info_t *peer_info;
-	char line[LINESIZE];
-	char buffer[BUFFSIZE];
-	int nbytes;
-	char *command;
-
-	char *id;
-	int identified = 0;
-
-#ifdef DEBUG
-	struct sockaddr_storage peeraddr_stor;
-	socklen_t peeraddr_storl = sizeof(peeraddr_stor);
-	struct sockaddr_in *peeraddr;
-	char peeraddrs[INET_ADDRSTRLEN];
-	int port;
-
-	getpeername(sockfd, (struct sockaddr *)&peeraddr_stor, &peeraddr_storl);
-	peeraddr = (struct sockaddr_in *)&peeraddr_stor;
-	inet_ntop(AF_INET, &peeraddr->sin_addr, peeraddrs, sizeof(peeraddrs));
-	port = ntohs(peeraddr->sin_port);
-
-	snprintf(line, LINESIZE, "accepted tcp connection from anon@%s:%d, waiting for id",
-		peeraddrs, port);
-	chat_writeln(TRUE, LOG_DEBUG, line);
-#endif
-	while ((nbytes = read(sockfd, buffer, BUFFSIZE)) > 0) {
-		buffer[nbytes] = '\0';
-
-		if (buffer[nbytes - 1] == '\n')
-			buffer[nbytes - 1] = '\0';
-
-		if (!identified && strstr(buffer, "id") == buffer) {
-			id = buffer + 3;
-
-			peer_info = g_hash_table_lookup(peers_by_id, id);
-			if (peer_info) {
-				if (peer_info->client_tid && pthread_kill(peer_info->client_tid, 0) == 0) {
-					snprintf(line, LINESIZE, "%s is already connected\n", id);
-					write(sockfd, line, strlen(line));
-					identified = 0;
-					return NULL;
-				}
-
-				identified = 1;
-
-				peer_info->sockfd_tcp_in = sockfd;
-				peer_info->client_tid = pthread_self();
-				update_peer_status(peer_info, TRUE);
-#ifdef DEBUG
-				snprintf(line, LINESIZE, "tcp connection from %s:%d identified itself as %s",
-					peeraddrs, port, peer_info->id);
-				chat_writeln(TRUE, LOG_DEBUG, line);
-#endif
-				continue;
-			}
-			else {
-				snprintf(line, LINESIZE, "unregistered id %s\n", id);
-				write(sockfd, line, strlen(line));
-				identified = 0;
-			}
-		}
-
-		if (!identified) {
-			snprintf(line, LINESIZE, "please identify by sending: id <name>\n");
-			write(sockfd, line, strlen(line));
-			continue;
-		}
-
-		if (strstr(buffer, "leave") == buffer) {
-			shutdown(sockfd, 2);
-			break;
-		}
-		else if (strstr(buffer, "exec") == buffer) {
-			command = buffer + 5;
-			snprintf(line, LINESIZE, "exec %s", command);
-			chat_writeln(TRUE, LOG_NOTICE, line);
-			exec_command(command);
+		else if (strncmp(buffer, "leave ", 6) == 0 && buffer[read - 1] == '\0') {
+			/* nobody else gets to say a peer left */
+			peer_info = g_hash_table_lookup(peers_by_id, buffer + 6);
+			if (peer_info && peer_info->in_addr == peeraddr.sin_addr.s_addr)
+				node_receive(&self_node, peer_info->index,
+					&(node_msg_t){ .type = NODE_LEAVE });
 		}
-		else {
-			chat_message(MSGDIR_IN, peer_info->id, buffer);
-		}
-	}
-#ifdef DEBUG
-	snprintf(line, LINESIZE, "closing tcp connection from %s@%s:%d",
-		identified ? peer_info->id : "anon", peeraddrs, port);
-	chat_writeln(TRUE, LOG_DEBUG, line);
-#endif
-	if (peer_info)
-		update_peer_status(peer_info, FALSE);
-
-	return NULL;
-}
-
-void *
-chatserver(void *data)
-{
-	int connsk, optval;
-	struct sockaddr_in srvaddr;
-	char line[LINESIZE];
-	int *pconnsk;
-	pthread_t client_tid;
-	int retval;
-
-	chatsrvsk = socket(PF_INET, SOCK_STREAM, 0);
-	setsockopt(chatsrvsk, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
-
-	srvaddr.sin_family = AF_INET;
-	srvaddr.sin_addr.s_addr = self_info->in_addr;
-	srvaddr.sin_port = self_info->tcp_port;
-
-	retval = bind(chatsrvsk, (struct sockaddr *)&srvaddr, sizeof(srvaddr));
-	if (retval != 0) {
-		snprintf(line, BUFFSIZE, "error binding to tcp port %d, exiting",
-			ntohs(srvaddr.sin_port));
-		chat_writeln(TRUE, LOG_CRIT, line);
-		sleep(3);
-		pthread_kill(main_tid, SIGINT);
-		return NULL;
-	}
-
-	listen(chatsrvsk, 4);
-
-	snprintf(line, LINESIZE, "listening for tcp conns in %s:%d",
-		inet_ntoa(srvaddr.sin_addr),
-		ntohs(srvaddr.sin_port));
-	chat_writeln(TRUE, LOG_INFO, line);
-
-	while (TRUE) {
-		connsk = accept(chatsrvsk, NULL, NULL);
-
-		pconnsk = (int *)malloc(sizeof(int));
-		*pconnsk = connsk;
-
-		pthread_create(&client_tid, NULL, chatclient, pconnsk);
 	}
 
 	return NULL;
@@ -269,72 +144,141 @@ chatserver(void *data)
 void
 cleanup()
 {
-	GList *peers, *curpeer;
-	peer_info_t *peer_info;
-	struct sockaddr_in peeraddr;
+	struct timespec deadline;
 	char buffer[BUFFSIZE];
+	int i, stuck;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += SHUTDOWN_MS / 1000;
+	deadline.tv_nsec += SHUTDOWN_MS % 1000 * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
 
-	peers = g_hash_table_get_values(peers_by_id);
-
-	curpeer = peers;
-	while (curpeer) {
-		peer_info = curpeer->data;
-		pthread_cancel(peer_info->poller_tid);
-		pthread_join(peer_info->poller_tid, NULL);
+	/* while the view is still the one we had */
+	snapshot_stop();
 
-		pthread_cancel(peer_info->connect_tid);
-		pthread_join(peer_info->connect_tid, NULL);
+	/* every peer hears it before any connection goes down */
+	peers_leave();
+	mcast_stop();
 
-		pthread_cancel(peer_info->client_tid);
-		pthread_join(peer_info->client_tid, NULL);
+	/* everything is told to stop at once and waited for until the deadline */
+	for (i = 0; i < npeers; i++)
+		pthread_cancel(peers_table[i]->poller_tid);
+	pthread_cancel(heartbeat_tid);
 
-		peeraddr.sin_family = AF_INET;
-		peeraddr.sin_addr.s_addr = peer_info->in_addr;
-		peeraddr.sin_port = peer_info->udp_port;
+	stuck = reactors_stop(&deadline);
+	for (i = 0; i < npeers; i++) {
+		if (pthread_timedjoin_np(peers_table[i]->poller_tid, NULL, &deadline) != 0)
+			stuck++;
+	}
+	if (pthread_timedjoin_np(heartbeat_tid, NULL, &deadline) != 0)
+		stuck++;
+	if (history_stop(&deadline) != 0)
+		stuck++;
+	if (metrics_stop(&deadline) != 0)
+		stuck++;
+	close(heartbtsk);
 
-		sendto(peer_info->sockfd_udp, leave, strlen(leave), 0,
-			(struct sockaddr *)&peeraddr,
-			 sizeof(struct sockaddr_in));
-		close(peer_info->sockfd_udp);
+	membership_write_begin();
+	for (i = 0; i < npeers; i++)
+		MEMBERSHIP_SET(peers_table[i]->alive, FALSE);
+	membership_write_end();
 
-		close(peer_info->sockfd_tcp);
-		close(peer_info->sockfd_tcp_in);
+	for (i = 0; i < npeers; i++)
+		close(peers_table[i]->sockfd_udp);
 
-		snprintf(buffer, BUFFSIZE, "Leaving %s", peer_info->id);
+	for (i = 0; i < npeers; i++) {
+		snprintf(buffer, BUFFSIZE, "Leaving %s", peers_table[i]->id);
 		chat_writeln(TRUE, LOG_INFO, buffer);
-
-		curpeer = curpeer->next;
 	}
 
-	pthread_cancel(heartbeat_tid);
-	pthread_cancel(chatserver_tid);
-
-	close(heartbtsk);
-	close(chatsrvsk);
+	if (stuck) {
+		snprintf(buffer, BUFFSIZE, "%d threads still busy after %d ms, leaving anyway",
+			stuck, SHUTDOWN_MS);
+		chat_writeln(TRUE, LOG_WARNING, buffer);
+	}
 
-	pthread_join(heartbeat_tid, NULL);
-	pthread_join(chatserver_tid, NULL);
-	endwin();
+	capture_close();
+	end_gui();
 }
 
 int
 main(int argc, char *argv[])
 {
-	char line[INPUTLEN];
+	char line[BUFFSIZE];
 	char buff[BUFFSIZE];
 
 	char *peersfile;
 	struct stat st;
-	int rc;
+	int rc, opt;
+	long count = 1;
+	char *backend = NULL;
+	char *metrics = NULL;
+	char *capture_path = NULL;
+	char *snapshot_path = NULL;
+	char **ids;
+	int i;
 
 	sigset_t set;
 
-	if (argc < 3) {
-		fprintf(stderr, "Usage: %s <peers_file> <self_id>\n", argv[0]);
+	while ((opt = getopt(argc, argv, "b:c:Hl:m:r:s:t:w:")) != -1) {
+		switch (opt) {
+		case 'H':
+			headless = TRUE;
+			break;
+		case 'b':
+			backend = optarg;
+			break;
+		case 'c':
+			/* usec[:bytes] */
+			if (sscanf(optarg, "%d:%zu", &coalesce_usec, &coalesce_bytes) < 1 ||
+			    coalesce_usec < 0)
+				count = -1;
+			break;
+		case 'l':
+			/* msgs[:execs] per second and peer */
+			if (sscanf(optarg, "%lf:%lf", &rate_msgs, &rate_execs) < 1 ||
+			    rate_msgs < 0 || rate_execs < 0)
+				count = -1;
+			break;
+		case 'm':
+			metrics = optarg;
+			break;
+		case 'r':
+			/* 0 means one reactor per online cpu */
+			count = atoi(optarg);
+			if (count == 0)
+				count = sysconf(_SC_NPROCESSORS_ONLN);
+			break;
+		case 's':
+			snapshot_path = optarg;
+			break;
+		case 't':
+			if (strcmp(optarg, "tcp") == 0)
+				transport = TRANSPORT_TCP;
+			else if (strcmp(optarg, "unix") == 0)
+				transport = TRANSPORT_UNIX;
+			else if (strcmp(optarg, "shm") == 0)
+				transport = TRANSPORT_SHM;
+			else
+				count = -1;
+			break;
+		case 'w':
+			capture_path = optarg;
+			break;
+		default:
+			count = -1;
+		}
+	}
+
+	if (argc - optind < 2 || count < 1) {
+		fprintf(stderr, "Usage: %s [-H] [-b epoll|uring] [-c usec[:bytes]] [-l msgs[:execs]] [-m port|path] [-r reactors] [-s snapshot] [-t tcp|unix|shm] [-w capture] <peers_file> <self_id>\n", argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
-	peersfile = argv[1];
+	peersfile = argv[optind];
 	rc = stat(peersfile, &st);
 	if (rc == -1) {
 		if (errno == ENOENT) {
@@ -347,22 +291,44 @@ main(int argc, char *argv[])
 		}
 	}
 	self_info = NULL;
-	load_peers(peersfile, argv[2]);
+	load_peers(peersfile, argv[optind + 1]);
 	if (self_info == NULL) {
-		fprintf(stderr, "Can't find id %s in %s.\n", argv[2], peersfile);
+		fprintf(stderr, "Can't find id %s in %s.\n", argv[optind + 1], peersfile);
 		exit(EXIT_FAILURE);
 	}
+	if (snapshot_path)
+		snapshot_load(snapshot_path);
+
+	if (capture_path) {
+		ids = malloc(npeers * sizeof(char *));
+		for (i = 0; i < npeers; i++)
+			ids[i] = peers_table[i]->id;
+		if (capture_open(capture_path, self_info->id, ids, npeers) != 0) {
+			fprintf(stderr, "Can't write %s: %s\n", capture_path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		free(ids);
+	}
 
+	metrics_init();
 	init_gui();
+	history_start();
+
+	if (metrics)
+		metrics_serve(metrics);
 
 	main_tid = pthread_self();
+	TRACE_THREAD("main");
 
 	sigemptyset(&set);
 	sigaddset(&set, SIGINT);
 	pthread_sigmask(SIG_BLOCK, &set, NULL);
 
 	pthread_create(&heartbeat_tid, NULL, heartbeat, NULL);
-	pthread_create(&chatserver_tid, NULL, chatserver, NULL);
+	reactors_start(count, backend);
+	mcast_start();
+	if (snapshot_path)
+		snapshot_start(snapshot_path);
 
 	create_peers_poller();
 
@@ -373,17 +339,23 @@ main(int argc, char *argv[])
 	chat_writeln(TRUE, LOG_INFO, "Client ready...");
 
 	while(TRUE) {
-		werase(input_window);
-		wgetnstr(input_window, line, INPUTLEN);
+		/* end of input leaves too */
+		if (chat_readline(line, BUFFSIZE) != 0)
+			break;
 
 		if (strstr(line, "status") == line) {
 			chat_writeln(TRUE, LOG_INFO, "STATUS");
 			cmd_status();
 		}
+		else if (strstr(line, "stats") == line) {
+			chat_writeln(TRUE, LOG_INFO, "STATS");
+			cmd_stats();
+		}
+		else if (strstr(line, "leave #") == line) {
+			cmd_part(line + 5);
+		}
 		else if (strstr(line, "leave") == line) {
-			werase(input_window);
 			chat_writeln(TRUE, LOG_INFO, "Leaving...");
-			sleep(1);
 			break;
 		}
 		else if (strstr(line, "msg") == line) {
@@ -395,8 +367,23 @@ main(int argc, char *argv[])
 		else if (strstr(line, "exec") == line) {
 			cmd_exec(line + 4);
 		}
+		else if (strstr(line, "join") == line) {
+			cmd_join(line + 4);
+		}
+		else if (strstr(line, "pub") == line) {
+			cmd_publish(line + 3);
+		}
+		else if (strstr(line, "route") == line) {
+			cmd_route(line + 5);
+		}
+		else if (strstr(line, "search") == line) {
+			cmd_search(line + 6);
+		}
+		else if (strstr(line, "trace") == line) {
+			cmd_trace(line + 5);
+		}
 		else {
-			snprintf(buff, BUFFSIZE, "%s :unknown command", line);
+			snprintf(buff, BUFFSIZE, "%.*s :unknown command", INPUTLEN, line);
 			chat_writeln(TRUE, LOG_ERR, buff);
 		}
 	}
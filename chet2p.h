@@ -23,5 +23,11 @@
 #define INPUTLEN 80
 #define BUFFSIZE 255
 #define LINESIZE 255
+/* leaving never takes longer than this */
+#define SHUTDOWN_MS 1000
+
+#include <pthread.h>
+
+extern pthread_t main_tid;
 
 #endif /* _CHET2P_H */
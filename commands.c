@@ -17,63 +17,189 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
 #include <glib.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "bitset.h"
+#include "channels.h"
 #include "chatgui.h"
 #include "chet2p.h"
+#include "history.h"
+#include "mcast.h"
+#include "membership.h"
+#include "metrics.h"
 #include "peers.h"
+#include "pool.h"
+#include "reactor.h"
+#include "route.h"
+#include "trace.h"
 
 void
 cmd_status()
 {
-	GList *peers, *curpeer;
+	const membership_t *membership;
+	const member_t *member;
+	char buff[BUFFSIZE];
+	int i;
+
+	membership = membership_read();
+
+	for (i = 0; i < membership->nmembers; i++) {
+		member = &membership->members[i];
+
+		snprintf(buff, BUFFSIZE, "[%s] is %salive", member->peer->id,
+			member->alive ? "" : "not ");
+		chat_writeln(FALSE, LOG_INFO, buff);
+	}
+
+	channel_status();
+}
+
+/* by transport_t */
+static const char *transports[] = { "tcp", "unix", "shm" };
+
+void
+cmd_stats()
+{
+	pool_stats_t stats;
+	histogram_t lines, execs;
 	peer_info_t *peer_info;
+	unsigned long sent, writes, kept;
+	const delivery_t *delivery;
+	size_t bytes;
 	char buff[BUFFSIZE];
+	int i;
+
+	for (i = 0; i < npools; i++) {
+		pool_stats(pools[i], &stats);
+
+		snprintf(buff, BUFFSIZE, "pool %s: %lu allocs, %lu frees, %lu in use, %lu/%lu free, %lu slabs",
+			pools[i]->name, stats.allocs, stats.frees,
+			stats.allocs - stats.frees,
+			stats.capacity - (stats.allocs - stats.frees), stats.capacity,
+			stats.slabs);
+		chat_writeln(FALSE, LOG_INFO, buff);
+	}
+
+	metric_hist_read(MH_LINE_NS, &lines);
+	metric_hist_read(MH_EXEC_US, &execs);
+	snprintf(buff, BUFFSIZE, "%lu pings answered, %lu conns accepted, %lu lines p99 %luns, %lu execs p99 %luus",
+		metric_read(MC_HEARTBEAT_PINGS), metric_read(MC_CONNS_ACCEPTED),
+		metric_read(MC_LINES), (unsigned long)histogram_percentile(&lines, 99),
+		metric_read(MC_EXECS), (unsigned long)histogram_percentile(&execs, 99));
+	chat_writeln(FALSE, LOG_INFO, buff);
+
+	history_usage(&kept, &bytes);
+	snprintf(buff, BUFFSIZE, "history: %lu msgs kept in %lu KB, %lu indexed, %lu dropped",
+		kept, (unsigned long)(bytes / 1024),
+		metric_read(MC_HISTORY_INDEXED), metric_read(MC_HISTORY_DROPPED));
+	chat_writeln(FALSE, LOG_INFO, buff);
 
-	peers = g_hash_table_get_values(peers_by_id);
-	curpeer = peers;
+	if (mcast_enabled) {
+		snprintf(buff, BUFFSIZE, "multicast: %lu datagrams sent, %lu received, %lu nacks, %lu repairs, %lu lost",
+			metric_read(MC_MCAST_SENT), metric_read(MC_MCAST_RECEIVED),
+			metric_read(MC_MCAST_NACKS), metric_read(MC_MCAST_REPAIRS),
+			metric_read(MC_MCAST_LOST));
+		chat_writeln(FALSE, LOG_INFO, buff);
+	}
+
+	for (i = 0; i < npeers; i++) {
+		peer_info = peers_table[i];
+
+		snprintf(buff, BUFFSIZE, "[%s] %lu pings, %lu lost, rtt p50 %luus p99 %luus, %lu connects, over %s",
+			peer_info->id,
+			metric_peer_read(peer_info, MP_PINGS),
+			metric_peer_read(peer_info, MP_PINGS_LOST),
+			(unsigned long)histogram_percentile(&peer_info->ping_rtt, 50),
+			(unsigned long)histogram_percentile(&peer_info->ping_rtt, 99),
+			metric_peer_read(peer_info, MP_CONNECTS),
+			transports[metric_peer_read(peer_info, MP_TRANSPORT)]);
+		chat_writeln(FALSE, LOG_INFO, buff);
+
+		sent = metric_peer_read(peer_info, MP_MSGS_SENT);
+		writes = metric_peer_read(peer_info, MP_WRITES);
+		snprintf(buff, BUFFSIZE, "[%s] %lu msgs sent in %lu packets, %.2f msgs/packet, %lu bytes",
+			peer_info->id, sent, writes,
+			writes ? (double)sent / writes : 0.0,
+			metric_peer_read(peer_info, MP_BYTES_SENT));
+		chat_writeln(FALSE, LOG_INFO, buff);
+
+		snprintf(buff, BUFFSIZE, "[%s] %lu msgs and %lu execs received, %lu bytes",
+			peer_info->id,
+			metric_peer_read(peer_info, MP_MSGS_RECEIVED),
+			metric_peer_read(peer_info, MP_EXECS_RECEIVED),
+			metric_peer_read(peer_info, MP_BYTES_RECEIVED));
+		chat_writeln(FALSE, LOG_INFO, buff);
 
-	while (curpeer) {
-		peer_info = curpeer->data;
+		snprintf(buff, BUFFSIZE, "[%s] %lu msgs dropped, %lu execs dropped, %lu msgs throttled",
+			peer_info->id,
+			metric_peer_read(peer_info, MP_MSGS_DROPPED),
+			metric_peer_read(peer_info, MP_EXECS_DROPPED),
+			metric_peer_read(peer_info, MP_MSGS_THROTTLED));
+		chat_writeln(FALSE, LOG_INFO, buff);
 
-		snprintf(buff, BUFFSIZE, "[%s] is %salive", peer_info->id,
-			peer_info->alive ? "" : "not ");
+		snprintf(buff, BUFFSIZE, "[%s] queued: %lu bytes, %lu pending, %lu unacked",
+			peer_info->id,
+			metric_peer_read(peer_info, MP_OUTQ_BYTES),
+			metric_peer_read(peer_info, MP_PENDING),
+			metric_peer_read(peer_info, MP_UNACKED));
 		chat_writeln(FALSE, LOG_INFO, buff);
 
-		curpeer = curpeer->next;
+		delivery = &peer_info->delivery;
+		snprintf(buff, BUFFSIZE, "[%s] %lu msgs acked, latency p50 %luus p99 %luus, rtt %luus, %lu resent, %lu dups",
+			peer_info->id,
+			__atomic_load_n(&delivery->acked, __ATOMIC_RELAXED),
+			(unsigned long)histogram_percentile(&delivery->latency, 50),
+			(unsigned long)histogram_percentile(&delivery->latency, 99),
+			__atomic_load_n(&delivery->rtt, __ATOMIC_RELAXED),
+			__atomic_load_n(&delivery->resent, __ATOMIC_RELAXED),
+			__atomic_load_n(&delivery->dups, __ATOMIC_RELAXED));
+		chat_writeln(FALSE, LOG_INFO, buff);
 	}
 }
 
-void
-send_message(const peer_info_t *peer_info, const char *message)
+static void
+send_buf(const member_t *member, buf_t *buf)
 {
-	ssize_t writec;
 	char buff[BUFFSIZE];
 
-	if (!peer_info->alive) {
-		snprintf(buff, BUFFSIZE, "%s :not alive", peer_info->id);
+	if (!member->alive) {
+		snprintf(buff, BUFFSIZE, "%s :not alive", member->peer->id);
 		chat_writeln(TRUE, LOG_ERR, buff);
 		return;
 	}
 
-	writec = write(peer_info->sockfd_tcp, message, strlen(message));
-	if (writec == strlen(message)) {
-		chat_message(MSGDIR_OUT, &peer_info->id[0], &message[0]);
-	}
-	else {
-		snprintf(buff, BUFFSIZE, "error sending message: %d bytes sent", (int)writec);
+	if (!member->connected) {
+		snprintf(buff, BUFFSIZE, "%s :not connected", member->peer->id);
 		chat_writeln(TRUE, LOG_ERR, buff);
+		return;
 	}
+
+	/* the peer's reactor does the write and echoes the message */
+	reactor_send(member->peer, buf);
+}
+
+void
+send_message(const member_t *member, const char *message)
+{
+	buf_t *buf;
+
+	buf = buf_line(message);
+	buf->frame = strncmp(message, "exec ", 5) == 0;
+	send_buf(member, buf);
+	buf_unref(buf);
 }
 
 void
 _cmd_message(const char *peer_id, const char *message)
 {
 	char line[LINESIZE];
-	peer_info_t *peer_info = NULL;
+	peer_info_t *peer_info = NULL, *next;
 
 	if (strncmp(self_info->id, peer_id, BUFFSIZE) == 0) {
 		chat_writeln(TRUE, LOG_ERR, "That's myself...");
@@ -87,14 +213,44 @@ _cmd_message(const char *peer_id, const char *message)
 		return;
 	}
 
-	send_message(peer_info, message);
+	/* no usable direct link, execs only ever go direct */
+	next = route_next(peer_info);
+	if (next && next != peer_info && strstr(message, "exec") != message) {
+		route_send(peer_info, next, message);
+		chat_message(MSGDIR_OUT, peer_info->id, message);
+		return;
+	}
+
+	send_message(&membership_read()->members[peer_info->index], message);
+}
+
+void
+broadcast_message(const char *message)
+{
+	const membership_t *membership;
+	buf_t *buf;
+	int i;
+
+	/* one datagram whatever the size of the cluster */
+	if (mcast_enabled) {
+		mcast_broadcast(message);
+		return;
+	}
+
+	membership = membership_read();
+
+	/* every peer queues a reference to the same buffer */
+	buf = buf_line(message);
+	for (i = 0; i < membership->nmembers; i++) {
+		if (membership->members[i].alive)
+			send_buf(&membership->members[i], buf);
+	}
+	buf_unref(buf);
 }
 
 void
 cmd_message(const char *line)
 {
-	GList *peers, *curpeer;
-	peer_info_t *peer_info;
 	int argc;
 	char peer_id[BUFFSIZE], message[BUFFSIZE];
 
@@ -106,16 +262,7 @@ cmd_message(const char *line)
 
 	if (strstr(&peer_id[0], "-b") == &peer_id[0]) {
 		chat_writeln(TRUE, LOG_INFO, "Broadcasting");
-
-		peers = g_hash_table_get_values(peers_by_id);
-		curpeer = peers;
-
-		while (curpeer) {
-			peer_info = curpeer->data;
-			if (peer_info->alive)
-				send_message(peer_info, message);
-			curpeer = curpeer->next;
-		}
+		broadcast_message(message);
 	}
 	else
 		_cmd_message(peer_id, message);
@@ -139,8 +286,6 @@ cmd_exec(const char *line)
 
 void
 cmd_broadcast(const char *line) {
-	GList *peers, *curpeer;
-	peer_info_t *peer_info;
 	int argc;
 	char message[BUFFSIZE];
 
@@ -150,13 +295,211 @@ cmd_broadcast(const char *line) {
 		return;
 	}
 
-	peers = g_hash_table_get_values(peers_by_id);
-	curpeer = peers;
+	broadcast_message(message);
+}
+
+void
+cmd_trace(const char *line)
+{
+	char what[BUFFSIZE], path[BUFFSIZE], buff[BUFFSIZE];
+	int argc, seconds = TRACE_SECONDS;
+
+	argc = sscanf(line, "%s %d %s", what, &seconds, path);
+	if (argc < 1 || strcmp(what, "dump") != 0 || seconds < 1) {
+		chat_writeln(TRUE, LOG_ERR, "Usage: trace dump [seconds] [file]");
+		return;
+	}
+#ifndef TRACE
+	chat_writeln(TRUE, LOG_ERR, "tracing is not built in, rebuild with make T=1");
+	return;
+#endif
+	if (argc < 3)
+		snprintf(path, BUFFSIZE, "chet2p-%s-%d.json", self_info->id, getpid());
+
+	if (trace_dump(path, seconds) != 0) {
+		snprintf(buff, BUFFSIZE, "error writing %.200s: %s", path, strerror(errno));
+		chat_writeln(TRUE, LOG_ERR, buff);
+		return;
+	}
+
+	snprintf(buff, BUFFSIZE, "last %ds of trace written to %.200s", seconds, path);
+	chat_writeln(TRUE, LOG_INFO, buff);
+}
+
+/* tells every peer we are connected to, the rest learns on connecting */
+static void
+channel_tell(const char *verb, const char *channel)
+{
+	const membership_t *membership;
+	char line[LINESIZE];
+	buf_t *buf;
+	int i;
+
+	membership = membership_read();
+
+	snprintf(line, LINESIZE, "%s %s", verb, channel);
+	buf = buf_line(line);
+	for (i = 0; i < membership->nmembers; i++) {
+		if (membership->members[i].alive)
+			reactor_control(membership->members[i].peer, buf);
+	}
+	buf_unref(buf);
+}
+
+void
+cmd_join(const char *line)
+{
+	char channel[BUFFSIZE], buff[BUFFSIZE];
+
+	if (sscanf(line, "%s", channel) < 1 || channel_valid(channel) != 0) {
+		chat_writeln(TRUE, LOG_ERR, "Usage: join <#channel>");
+		return;
+	}
+
+	if (channel_join(channel) != 0) {
+		snprintf(buff, BUFFSIZE, "%.*s :already joined or too many channels", CHANNEL_NAME, channel);
+		chat_writeln(TRUE, LOG_ERR, buff);
+		return;
+	}
+
+	channel_tell("sub", channel);
+	snprintf(buff, BUFFSIZE, "Joined %.*s", CHANNEL_NAME, channel);
+	chat_writeln(TRUE, LOG_INFO, buff);
+}
+
+void
+cmd_part(const char *line)
+{
+	char channel[BUFFSIZE], buff[BUFFSIZE];
+
+	if (sscanf(line, "%s", channel) < 1 || channel_valid(channel) != 0) {
+		chat_writeln(TRUE, LOG_ERR, "Usage: leave <#channel>");
+		return;
+	}
+
+	if (channel_part(channel) != 0) {
+		snprintf(buff, BUFFSIZE, "%.*s :not joined", CHANNEL_NAME, channel);
+		chat_writeln(TRUE, LOG_ERR, buff);
+		return;
+	}
+
+	channel_tell("unsub", channel);
+	snprintf(buff, BUFFSIZE, "Left %.*s", CHANNEL_NAME, channel);
+	chat_writeln(TRUE, LOG_INFO, buff);
+}
 
-	while (curpeer) {
-		peer_info = curpeer->data;
-		if (peer_info->alive)
-			send_message(peer_info, message);
-		curpeer = curpeer->next;
+void
+cmd_publish(const char *line)
+{
+	const membership_t *membership;
+	char channel[BUFFSIZE], message[BUFFSIZE], buff[BUFFSIZE];
+	uint64_t *targets;
+	buf_t *buf;
+	int i, len, nwords = BITSET_WORDS(npeers);
+
+	if (sscanf(line, "%s %[^\n]", channel, message) < 2 ||
+	    channel_valid(channel) != 0) {
+		chat_writeln(TRUE, LOG_ERR, "Usage: pub <#channel> <message>");
+		return;
 	}
+
+	membership = membership_read();
+	targets = calloc(nwords + 1, sizeof(uint64_t));
+
+	if (channel_targets(channel, membership->alive, targets) == 0) {
+		snprintf(buff, BUFFSIZE, "%.*s :no one alive subscribes to it", CHANNEL_NAME, channel);
+		chat_writeln(TRUE, LOG_ERR, buff);
+		free(targets);
+		return;
+	}
+
+	/* what doesn't fit after the header isn't sent, nor echoed */
+	len = snprintf(buff, BUFFSIZE, "chan %.*s ", CHANNEL_NAME, channel);
+	if (strlen(message) > BUFFSIZE - 1 - len)
+		message[BUFFSIZE - 1 - len] = '\0';
+	strcpy(buff + len, message);
+
+	/* only subscribers are walked, a copy each, echoed once below */
+	buf = buf_line(buff);
+	buf->frame = TRUE;
+	for (i = bitset_next(targets, nwords, 0); i >= 0;
+	     i = bitset_next(targets, nwords, i + 1)) {
+		if (membership->members[i].connected)
+			reactor_publish(membership->members[i].peer, buf);
+	}
+	buf_unref(buf);
+	free(targets);
+
+	chat_message(MSGDIR_OUT, channel, message);
+}
+
+void
+cmd_route(const char *line)
+{
+	char peer_id[BUFFSIZE], buff[BUFFSIZE];
+	peer_info_t *peer_info, **path;
+	uint64_t rtt;
+	int hops, i, len;
+
+	if (sscanf(line, "%s", peer_id) < 1) {
+		chat_writeln(TRUE, LOG_ERR, "Usage: route <id>");
+		return;
+	}
+
+	peer_info = g_hash_table_lookup(peers_by_id, peer_id);
+	if (peer_info == NULL) {
+		snprintf(buff, BUFFSIZE, "%.200s :unknown id", peer_id);
+		chat_writeln(TRUE, LOG_ERR, buff);
+		return;
+	}
+
+	path = calloc(npeers, sizeof(peer_info_t *));
+	hops = route_path(peer_info, path, npeers, &rtt);
+	if (hops < 0) {
+		snprintf(buff, BUFFSIZE, "%s :no route", peer_info->id);
+		chat_writeln(TRUE, LOG_ERR, buff);
+		free(path);
+		return;
+	}
+
+	len = snprintf(buff, BUFFSIZE, "%s", self_info->id);
+	for (i = 0; i < hops && len < BUFFSIZE; i++)
+		len += snprintf(buff + len, BUFFSIZE - len, " -> %s", path[i]->id);
+	if (len < BUFFSIZE)
+		snprintf(buff + len, BUFFSIZE - len, ", %d hop%s, rtt %luus", hops,
+			hops > 1 ? "s" : "", (unsigned long)rtt);
+	chat_writeln(FALSE, LOG_INFO, buff);
+	free(path);
+}
+
+void
+cmd_search(const char *line)
+{
+	char (*lines)[LINESIZE];
+	char buff[BUFFSIZE];
+	struct timespec start, end;
+	int found, i;
+
+	lines = malloc(HISTORY_RESULTS * LINESIZE);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	found = history_search(line, lines, HISTORY_RESULTS);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (found < 0) {
+		chat_writeln(TRUE, LOG_ERR, "Usage: search <words> [from:<id>]");
+		free(lines);
+		return;
+	}
+
+	/* oldest first, the newest ends up next to the prompt */
+	for (i = (found < HISTORY_RESULTS ? found : HISTORY_RESULTS) - 1; i >= 0; i--)
+		chat_writeln(FALSE, LOG_INFO, lines[i]);
+
+	snprintf(buff, BUFFSIZE, "%s%d matches in %.2f ms",
+		found > HISTORY_RESULTS ? "newest " : "",
+		found > HISTORY_RESULTS ? HISTORY_RESULTS : found,
+		(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+	chat_writeln(TRUE, LOG_INFO, buff);
+	free(lines);
 }
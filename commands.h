@@ -23,6 +23,9 @@
 void
 cmd_status();
 
+void
+cmd_stats();
+
 void
 cmd_message(const char *line);
 
@@ -32,4 +35,28 @@ cmd_exec(const char *line);
 void
 cmd_broadcast(const char *line);
 
+/* join <#channel> */
+void
+cmd_join(const char *line);
+
+/* leave <#channel> */
+void
+cmd_part(const char *line);
+
+/* pub <#channel> <message>, to the channel's alive subscribers */
+void
+cmd_publish(const char *line);
+
+/* route <id>, the path a message to id takes and its rtt */
+void
+cmd_route(const char *line);
+
+/* trace dump [seconds] [file] */
+void
+cmd_trace(const char *line);
+
+/* search <words> [from:<id>], the newest messages holding them all */
+void
+cmd_search(const char *line);
+
 #endif /* _COMMANDS_H */
@@ -0,0 +1,226 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "delivery.h"
+
+uint64_t
+delivery_clock()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+void
+delivery_init(delivery_t *delivery)
+{
+	memset(delivery, 0, sizeof(delivery_t));
+	delivery->next_seq = delivery->una = 1;
+}
+
+int
+delivery_full(const delivery_t *delivery)
+{
+	return delivery->next_seq - delivery->una == SEQ_WINDOW;
+}
+
+buf_t *
+delivery_send(delivery_t *delivery, buf_t *payload)
+{
+	unacked_t *entry;
+	uint64_t seq;
+
+	seq = delivery->next_seq++;
+	entry = &delivery->unacked[seq % SEQ_WINDOW];
+	entry->sent = delivery_clock();
+	entry->sacked = 0;
+	entry->payload = buf_ref(payload);
+	entry->header = buf_new();
+	/* chat goes as a msg frame, the receiver never looks into its text */
+	entry->header->len = snprintf(entry->header->data, BUF_DATA, "seq %lu %lu %s",
+		(unsigned long)seq, (unsigned long)entry->sent, payload->frame ? "" : "msg ");
+
+	return entry->header;
+}
+
+static int
+delivery_sacked(const delivery_t *delivery, uint64_t seq)
+{
+	uint64_t bit = seq - delivery->cum - 1;
+
+	return (delivery->sack[bit / 64] >> (bit % 64)) & 1;
+}
+
+int
+delivery_receive(delivery_t *delivery, uint64_t seq, uint64_t ts)
+{
+	uint64_t bit, word;
+	int i;
+
+	/* beyond what we can track, the sender never goes that far */
+	if (seq > delivery->cum + SEQ_WINDOW)
+		return -1;
+
+	delivery->ack_pending = 1;
+
+	if (seq <= delivery->cum || delivery_sacked(delivery, seq)) {
+		__atomic_add_fetch(&delivery->dups, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	delivery->echo = ts;
+
+	bit = seq - delivery->cum - 1;
+	delivery->sack[bit / 64] |= 1ULL << (bit % 64);
+
+	/* slide the window over the now contiguous prefix */
+	while (delivery->sack[0] & 1) {
+		delivery->cum++;
+		for (i = 0; i < SEQ_WINDOW / 64; i++) {
+			word = delivery->sack[i] >> 1;
+			if (i + 1 < SEQ_WINDOW / 64)
+				word |= delivery->sack[i + 1] << 63;
+			delivery->sack[i] = word;
+		}
+	}
+
+	return 0;
+}
+
+void
+delivery_sync(delivery_t *delivery, uint64_t epoch, uint64_t una)
+{
+	if (delivery->epoch == epoch)
+		return;
+
+	/*
+	 * the peer restarted, its numbering starts over; or we did, and
+	 * everything before una was acked by our previous run
+	 */
+	delivery->epoch = epoch;
+	delivery->cum = una ? una - 1 : 0;
+	delivery->echo = 0;
+	memset(delivery->sack, 0, sizeof(delivery->sack));
+}
+
+int
+delivery_ack_line(delivery_t *delivery, char *line, size_t size)
+{
+	uint64_t seq, start = 0;
+	int len, ranges = 0;
+
+	delivery->ack_pending = 0;
+
+	len = snprintf(line, size, "ack %lu %lu %lu", (unsigned long)delivery->epoch,
+		(unsigned long)delivery->cum, (unsigned long)delivery->echo);
+
+	for (seq = delivery->cum + 1; seq <= delivery->cum + SEQ_WINDOW + 1; seq++) {
+		if (seq <= delivery->cum + SEQ_WINDOW && delivery_sacked(delivery, seq)) {
+			if (start == 0)
+				start = seq;
+			continue;
+		}
+
+		if (start && ranges < SACK_RANGES && len < (int)size) {
+			len += snprintf(line + len, size - len, " %lu-%lu",
+				(unsigned long)start, (unsigned long)seq - 1);
+			ranges++;
+		}
+		start = 0;
+	}
+
+	if (len < (int)size - 1) {
+		line[len++] = '\n';
+		line[len] = '\0';
+	}
+
+	return len;
+}
+
+static void
+delivery_sample(delivery_t *delivery, unacked_t *entry, uint64_t now)
+{
+	histogram_record(&delivery->latency, now - entry->sent);
+	__atomic_add_fetch(&delivery->acked, 1, __ATOMIC_RELAXED);
+}
+
+int
+delivery_acked(delivery_t *delivery, const char *args)
+{
+	unsigned long cum, echo, first, last;
+	uint64_t seq, now, rtt;
+	unacked_t *entry;
+	char *end;
+	int n = 0;
+
+	if (sscanf(args, "%lu %lu", &cum, &echo) != 2)
+		return 0;
+
+	now = delivery_clock();
+
+	if (echo && echo <= now) {
+		rtt = __atomic_load_n(&delivery->rtt, __ATOMIC_RELAXED);
+		rtt = rtt ? (7 * rtt + (now - echo)) / 8 : now - echo;
+		__atomic_store_n(&delivery->rtt, rtt, __ATOMIC_RELAXED);
+	}
+
+	while (delivery->una <= cum && delivery->una < delivery->next_seq) {
+		entry = &delivery->unacked[delivery->una % SEQ_WINDOW];
+		if (!entry->sacked)
+			delivery_sample(delivery, entry, now);
+
+		buf_unref(entry->header);
+		buf_unref(entry->payload);
+		delivery->una++;
+		n++;
+	}
+
+	/* selective ranges, after cum and echo */
+	args = strchr(args, ' ');
+	args = args ? strchr(args + 1, ' ') : NULL;
+	while (args && *args) {
+		first = strtoul(args, &end, 10);
+		if (end == args || *end != '-')
+			break;
+		last = strtoul(end + 1, &end, 10);
+		args = end;
+
+		/* the peer picks the bounds, only what is in flight counts */
+		if (first < delivery->una)
+			first = delivery->una;
+		if (last >= delivery->next_seq)
+			last = delivery->next_seq - 1;
+
+		for (seq = first; seq <= last; seq++) {
+			entry = &delivery->unacked[seq % SEQ_WINDOW];
+			if (!entry->sacked) {
+				entry->sacked = 1;
+				delivery_sample(delivery, entry, now);
+			}
+		}
+	}
+
+	return n;
+}
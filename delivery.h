@@ -0,0 +1,108 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DELIVERY_H
+#define _DELIVERY_H
+
+#include <stdint.h>
+
+#include "histogram.h"
+#include "pool.h"
+
+/*
+ * Sequenced delivery between two peers.  Every message we send a peer
+ * gets the next sequence number of our epoch (process start time) and a
+ * send timestamp, and stays queued until the peer acks it.  The peer
+ * acks cumulatively plus a few selective ranges beyond the cumulative
+ * point, echoing the newest timestamp it saw.  State lives in the peer,
+ * not the connection, so after a reconnect the unacked tail is resent
+ * and the receiver drops what it already had.
+ *
+ * Wire format, one line each:
+ *     seq <n> <ts> <frame>              data
+ *     sync <epoch> <una>                sender's epoch and oldest unacked
+ *                                       seq, once per conn
+ *     ack <epoch> <cum> <echo> [a-b]... acks for epoch's messages
+ *
+ * A frame says what it carries: msg <text> for chat, whose text is never
+ * parsed, or one of our own chan, fwd and exec lines (see reactor.h).
+ */
+
+#define SEQ_WINDOW 128
+#define SACK_RANGES 8
+
+typedef struct {
+	uint64_t sent;
+	buf_t *header;
+	buf_t *payload;
+	int sacked;
+} unacked_t;
+
+typedef struct {
+	/* sending side: [una, next_seq) are in flight */
+	uint64_t next_seq;
+	uint64_t una;
+	unacked_t unacked[SEQ_WINDOW];
+
+	/* receiving side, for the peer's current epoch */
+	uint64_t epoch;
+	uint64_t cum;
+	uint64_t sack[SEQ_WINDOW / 64];
+	uint64_t echo;
+	int ack_pending;
+
+	/* written by the peer's reactor, read with relaxed atomics */
+	histogram_t latency;
+	unsigned long acked;
+	unsigned long resent;
+	unsigned long dups;
+	unsigned long rtt;
+} delivery_t;
+
+/* usec since boot */
+uint64_t
+delivery_clock();
+
+void
+delivery_init(delivery_t *delivery);
+
+int
+delivery_full(const delivery_t *delivery);
+
+/* queues payload, returns the header to send in front of it */
+buf_t *
+delivery_send(delivery_t *delivery, buf_t *payload);
+
+/* a data frame arrived, 0 if new, -1 if it has to be dropped */
+int
+delivery_receive(delivery_t *delivery, uint64_t seq, uint64_t ts);
+
+/* the sender's epoch and the oldest seq it still waits an ack for, 0 if unknown */
+void
+delivery_sync(delivery_t *delivery, uint64_t epoch, uint64_t una);
+
+/* formats the pending ack, newline included */
+int
+delivery_ack_line(delivery_t *delivery, char *line, size_t size);
+
+/* handles "<cum> <echo> [a-b]...", returns how many left the window */
+int
+delivery_acked(delivery_t *delivery, const char *args);
+
+#endif /* _DELIVERY_H */
@@ -0,0 +1,106 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "histogram.h"
+
+static int
+histogram_index(uint64_t value)
+{
+	int exp;
+
+	if (value < HIST_SUB)
+		return value;
+
+	exp = 63 - __builtin_clzll(value);
+	if (exp >= HIST_BITS)
+		return HIST_BUCKETS - 1;
+
+	return (exp - HIST_SUB_BITS + 1) * HIST_SUB +
+		((value >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* largest value that falls in bucket idx */
+static uint64_t
+histogram_value(int idx)
+{
+	int exp, sub;
+
+	if (idx < HIST_SUB)
+		return idx;
+
+	exp = idx / HIST_SUB + HIST_SUB_BITS - 1;
+	sub = idx % HIST_SUB;
+
+	return ((uint64_t)(HIST_SUB + sub + 1) << (exp - HIST_SUB_BITS)) - 1;
+}
+
+/* plain adds, nobody else writes; relaxed stores keep readers tear free */
+void
+histogram_record(histogram_t *hist, uint64_t value)
+{
+	int idx = histogram_index(value);
+
+	__atomic_store_n(&hist->counts[idx], hist->counts[idx] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->sum, hist->sum + value, __ATOMIC_RELAXED);
+}
+
+void
+histogram_merge(histogram_t *into, const histogram_t *hist)
+{
+	int i;
+
+	into->count += __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+	into->sum += __atomic_load_n(&hist->sum, __ATOMIC_RELAXED);
+	for (i = 0; i < HIST_BUCKETS; i++)
+		into->counts[i] += __atomic_load_n(&hist->counts[i], __ATOMIC_RELAXED);
+}
+
+uint64_t
+histogram_percentile(const histogram_t *hist, double p)
+{
+	unsigned long count, seen = 0;
+	double rank;
+	int i;
+
+	count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+	if (count == 0)
+		return 0;
+
+	rank = count * p / 100;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += __atomic_load_n(&hist->counts[i], __ATOMIC_RELAXED);
+		if (seen >= rank && seen > 0)
+			return histogram_value(i);
+	}
+
+	return histogram_value(HIST_BUCKETS - 1);
+}
+
+unsigned long
+histogram_count_below(const histogram_t *hist, uint64_t bound)
+{
+	unsigned long count = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS && histogram_value(i) < bound; i++)
+		count += __atomic_load_n(&hist->counts[i], __ATOMIC_RELAXED);
+
+	return count;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * Log-linear histogram: every power of two range is split in HIST_SUB
+ * equal buckets, so any recorded value is off by at most 1/HIST_SUB.
+ * Values up to 2^HIST_BITS, larger ones land in the last bucket.  A
+ * single thread records, any thread may read; histograms written by
+ * several threads are kept one per thread and merged when read.
+ */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BITS 40
+#define HIST_BUCKETS ((HIST_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+	unsigned long count;
+	unsigned long sum;
+	unsigned long counts[HIST_BUCKETS];
+} histogram_t;
+
+void
+histogram_record(histogram_t *hist, uint64_t value);
+
+/* adds what hist holds to into, which the caller owns */
+void
+histogram_merge(histogram_t *into, const histogram_t *hist);
+
+/* p in [0, 100], 0 when empty */
+uint64_t
+histogram_percentile(const histogram_t *hist, double p);
+
+/* values recorded below bound, exact when bound is a power of two */
+unsigned long
+histogram_count_below(const histogram_t *hist, uint64_t bound);
+
+#endif /* _HISTOGRAM_H */
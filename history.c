@@ -0,0 +1,619 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "history.h"
+#include "metrics.h"
+#include "peers.h"
+#include "spsc.h"
+#include "trace.h"
+
+/* messages indexed per write lock, searches get in between */
+#define HISTORY_BATCH 256
+/* a posting block starts this small and doubles up to HISTORY_BLOCK */
+#define HISTORY_BLOCK_MIN 8
+/* charged per allocation on top of its size */
+#define HISTORY_OVERHEAD 16
+
+#define HISTORY_WORD(c) \
+	(((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || \
+	 ((c) >= '0' && (c) <= '9') || (c) >= 0x80)
+
+/* as handed over by chat_message */
+typedef struct {
+	time_t ts;
+	msgdir_t dir;
+	char peer[HISTORY_PEER];
+	char text[BUFFSIZE];
+} hentry_t;
+
+/*
+ * messages first to first + count - 1, each at data + offsets[i] as its
+ * time, direction, peer and text, the last two nul terminated
+ */
+typedef struct {
+	uint32_t first;
+	uint32_t count;
+	int cap;
+	uint32_t *offsets;
+	size_t used;
+	char data[HISTORY_SEGMENT];
+} hseg_t;
+
+/* n ids, first then len bytes of varint deltas up to last */
+typedef struct {
+	uint32_t first;
+	uint32_t last;
+	uint16_t n;
+	uint16_t len;
+	uint16_t cap;
+	uint8_t data[];
+} hblock_t;
+
+typedef struct {
+	/* oldest first */
+	hblock_t **blocks;
+	int nblocks;
+	int cap;
+	uint32_t count;
+	/* in postings */
+	size_t index;
+	char token[];
+} posting_t;
+
+/* walks a posting list backwards, one decoded block at a time */
+typedef struct {
+	posting_t *posting;
+	int block;
+	int n;
+	uint32_t ids[HISTORY_BLOCK + 1];
+} cursor_t;
+
+static spsc_t history_queue;
+static int history_evfd = -1;
+static int history_sleeping;
+static int history_running;
+static pthread_t history_tid;
+
+/* everything below is written by the indexer only, under the lock */
+static pthread_rwlock_t history_lock = PTHREAD_RWLOCK_INITIALIZER;
+static hseg_t **segs;
+static int nsegs, capsegs;
+/* ids start at 1, 0 is none */
+static uint32_t history_next = 1;
+static GHashTable *tokens;
+static posting_t **postings;
+static size_t npostings, cappostings;
+static size_t history_bytes;
+
+static void
+history_grow(void **array, int *cap, size_t elemsize, int min)
+{
+	int old = *cap;
+
+	*cap = old ? old * 2 : min;
+	*array = realloc(*array, *cap * elemsize);
+	history_bytes += (*cap - old) * elemsize;
+}
+
+/* lowercased token of s from *pos on into token, 0 at the end */
+static int
+history_token(const char *s, size_t *pos, char *token)
+{
+	const unsigned char *p = (const unsigned char *)s + *pos;
+	int len = 0;
+
+	while (*p && !HISTORY_WORD(*p))
+		p++;
+	for (; *p && HISTORY_WORD(*p); p++) {
+		if (len < HISTORY_TOKEN - 1)
+			token[len++] = (*p >= 'A' && *p <= 'Z') ? *p - 'A' + 'a' : *p;
+	}
+	token[len] = '\0';
+
+	*pos = (const char *)p - s;
+	return len;
+}
+
+static int
+varint_put(uint8_t *data, uint32_t value)
+{
+	int n = 0;
+
+	while (value >= 0x80) {
+		data[n++] = value | 0x80;
+		value >>= 7;
+	}
+	data[n++] = value;
+
+	return n;
+}
+
+static int
+block_ids(const hblock_t *block, uint32_t *ids)
+{
+	uint32_t id = block->first, delta;
+	int i = 0, n = 0, shift;
+	uint8_t b;
+
+	ids[n++] = id;
+	while (i < block->len) {
+		delta = 0;
+		shift = 0;
+		do {
+			b = block->data[i++];
+			delta |= (uint32_t)(b & 0x7f) << shift;
+			shift += 7;
+		} while (b & 0x80);
+		id += delta;
+		ids[n++] = id;
+	}
+
+	return n;
+}
+
+static posting_t *
+posting_get(const char *token)
+{
+	posting_t *posting;
+	size_t len;
+
+	posting = g_hash_table_lookup(tokens, token);
+	if (posting)
+		return posting;
+
+	len = strlen(token) + 1;
+	posting = calloc(1, sizeof(posting_t) + len);
+	memcpy(posting->token, token, len);
+	history_bytes += sizeof(posting_t) + len + 2 * HISTORY_OVERHEAD;
+
+	if (npostings == cappostings) {
+		cappostings = cappostings ? cappostings * 2 : 1024;
+		postings = realloc(postings, cappostings * sizeof(posting_t *));
+	}
+	posting->index = npostings;
+	postings[npostings++] = posting;
+	g_hash_table_insert(tokens, posting->token, posting);
+
+	return posting;
+}
+
+static void
+posting_add(posting_t *posting, uint32_t id)
+{
+	hblock_t *block = NULL;
+	uint8_t varint[5];
+	int n = 0, cap;
+
+	if (posting->nblocks) {
+		block = posting->blocks[posting->nblocks - 1];
+		/* the token came up before in this message */
+		if (block->last == id)
+			return;
+		n = varint_put(varint, id - block->last);
+	}
+
+	if (block == NULL || block->len + n > HISTORY_BLOCK) {
+		if (posting->nblocks == posting->cap)
+			history_grow((void **)&posting->blocks, &posting->cap,
+				sizeof(hblock_t *), 1);
+
+		block = malloc(sizeof(hblock_t) + HISTORY_BLOCK_MIN);
+		block->first = block->last = id;
+		block->n = 1;
+		block->len = 0;
+		block->cap = HISTORY_BLOCK_MIN;
+		posting->blocks[posting->nblocks++] = block;
+		history_bytes += sizeof(hblock_t) + HISTORY_BLOCK_MIN + HISTORY_OVERHEAD;
+		posting->count++;
+		return;
+	}
+
+	if (block->len + n > block->cap) {
+		cap = block->cap * 2 < HISTORY_BLOCK ? block->cap * 2 : HISTORY_BLOCK;
+		block = realloc(block, sizeof(hblock_t) + cap);
+		history_bytes += cap - block->cap;
+		block->cap = cap;
+		posting->blocks[posting->nblocks - 1] = block;
+	}
+
+	memcpy(block->data + block->len, varint, n);
+	block->len += n;
+	block->last = id;
+	block->n++;
+	posting->count++;
+}
+
+static void
+posting_free(posting_t *posting)
+{
+	history_bytes -= posting->cap * sizeof(hblock_t *) +
+		sizeof(posting_t) + strlen(posting->token) + 1 + 2 * HISTORY_OVERHEAD;
+
+	g_hash_table_remove(tokens, posting->token);
+	postings[posting->index] = postings[--npostings];
+	postings[posting->index]->index = posting->index;
+
+	free(posting->blocks);
+	free(posting);
+}
+
+/* frees the blocks holding nothing from oldest on */
+static void
+posting_prune(posting_t *posting, uint32_t oldest)
+{
+	hblock_t *block;
+	int i;
+
+	for (i = 0; i < posting->nblocks && posting->blocks[i]->last < oldest; i++) {
+		block = posting->blocks[i];
+		posting->count -= block->n;
+		history_bytes -= sizeof(hblock_t) + block->cap + HISTORY_OVERHEAD;
+		free(block);
+	}
+
+	if (i == 0)
+		return;
+
+	posting->nblocks -= i;
+	memmove(posting->blocks, posting->blocks + i, posting->nblocks * sizeof(hblock_t *));
+	if (posting->nblocks == 0)
+		posting_free(posting);
+}
+
+static hseg_t *
+history_segment()
+{
+	hseg_t *seg;
+
+	if (nsegs == capsegs)
+		history_grow((void **)&segs, &capsegs, sizeof(hseg_t *), 16);
+
+	seg = malloc(sizeof(hseg_t));
+	seg->first = history_next;
+	seg->count = 0;
+	seg->cap = 0;
+	seg->offsets = NULL;
+	seg->used = 0;
+	segs[nsegs++] = seg;
+	history_bytes += sizeof(hseg_t) + HISTORY_OVERHEAD;
+
+	return seg;
+}
+
+/* the oldest segment goes, and every block left holding only its ids */
+static void
+history_evict()
+{
+	hseg_t *seg = segs[0];
+	size_t i;
+
+	history_bytes -= sizeof(hseg_t) + seg->cap * sizeof(uint32_t) + 2 * HISTORY_OVERHEAD;
+	free(seg->offsets);
+	free(seg);
+	nsegs--;
+	memmove(segs, segs + 1, nsegs * sizeof(hseg_t *));
+
+	/* pruning may move the last posting into slot i */
+	for (i = npostings; i > 0; i--)
+		posting_prune(postings[i - 1], segs[0]->first);
+}
+
+static uint32_t
+history_store(const hentry_t *entry)
+{
+	size_t plen = strlen(entry->peer) + 1, tlen = strlen(entry->text) + 1;
+	size_t len = sizeof(time_t) + 1 + plen + tlen;
+	hseg_t *seg = nsegs ? segs[nsegs - 1] : NULL;
+	char *rec;
+
+	if (seg == NULL || seg->used + len > HISTORY_SEGMENT)
+		seg = history_segment();
+
+	if (seg->count == seg->cap)
+		history_grow((void **)&seg->offsets, &seg->cap, sizeof(uint32_t), 256);
+
+	rec = seg->data + seg->used;
+	memcpy(rec, &entry->ts, sizeof(time_t));
+	rec[sizeof(time_t)] = entry->dir;
+	memcpy(rec + sizeof(time_t) + 1, entry->peer, plen);
+	memcpy(rec + sizeof(time_t) + 1 + plen, entry->text, tlen);
+
+	seg->offsets[seg->count++] = seg->used;
+	seg->used += len;
+
+	return history_next++;
+}
+
+static void
+history_index(const hentry_t *entry)
+{
+	char token[HISTORY_TOKEN];
+	uint32_t id;
+	size_t pos = 0;
+
+	id = history_store(entry);
+
+	snprintf(token, HISTORY_TOKEN, "from:%.*s", HISTORY_TOKEN - 6,
+		entry->dir == MSGDIR_OUT ? self_info->id : entry->peer);
+	posting_add(posting_get(token), id);
+
+	while (history_token(entry->text, &pos, token))
+		posting_add(posting_get(token), id);
+}
+
+static void *
+history_indexer(void *data)
+{
+	hentry_t entry;
+	uint64_t counter;
+	int n;
+
+	TRACE_THREAD("history");
+
+	while (__atomic_load_n(&history_running, __ATOMIC_RELAXED)) {
+		pthread_rwlock_wrlock(&history_lock);
+		for (n = 0; n < HISTORY_BATCH && spsc_pop(&history_queue, &entry) == 0; n++)
+			history_index(&entry);
+		metric_add(MC_HISTORY_INDEXED, n);
+		while (history_bytes > HISTORY_BUDGET && nsegs > 1)
+			history_evict();
+		pthread_rwlock_unlock(&history_lock);
+
+		if (n == HISTORY_BATCH)
+			continue;
+
+		/* pairs with the fence in history_add */
+		__atomic_store_n(&history_sleeping, TRUE, __ATOMIC_SEQ_CST);
+		if (spsc_empty(&history_queue))
+			read(history_evfd, &counter, sizeof(counter));
+		__atomic_store_n(&history_sleeping, FALSE, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+void
+history_start()
+{
+	tokens = g_hash_table_new(g_str_hash, g_str_equal);
+	spsc_init(&history_queue, HISTORY_QUEUE, sizeof(hentry_t));
+	history_evfd = eventfd(0, 0);
+
+	history_running = TRUE;
+	pthread_create(&history_tid, NULL, history_indexer, NULL);
+}
+
+int
+history_stop(const struct timespec *deadline)
+{
+	uint64_t one = 1;
+
+	if (history_evfd < 0)
+		return 0;
+
+	__atomic_store_n(&history_running, FALSE, __ATOMIC_RELAXED);
+	write(history_evfd, &one, sizeof(one));
+
+	return pthread_timedjoin_np(history_tid, NULL, deadline) == 0 ? 0 : -1;
+}
+
+void
+history_add(msgdir_t dir, const char *peer_id, const char *message)
+{
+	hentry_t entry;
+	uint64_t one = 1;
+
+	if (history_evfd < 0)
+		return;
+
+	entry.ts = time(NULL);
+	entry.dir = dir;
+	snprintf(entry.peer, HISTORY_PEER, "%s", peer_id);
+	snprintf(entry.text, BUFFSIZE, "%s", message);
+
+	/* history is best effort, the chat window is not held up */
+	if (spsc_push(&history_queue, &entry) != 0) {
+		metric_add(MC_HISTORY_DROPPED, 1);
+		return;
+	}
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&history_sleeping, __ATOMIC_RELAXED))
+		write(history_evfd, &one, sizeof(one));
+}
+
+/* the newest id in the posting list not above id, 0 if none */
+static uint32_t
+cursor_floor(cursor_t *cursor, uint32_t id)
+{
+	posting_t *posting = cursor->posting;
+	int lo = 0, hi = posting->nblocks - 1, mid, b = -1;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (posting->blocks[mid]->first <= id) {
+			b = mid;
+			lo = mid + 1;
+		}
+		else {
+			hi = mid - 1;
+		}
+	}
+
+	if (b < 0)
+		return 0;
+	if (posting->blocks[b]->last <= id)
+		return posting->blocks[b]->last;
+
+	if (b != cursor->block) {
+		cursor->n = block_ids(posting->blocks[b], cursor->ids);
+		cursor->block = b;
+	}
+
+	lo = 0;
+	hi = cursor->n - 1;
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (cursor->ids[mid] <= id)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return cursor->ids[lo];
+}
+
+static void
+history_format(uint32_t id, char *line)
+{
+	int lo = 0, hi = nsegs - 1, mid;
+	const char *rec, *peer;
+	char stamp[32];
+	struct tm tm;
+	time_t ts;
+	hseg_t *seg;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (segs[mid]->first <= id)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	seg = segs[lo];
+
+	rec = seg->data + seg->offsets[id - seg->first];
+	memcpy(&ts, rec, sizeof(time_t));
+	peer = rec + sizeof(time_t) + 1;
+
+	localtime_r(&ts, &tm);
+	strftime(stamp, sizeof(stamp), "%m-%d %H:%M:%S", &tm);
+	snprintf(line, LINESIZE, "%s %s%s %s", stamp,
+		rec[sizeof(time_t)] == MSGDIR_OUT ? "> " : "", peer,
+		peer + strlen(peer) + 1);
+}
+
+/* from:<id> as it is, anything else split into tokens */
+static int
+history_terms(const char *query, char terms[HISTORY_TERMS][HISTORY_TOKEN])
+{
+	char word[BUFFSIZE], token[HISTORY_TOKEN];
+	int nterms = 0, i, n;
+	size_t pos;
+
+	while (nterms < HISTORY_TERMS && sscanf(query, " %254s%n", word, &n) == 1) {
+		query += n;
+
+		if (strncmp(word, "from:", 5) == 0 && word[5]) {
+			snprintf(terms[nterms++], HISTORY_TOKEN, "%.*s", HISTORY_TOKEN - 1, word);
+			continue;
+		}
+
+		pos = 0;
+		while (nterms < HISTORY_TERMS && history_token(word, &pos, token)) {
+			for (i = 0; i < nterms && strcmp(terms[i], token) != 0; i++)
+				;
+			if (i == nterms)
+				strcpy(terms[nterms++], token);
+		}
+	}
+
+	return nterms;
+}
+
+int
+history_search(const char *query, char (*lines)[LINESIZE], int max)
+{
+	char terms[HISTORY_TERMS][HISTORY_TOKEN];
+	cursor_t cursors[HISTORY_TERMS], tmp;
+	uint32_t id, oldest, floor = 0;
+	int nterms, found = 0, i, j;
+
+	nterms = history_terms(query, terms);
+	if (nterms == 0)
+		return -1;
+
+	pthread_rwlock_rdlock(&history_lock);
+
+	for (i = 0; i < nterms; i++) {
+		cursors[i].posting = g_hash_table_lookup(tokens, terms[i]);
+		cursors[i].block = -1;
+		if (cursors[i].posting == NULL) {
+			pthread_rwlock_unlock(&history_lock);
+			return 0;
+		}
+
+		/* the rarest term leads, the others are only probed */
+		for (j = i; j > 0 && cursors[j - 1].posting->count > cursors[j].posting->count; j--) {
+			tmp = cursors[j];
+			cursors[j] = cursors[j - 1];
+			cursors[j - 1] = tmp;
+		}
+	}
+
+	/* ids below oldest linger in blocks shared with newer ones */
+	oldest = nsegs ? segs[0]->first : history_next;
+	id = history_next - 1;
+
+	while (id >= oldest && id > 0 && found <= max) {
+		for (i = 0; i < nterms; i++) {
+			floor = cursor_floor(&cursors[i], id);
+			if (floor != id)
+				break;
+		}
+
+		if (i < nterms) {
+			/* nothing between floor and id holds term i */
+			id = floor;
+			continue;
+		}
+
+		if (found < max)
+			history_format(id, lines[found]);
+		found++;
+		id--;
+	}
+
+	pthread_rwlock_unlock(&history_lock);
+
+	return found;
+}
+
+void
+history_usage(unsigned long *messages, size_t *bytes)
+{
+	pthread_rwlock_rdlock(&history_lock);
+	*messages = nsegs ? history_next - segs[0]->first : 0;
+	*bytes = history_bytes;
+	pthread_rwlock_unlock(&history_lock);
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HISTORY_H
+#define _HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "chatgui.h"
+#include "chet2p.h"
+
+/*
+ * Chat history and its full text index.  Every message shown is handed
+ * to the indexing thread through a ring, HISTORY_QUEUE deep and dropped
+ * from history when full, so showing a message never waits for it.  The
+ * thread numbers messages in order, appends them to the store and adds
+ * each id to the posting list of its tokens (lowercased runs of letters
+ * and digits, any non-ascii byte counts as a letter) and of from:<id>,
+ * the sender.
+ *
+ * Posting lists are delta encoded varints in blocks of up to
+ * HISTORY_BLOCK bytes, each tagged with the first and last id in it, so
+ * a search walks them newest first and skips whole blocks while it
+ * intersects.  Store and index share a memory budget: over it, the
+ * oldest segment of messages goes, and with it the blocks left holding
+ * only its ids.
+ */
+
+#define HISTORY_QUEUE 4096
+#define HISTORY_BUDGET (64 * 1024 * 1024)
+#define HISTORY_SEGMENT (1024 * 1024)
+#define HISTORY_BLOCK 128
+#define HISTORY_TOKEN 32
+#define HISTORY_PEER 64
+#define HISTORY_TERMS 8
+#define HISTORY_RESULTS 20
+
+void
+history_start();
+
+/* waits for the indexing thread until deadline, -1 if it didn't stop */
+int
+history_stop(const struct timespec *deadline);
+
+/* called by chat_message, under chatw_mutex */
+void
+history_add(msgdir_t dir, const char *peer_id, const char *message);
+
+/*
+ * the newest messages holding every term of query (words, from:<id>),
+ * formatted one per line; returns how many, max + 1 if there are more,
+ * -1 if the query has no terms
+ */
+int
+history_search(const char *query, char (*lines)[LINESIZE], int max);
+
+/* messages kept and bytes used by store and index */
+void
+history_usage(unsigned long *messages, size_t *bytes);
+
+#endif /* _HISTORY_H */
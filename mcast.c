@@ -0,0 +1,489 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "chatgui.h"
+#include "chet2p.h"
+#include "mcast.h"
+#include "metrics.h"
+#include "reactor.h"
+#include "trace.h"
+
+typedef struct {
+	uint64_t seq;
+	/* the sender no longer had it */
+	int gone;
+	char text[BUFFSIZE];
+} mcast_entry_t;
+
+/* what we know about a sender's broadcasts */
+typedef struct {
+	uint64_t epoch;
+	/* next one to deliver, 0 until we hear from this epoch */
+	uint64_t next;
+	/* newest the sender told us about, highest we asked for */
+	uint64_t last;
+	uint64_t nacked;
+	uint64_t heard;
+	/* given up on since the last one delivered */
+	unsigned long lost;
+	/* held out of order, slot seq % MCAST_WINDOW */
+	mcast_entry_t *window;
+} mcast_peer_t;
+
+int mcast_enabled;
+
+static struct sockaddr_in mcast_addr;
+static int mcast_ttl = MCAST_TTL;
+static int mcastsk = -1;
+static pthread_t mcast_tid;
+
+/* ours, slot seq % MCAST_HISTORY */
+static mcast_entry_t history[MCAST_HISTORY];
+static uint64_t mcast_seq;
+
+/* by peer index */
+static mcast_peer_t *mcast_peers;
+
+/* shared by the receiving thread and the reactors handling repairs */
+static pthread_mutex_t mcast_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int
+mcast_config(const char *group, const char *port, const char *ttl)
+{
+	if (group == NULL || port == NULL)
+		return -1;
+
+	memset(&mcast_addr, 0, sizeof(mcast_addr));
+	mcast_addr.sin_family = AF_INET;
+	if (inet_aton(group, &mcast_addr.sin_addr) == 0 ||
+	    !IN_MULTICAST(ntohl(mcast_addr.sin_addr.s_addr)))
+		return -1;
+
+	mcast_addr.sin_port = htons(atoi(port));
+	if (ttl)
+		mcast_ttl = atoi(ttl);
+
+	mcast_enabled = TRUE;
+	return 0;
+}
+
+static void
+mcast_send(const char *datagram, size_t len)
+{
+	TRACE_BEGIN(mcast_send);
+	sendto(mcastsk, datagram, len, 0, (struct sockaddr *)&mcast_addr,
+		sizeof(mcast_addr));
+	TRACE_END(mcast_send);
+	metric_add(MC_MCAST_SENT, 1);
+	capture(CAP_UDP_OUT, -1, datagram, len && datagram[len - 1] == '\n' ? len - 1 : len);
+}
+
+static void
+mcast_heartbeat()
+{
+	char datagram[LINESIZE];
+	int len;
+
+	len = snprintf(datagram, LINESIZE, "hb %s %lu %lu\n", self_info->id,
+		(unsigned long)self_epoch,
+		(unsigned long)__atomic_load_n(&mcast_seq, __ATOMIC_RELAXED));
+	mcast_send(datagram, len);
+}
+
+void
+mcast_broadcast(const char *message)
+{
+	char datagram[WIRE_LINE];
+	mcast_entry_t *entry;
+	uint64_t seq;
+	int len;
+
+	pthread_mutex_lock(&mcast_mutex);
+	seq = mcast_seq + 1;
+	entry = &history[seq % MCAST_HISTORY];
+	entry->seq = seq;
+	snprintf(entry->text, BUFFSIZE, "%s", message);
+	__atomic_store_n(&mcast_seq, seq, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&mcast_mutex);
+
+	len = snprintf(datagram, WIRE_LINE, "bcast %s %lu %lu %s\n", self_info->id,
+		(unsigned long)self_epoch, (unsigned long)seq, message);
+	mcast_send(datagram, len);
+
+	chat_message(MSGDIR_OUT, "*", message);
+}
+
+uint64_t
+mcast_heard(const peer_info_t *peer_info)
+{
+	return __atomic_load_n(&mcast_peers[peer_info->index].heard, __ATOMIC_RELAXED);
+}
+
+/* a sender heard from in a new epoch is followed from first on, -1 if stale */
+static int
+mcast_sync(mcast_peer_t *mp, uint64_t epoch, uint64_t first)
+{
+	if (epoch < mp->epoch)
+		return -1;
+	if (epoch == mp->epoch && mp->next)
+		return 0;
+
+	mp->epoch = epoch;
+	mp->next = first;
+	mp->last = first - 1;
+	mp->nacked = first - 1;
+	if (mp->window)
+		memset(mp->window, 0, MCAST_WINDOW * sizeof(mcast_entry_t));
+
+	return 0;
+}
+
+/* hands over held broadcasts from next on, up to the first missing */
+static void
+mcast_flush(peer_info_t *peer_info, mcast_peer_t *mp)
+{
+	mcast_entry_t *entry;
+
+	char line[LINESIZE];
+
+	while ((entry = &mp->window[mp->next % MCAST_WINDOW])->seq == mp->next) {
+		mp->next++;
+		if (entry->gone) {
+			mp->lost++;
+			continue;
+		}
+
+		if (mp->lost) {
+			metric_add(MC_MCAST_LOST, mp->lost);
+			snprintf(line, LINESIZE, "lost %lu broadcasts from %s", mp->lost, peer_info->id);
+			chat_writeln(TRUE, LOG_WARNING, line);
+			mp->lost = 0;
+		}
+
+		metric_peer_add(peer_info, MP_MSGS_RECEIVED, 1);
+		chat_message(MSGDIR_IN, peer_info->id, entry->text);
+	}
+}
+
+/* with mcast_mutex held, text is NULL when the sender no longer has it */
+static void
+mcast_accept(peer_info_t *peer_info, mcast_peer_t *mp, uint64_t seq, const char *text)
+{
+	mcast_entry_t *entry;
+	uint64_t start;
+
+	if (seq > mp->last)
+		mp->last = seq;
+	if (seq < mp->next)
+		return;
+
+	if (mp->window == NULL)
+		mp->window = calloc(MCAST_WINDOW, sizeof(mcast_entry_t));
+
+	/* too far ahead, give up on the oldest missing ones */
+	start = mp->next;
+	while (seq - mp->next >= MCAST_WINDOW && mp->next - start < MCAST_WINDOW) {
+		entry = &mp->window[mp->next % MCAST_WINDOW];
+		if (entry->seq == mp->next)
+			mcast_flush(peer_info, mp);
+		else {
+			mp->next++;
+			mp->lost++;
+		}
+	}
+
+	/* a whole window walked and nothing held beyond it, skip the rest at once */
+	if (seq - mp->next >= MCAST_WINDOW) {
+		mp->lost += seq - MCAST_WINDOW + 1 - mp->next;
+		mp->next = seq - MCAST_WINDOW + 1;
+	}
+
+	entry = &mp->window[seq % MCAST_WINDOW];
+	entry->seq = seq;
+	entry->gone = text == NULL;
+	if (text)
+		snprintf(entry->text, BUFFSIZE, "%s", text);
+
+	mcast_flush(peer_info, mp);
+}
+
+/* formats a nack for what is missing up to seq, 0 if nothing is */
+static int
+mcast_nack(mcast_peer_t *mp, uint64_t upto, int again, char *line)
+{
+	uint64_t from;
+
+	from = again || mp->nacked < mp->next ? mp->next : mp->nacked + 1;
+	if (upto < from)
+		return 0;
+
+	if (upto - from >= MCAST_REPAIR)
+		upto = from + MCAST_REPAIR - 1;
+	if (upto > mp->nacked)
+		mp->nacked = upto;
+
+	return snprintf(line, LINESIZE, "nack %lu %lu %lu", (unsigned long)mp->epoch,
+		(unsigned long)from, (unsigned long)upto);
+}
+
+static void
+mcast_send_nack(peer_info_t *peer_info, const char *nack)
+{
+	buf_t *buf;
+
+	if (nack[0] == '\0')
+		return;
+
+	metric_add(MC_MCAST_NACKS, 1);
+	buf = buf_line(nack);
+	reactor_control(peer_info, buf);
+	buf_unref(buf);
+}
+
+static void
+mcast_receive(char *datagram, const struct sockaddr_in *from)
+{
+	char kind[8], id[BUFFSIZE], nack[LINESIZE];
+	unsigned long epoch, seq;
+	peer_info_t *peer_info;
+	mcast_peer_t *mp;
+	char *args;
+	int off;
+
+	datagram[strcspn(datagram, "\n")] = '\0';
+	if (sscanf(datagram, "%7s %254s %n", kind, id, &off) < 2)
+		return;
+
+	/* our own come back too, and so would anybody's spoofing a peer */
+	peer_info = g_hash_table_lookup(peers_by_id, id);
+	if (peer_info == NULL || peer_info->in_addr != from->sin_addr.s_addr)
+		return;
+
+	args = datagram + off;
+	mp = &mcast_peers[peer_info->index];
+	__atomic_store_n(&mp->heard, delivery_clock(), __ATOMIC_RELAXED);
+
+	if (strcmp(kind, "leave") == 0) {
+		__atomic_store_n(&mp->heard, 0, __ATOMIC_RELAXED);
+		update_peer_status(peer_info, FALSE);
+		return;
+	}
+
+	nack[0] = '\0';
+	pthread_mutex_lock(&mcast_mutex);
+
+	if (strcmp(kind, "hb") == 0 &&
+	    sscanf(args, "%lu %lu", &epoch, &seq) == 2 &&
+	    mcast_sync(mp, epoch, seq + 1) == 0) {
+		if (seq > mp->last)
+			mp->last = seq;
+		/* asks again for anything still missing */
+		mcast_nack(mp, seq, TRUE, nack);
+	}
+	else if (strcmp(kind, "bcast") == 0 &&
+		 sscanf(args, "%lu %lu %n", &epoch, &seq, &off) == 2 &&
+		 mcast_sync(mp, epoch, seq) == 0) {
+		mcast_nack(mp, seq - 1, FALSE, nack);
+		mcast_accept(peer_info, mp, seq, args + off);
+	}
+
+	pthread_mutex_unlock(&mcast_mutex);
+
+	/* not under the mutex, the reactor may be waiting for it */
+	mcast_send_nack(peer_info, nack);
+}
+
+static void *
+mcast_run(void *data)
+{
+	char datagram[WIRE_LINE + 1];
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	struct pollfd pfd;
+	uint64_t now, next_hb = 0;
+	ssize_t len;
+
+	TRACE_THREAD("mcast");
+
+	pfd.fd = mcastsk;
+	pfd.events = POLLIN;
+
+	while (TRUE) {
+		now = delivery_clock();
+		if (now >= next_hb) {
+			mcast_heartbeat();
+			next_hb = now + self_node.probe_ms * 1000ULL;
+		}
+
+		if (poll(&pfd, 1, (next_hb - now) / 1000 + 1) <= 0)
+			continue;
+
+		fromlen = sizeof(from);
+		len = recvfrom(mcastsk, datagram, WIRE_LINE, MSG_DONTWAIT,
+			(struct sockaddr *)&from, &fromlen);
+		if (len <= 0)
+			continue;
+
+		datagram[len] = '\0';
+		metric_add(MC_MCAST_RECEIVED, 1);
+		capture(CAP_UDP_IN, -1, datagram, datagram[len - 1] == '\n' ? len - 1 : len);
+
+		/* never cancelled holding the mutex */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		mcast_receive(datagram, &from);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	}
+
+	return NULL;
+}
+
+void
+mcast_start()
+{
+	struct ip_mreq mreq;
+	struct in_addr ifaddr;
+	unsigned char ttl, loop = 1;
+	char line[LINESIZE];
+	int one = 1;
+
+	if (!mcast_enabled)
+		return;
+
+	mcast_peers = calloc(npeers ? npeers : 1, sizeof(mcast_peer_t));
+
+	mreq.imr_multiaddr = mcast_addr.sin_addr;
+	mreq.imr_interface.s_addr = self_info->in_addr;
+	ifaddr.s_addr = self_info->in_addr;
+	ttl = mcast_ttl;
+
+	/* co-located nodes all bind the group, each gets a copy */
+	mcastsk = socket(PF_INET, SOCK_DGRAM, 0);
+	setsockopt(mcastsk, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(mcastsk, (struct sockaddr *)&mcast_addr, sizeof(mcast_addr)) != 0 ||
+	    setsockopt(mcastsk, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0 ||
+	    setsockopt(mcastsk, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof(ifaddr)) != 0) {
+		snprintf(line, LINESIZE, "error joining multicast group %s:%d, staying on unicast",
+			inet_ntoa(mcast_addr.sin_addr), ntohs(mcast_addr.sin_port));
+		chat_writeln(TRUE, LOG_WARNING, line);
+		close(mcastsk);
+		mcastsk = -1;
+		mcast_enabled = FALSE;
+		return;
+	}
+
+	setsockopt(mcastsk, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+	setsockopt(mcastsk, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+
+	snprintf(line, LINESIZE, "listening for multicast in %s:%d",
+		inet_ntoa(mcast_addr.sin_addr), ntohs(mcast_addr.sin_port));
+	chat_writeln(TRUE, LOG_INFO, line);
+
+	pthread_create(&mcast_tid, NULL, mcast_run, NULL);
+}
+
+void
+mcast_stop()
+{
+	char datagram[LINESIZE];
+	int len;
+
+	if (!mcast_enabled)
+		return;
+
+	pthread_cancel(mcast_tid);
+	pthread_join(mcast_tid, NULL);
+
+	len = snprintf(datagram, LINESIZE, "leave %s\n", self_info->id);
+	mcast_send(datagram, len);
+	close(mcastsk);
+}
+
+buf_t *
+mcast_nacked(const char *args)
+{
+	char data[MCAST_REPAIR * WIRE_LINE];
+	unsigned long epoch, from, to, seq;
+	mcast_entry_t *entry;
+	size_t len = 0;
+
+	if (sscanf(args, "%lu %lu %lu", &epoch, &from, &to) != 3 ||
+	    epoch != self_epoch || from == 0 || to < from)
+		return NULL;
+
+	if (to - from >= MCAST_REPAIR)
+		to = from + MCAST_REPAIR - 1;
+
+	pthread_mutex_lock(&mcast_mutex);
+	if (to > mcast_seq)
+		to = mcast_seq;
+
+	for (seq = from; seq <= to; seq++) {
+		entry = &history[seq % MCAST_HISTORY];
+		if (entry->seq == seq)
+			len += snprintf(data + len, WIRE_LINE, "mcast %lu %lu %s\n",
+				epoch, seq, entry->text);
+		else
+			len += snprintf(data + len, WIRE_LINE, "mcast %lu %lu\n",
+				epoch, seq);
+	}
+	pthread_mutex_unlock(&mcast_mutex);
+
+	if (len == 0)
+		return NULL;
+
+	metric_add(MC_MCAST_REPAIRS, to - from + 1);
+	return buf_from(data, len);
+}
+
+void
+mcast_repaired(peer_info_t *peer_info, const char *args)
+{
+	char nack[LINESIZE];
+	unsigned long epoch, seq;
+	mcast_peer_t *mp;
+	int off = 0;
+
+	if (!mcast_enabled ||
+	    sscanf(args, "%lu %lu%n", &epoch, &seq, &off) != 2)
+		return;
+
+	mp = &mcast_peers[peer_info->index];
+	nack[0] = '\0';
+
+	pthread_mutex_lock(&mcast_mutex);
+	if (mp->next && mp->epoch == epoch) {
+		mcast_accept(peer_info, mp, seq, args[off] == ' ' ? args + off + 1 : NULL);
+		/* a long gap is asked for a chunk at a time */
+		if (mp->next > mp->nacked)
+			mcast_nack(mp, mp->last, FALSE, nack);
+	}
+	pthread_mutex_unlock(&mcast_mutex);
+
+	mcast_send_nack(peer_info, nack);
+}
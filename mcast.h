@@ -0,0 +1,90 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _MCAST_H
+#define _MCAST_H
+
+#include <stdint.h>
+
+#include "peers.h"
+#include "pool.h"
+
+/*
+ * Optional ip multicast channel, set by a line in the peers file:
+ *
+ *     @mcast <group> <port> [ttl]
+ *
+ * Every node then sends one datagram per heartbeat and per broadcast
+ * instead of one per peer:
+ *
+ *     hb <id> <epoch> <last>               every probe interval
+ *     bcast <id> <epoch> <seq> <message>   a broadcast chat message
+ *     leave <id>                           on the way out
+ *
+ * A peer is alive while its heartbeats keep coming.  Broadcasts are
+ * numbered per sender and epoch (process start) and delivered in order;
+ * a gap, or a heartbeat whose <last> we haven't seen, is nacked over the
+ * unicast connection and the sender repairs it from its history:
+ *
+ *     nack <epoch> <from> <to>        receiver to sender
+ *     mcast <epoch> <seq> [message]   a repair, no message if it is gone
+ *
+ * All nodes of a peers file have to agree on it.  When the group can't
+ * be joined we stay on unicast.
+ */
+
+#define MCAST_TTL 1
+/* broadcasts kept for repairs */
+#define MCAST_HISTORY 256
+/* out of order broadcasts held per sender while a gap is repaired */
+#define MCAST_WINDOW 64
+/* repairs sent for one nack */
+#define MCAST_REPAIR 32
+
+extern int mcast_enabled;
+
+/* from the peers file, -1 on a malformed line */
+int
+mcast_config(const char *group, const char *port, const char *ttl);
+
+/* joins the group and starts heartbeating, unicast if it fails */
+void
+mcast_start();
+
+/* says leave to the group */
+void
+mcast_stop();
+
+void
+mcast_broadcast(const char *message);
+
+/* usec (delivery_clock) of peer's last heartbeat, 0 if never heard */
+uint64_t
+mcast_heard(const peer_info_t *peer_info);
+
+/* called by the peer's reactor */
+
+/* the repairs asked for by a nack line, NULL if none */
+buf_t *
+mcast_nacked(const char *args);
+
+/* a repair line arrived from peer_info */
+void
+mcast_repaired(peer_info_t *peer_info, const char *args);
+
+#endif /* _MCAST_H */
@@ -0,0 +1,99 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include "bitset.h"
+#include "membership.h"
+#include "peers.h"
+
+static pthread_mutex_t membership_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* odd while a writer is publishing, version is seq / 2 */
+static unsigned long membership_seq;
+
+/* every reader thread keeps its last snapshot, refreshed on version change */
+static __thread membership_t snapshot;
+
+void
+membership_write_begin()
+{
+	pthread_mutex_lock(&membership_mutex);
+	__atomic_store_n(&membership_seq, membership_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void
+membership_write_end()
+{
+	__atomic_store_n(&membership_seq, membership_seq + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&membership_mutex);
+}
+
+const membership_t *
+membership_read()
+{
+	unsigned long seq;
+	peer_info_t *peer_info;
+	member_t *member;
+	int i;
+
+	if (snapshot.members == NULL) {
+		snapshot.members = calloc(npeers, sizeof(member_t));
+		snapshot.alive = calloc(BITSET_WORDS(npeers) + 1, sizeof(uint64_t));
+		snapshot.nmembers = npeers;
+		snapshot.version = ~0UL;
+	}
+
+	while (TRUE) {
+		seq = __atomic_load_n(&membership_seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+
+		if (seq / 2 == snapshot.version)
+			return &snapshot;
+
+		bitset_zero(snapshot.alive, BITSET_WORDS(npeers));
+		for (i = 0; i < snapshot.nmembers; i++) {
+			peer_info = peers_table[i];
+			member = &snapshot.members[i];
+
+			member->peer = peer_info;
+			member->alive = __atomic_load_n(&peer_info->alive,
+				__ATOMIC_RELAXED);
+			member->connected = __atomic_load_n(&peer_info->connected,
+				__ATOMIC_RELAXED);
+			member->connected_in = __atomic_load_n(&peer_info->connected_in,
+				__ATOMIC_RELAXED);
+			if (member->alive)
+				bitset_set(snapshot.alive, i);
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&membership_seq, __ATOMIC_RELAXED) == seq)
+			break;
+	}
+
+	snapshot.version = seq / 2;
+	return &snapshot;
+}
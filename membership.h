@@ -0,0 +1,69 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MEMBERSHIP_H
+#define _MEMBERSHIP_H
+
+#include <stdint.h>
+
+#include "peers.h"
+
+/*
+ * Membership state (alive flag, tcp connections up) is written by the
+ * poller threads and the reactors, and read by the UI and broadcast
+ * paths.  Writers serialize on a mutex and publish their changes under a
+ * sequence counter (seqlock).  Readers never lock: they get an immutable
+ * copy of the whole table tagged with a version, and retry the copy if a
+ * writer was active meanwhile.
+ *
+ * No fds are published.  A reader acting on a member hands the work to
+ * the peer's reactor, which owns its connections, so one closed in the
+ * meantime can't be written to.  Readers spin while a write is open, so
+ * nothing slow (i/o, thread creation) happens inside one.
+ */
+
+typedef struct {
+	peer_info_t *peer;
+	int alive;
+	int connected;
+	int connected_in;
+} member_t;
+
+typedef struct {
+	unsigned long version;
+	int nmembers;
+	member_t *members;
+	/* members[i].alive as a bitset, see bitset.h */
+	uint64_t *alive;
+} membership_t;
+
+/* store a published field, only valid between write_begin/write_end */
+#define MEMBERSHIP_SET(field, value) \
+	__atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+
+void
+membership_write_begin();
+
+void
+membership_write_end();
+
+const membership_t *
+membership_read();
+
+#endif /* _MEMBERSHIP_H */
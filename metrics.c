@@ -0,0 +1,338 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chatgui.h"
+#include "chet2p.h"
+#include "metrics.h"
+
+#define METRICS_BACKLOG 8
+/* a scraper gets this long to ask and to take the answer */
+#define METRICS_TIMEOUT_MS 200
+
+/* histogram buckets exported, powers of four of the recorded unit */
+#define METRICS_LE_STEP 2
+#define METRICS_LE_MAX 30
+
+typedef enum {
+	METRIC_COUNTER,
+	METRIC_GAUGE
+} metric_type_t;
+
+typedef struct {
+	const char *name;
+	const char *help;
+	metric_type_t type;
+} metric_desc_t;
+
+typedef struct shard {
+	struct shard *next;
+	histogram_t hists[METRIC_HISTS];
+	unsigned long values[];
+} shard_t;
+
+static const metric_desc_t global_descs[METRIC_GLOBALS] = {
+	[MC_HEARTBEAT_PINGS] = { "heartbeat_pings_total", "Pings answered", METRIC_COUNTER },
+	[MC_CONNS_ACCEPTED] = { "conns_accepted_total", "Tcp connections accepted", METRIC_COUNTER },
+	[MC_LINES] = { "lines_total", "Protocol lines handled by the chat server", METRIC_COUNTER },
+	[MC_EXECS] = { "execs_total", "Commands executed", METRIC_COUNTER },
+	[MC_MCAST_SENT] = { "mcast_sent_total", "Multicast datagrams sent", METRIC_COUNTER },
+	[MC_MCAST_RECEIVED] = { "mcast_received_total", "Multicast datagrams received", METRIC_COUNTER },
+	[MC_MCAST_NACKS] = { "mcast_nacks_total", "Nacks sent for missing broadcasts", METRIC_COUNTER },
+	[MC_MCAST_REPAIRS] = { "mcast_repairs_total", "Broadcasts resent over unicast", METRIC_COUNTER },
+	[MC_MCAST_LOST] = { "mcast_lost_total", "Broadcasts given up on", METRIC_COUNTER },
+	[MC_ROUTE_UPDATES] = { "route_updates_total", "Link state changes learnt from peers", METRIC_COUNTER },
+	[MC_ROUTE_FORWARDED] = { "route_forwarded_total", "Messages relayed towards another node", METRIC_COUNTER },
+	[MC_ROUTE_DROPPED] = { "route_dropped_total", "Relayed messages without a route or out of hops", METRIC_COUNTER },
+	[MC_HISTORY_INDEXED] = { "history_indexed_total", "Chat messages added to the search index", METRIC_COUNTER },
+	[MC_HISTORY_DROPPED] = { "history_dropped_total", "Chat messages left out of history, the indexer was behind", METRIC_COUNTER },
+};
+
+static const metric_desc_t peer_descs[METRIC_PEER] = {
+	[MP_MSGS_SENT] = { "peer_msgs_sent_total", "Messages sent", METRIC_COUNTER },
+	[MP_WRITES] = { "peer_writes_total", "Socket writes", METRIC_COUNTER },
+	[MP_BYTES_SENT] = { "peer_bytes_sent_total", "Bytes written", METRIC_COUNTER },
+	[MP_MSGS_RECEIVED] = { "peer_msgs_received_total", "Messages received", METRIC_COUNTER },
+	[MP_EXECS_RECEIVED] = { "peer_execs_received_total", "Execs received", METRIC_COUNTER },
+	[MP_BYTES_RECEIVED] = { "peer_bytes_received_total", "Bytes read", METRIC_COUNTER },
+	[MP_MSGS_DROPPED] = { "peer_msgs_dropped_total", "Messages dropped over the rate limit", METRIC_COUNTER },
+	[MP_EXECS_DROPPED] = { "peer_execs_dropped_total", "Execs dropped over the rate limit", METRIC_COUNTER },
+	[MP_MSGS_THROTTLED] = { "peer_msgs_throttled_total", "Messages held waiting for credit", METRIC_COUNTER },
+	[MP_CONNECTS] = { "peer_connects_total", "Outbound connections established", METRIC_COUNTER },
+	[MP_PINGS] = { "peer_pings_total", "Heartbeat pings sent", METRIC_COUNTER },
+	[MP_PINGS_LOST] = { "peer_pings_lost_total", "Heartbeat pings without a pong", METRIC_COUNTER },
+	[MP_OUTQ_BYTES] = { "peer_outq_bytes", "Bytes queued for writing", METRIC_GAUGE },
+	[MP_PENDING] = { "peer_pending_msgs", "Messages held waiting for credit", METRIC_GAUGE },
+	[MP_UNACKED] = { "peer_unacked_msgs", "Messages sent and not acked", METRIC_GAUGE },
+	[MP_TRANSPORT] = { "peer_transport", "Transport of the outbound conn: 0 tcp, 1 unix, 2 shm", METRIC_GAUGE },
+};
+
+static const metric_desc_t hist_descs[METRIC_HISTS] = {
+	[MH_LINE_NS] = { "line_ns", "Time handling a protocol line", 0 },
+	[MH_EXEC_US] = { "exec_spawn_us", "Time spawning an exec", 0 },
+};
+
+__thread unsigned long *metrics_shard;
+__thread histogram_t *metrics_hists;
+
+static pthread_mutex_t shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+static shard_t *shards;
+static size_t nvalues;
+
+static int metrics_sk = -1;
+static const char *metrics_path;
+static pthread_t metrics_tid;
+
+void
+metrics_init()
+{
+	nvalues = METRIC_GLOBALS + npeers * METRIC_PEER;
+}
+
+unsigned long *
+metrics_shard_new()
+{
+	shard_t *shard;
+
+	shard = calloc(1, sizeof(shard_t) + nvalues * sizeof(unsigned long));
+
+	pthread_mutex_lock(&shards_mutex);
+	shard->next = shards;
+	shards = shard;
+	pthread_mutex_unlock(&shards_mutex);
+
+	metrics_hists = shard->hists;
+	metrics_shard = shard->values;
+	return metrics_shard;
+}
+
+static unsigned long
+metric_sum(size_t slot)
+{
+	unsigned long sum = 0;
+	shard_t *shard;
+
+	pthread_mutex_lock(&shards_mutex);
+	for (shard = shards; shard; shard = shard->next)
+		sum += __atomic_load_n(&shard->values[slot], __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&shards_mutex);
+
+	return sum;
+}
+
+unsigned long
+metric_read(int id)
+{
+	return metric_sum(id);
+}
+
+unsigned long
+metric_peer_read(const peer_info_t *peer_info, int id)
+{
+	return metric_sum(METRIC_GLOBALS + peer_info->index * METRIC_PEER + id);
+}
+
+void
+metric_hist_read(int id, histogram_t *hist)
+{
+	shard_t *shard;
+
+	memset(hist, 0, sizeof(histogram_t));
+
+	pthread_mutex_lock(&shards_mutex);
+	for (shard = shards; shard; shard = shard->next)
+		histogram_merge(hist, &shard->hists[id]);
+	pthread_mutex_unlock(&shards_mutex);
+}
+
+static void
+write_hist(FILE *out, const char *name, const char *labels, const histogram_t *hist)
+{
+	const char *sep = *labels ? "," : "";
+	const char *lbrace = *labels ? "{" : "";
+	const char *rbrace = *labels ? "}" : "";
+	int bits;
+
+	for (bits = 0; bits <= METRICS_LE_MAX; bits += METRICS_LE_STEP)
+		fprintf(out, "chet2p_%s_bucket{%s%sle=\"%lu\"} %lu\n", name, labels, sep,
+			1UL << bits, histogram_count_below(hist, 1ULL << bits));
+	fprintf(out, "chet2p_%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, sep,
+		__atomic_load_n(&hist->count, __ATOMIC_RELAXED));
+	fprintf(out, "chet2p_%s_sum%s%s%s %lu\n", name, lbrace, labels, rbrace,
+		__atomic_load_n(&hist->sum, __ATOMIC_RELAXED));
+	fprintf(out, "chet2p_%s_count%s%s%s %lu\n", name, lbrace, labels, rbrace,
+		__atomic_load_n(&hist->count, __ATOMIC_RELAXED));
+}
+
+void
+metrics_write(FILE *out)
+{
+	char labels[LINESIZE];
+	histogram_t hist;
+	int i, j;
+
+	for (i = 0; i < METRIC_GLOBALS; i++) {
+		fprintf(out, "# HELP chet2p_%s %s\n", global_descs[i].name, global_descs[i].help);
+		fprintf(out, "# TYPE chet2p_%s %s\n", global_descs[i].name,
+			global_descs[i].type == METRIC_COUNTER ? "counter" : "gauge");
+		fprintf(out, "chet2p_%s %lu\n", global_descs[i].name, metric_read(i));
+	}
+
+	for (i = 0; i < METRIC_HISTS; i++) {
+		fprintf(out, "# HELP chet2p_%s %s\n", hist_descs[i].name, hist_descs[i].help);
+		fprintf(out, "# TYPE chet2p_%s histogram\n", hist_descs[i].name);
+		metric_hist_read(i, &hist);
+		write_hist(out, hist_descs[i].name, "", &hist);
+	}
+
+	for (i = 0; i < METRIC_PEER; i++) {
+		fprintf(out, "# HELP chet2p_%s %s\n", peer_descs[i].name, peer_descs[i].help);
+		fprintf(out, "# TYPE chet2p_%s %s\n", peer_descs[i].name,
+			peer_descs[i].type == METRIC_COUNTER ? "counter" : "gauge");
+		for (j = 0; j < npeers; j++)
+			fprintf(out, "chet2p_%s{peer=\"%s\"} %lu\n", peer_descs[i].name,
+				peers_table[j]->id, metric_peer_read(peers_table[j], i));
+	}
+
+	fprintf(out, "# HELP chet2p_peer_ping_rtt_us Heartbeat round trip\n");
+	fprintf(out, "# TYPE chet2p_peer_ping_rtt_us histogram\n");
+	for (j = 0; j < npeers; j++) {
+		snprintf(labels, LINESIZE, "peer=\"%s\"", peers_table[j]->id);
+		write_hist(out, "peer_ping_rtt_us", labels, &peers_table[j]->ping_rtt);
+	}
+
+	fprintf(out, "# HELP chet2p_peer_latency_us Message latency, send to ack\n");
+	fprintf(out, "# TYPE chet2p_peer_latency_us histogram\n");
+	for (j = 0; j < npeers; j++) {
+		snprintf(labels, LINESIZE, "peer=\"%s\"", peers_table[j]->id);
+		write_hist(out, "peer_latency_us", labels, &peers_table[j]->delivery.latency);
+	}
+}
+
+static void *
+metrics_server(void *data)
+{
+	const char *header = "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Connection: close\r\n\r\n";
+	struct timeval tv = {
+		.tv_sec = METRICS_TIMEOUT_MS / 1000,
+		.tv_usec = METRICS_TIMEOUT_MS % 1000 * 1000
+	};
+	char request[BUFFSIZE];
+	char *body;
+	size_t len;
+	FILE *out;
+	int sk;
+
+	while ((sk = accept(metrics_sk, NULL, NULL)) >= 0) {
+		/* a silent or stalled client can't hold the server, nor leaving */
+		setsockopt(sk, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(sk, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+		/* whatever was asked, the answer is the same */
+		recv(sk, request, sizeof(request), 0);
+
+		out = open_memstream(&body, &len);
+		metrics_write(out);
+		fclose(out);
+
+		send(sk, header, strlen(header), MSG_NOSIGNAL);
+		send(sk, body, len, MSG_NOSIGNAL);
+		free(body);
+		close(sk);
+	}
+
+	return NULL;
+}
+
+int
+metrics_serve(const char *where)
+{
+	struct sockaddr_in inaddr;
+	struct sockaddr_un unaddr;
+	char line[LINESIZE];
+	int one = 1, ret;
+
+	if (where[0] == '/') {
+		memset(&unaddr, 0, sizeof(unaddr));
+		unaddr.sun_family = AF_UNIX;
+		strncpy(unaddr.sun_path, where, sizeof(unaddr.sun_path) - 1);
+		unlink(where);
+		metrics_path = where;
+
+		metrics_sk = socket(AF_UNIX, SOCK_STREAM, 0);
+		ret = bind(metrics_sk, (struct sockaddr *)&unaddr, sizeof(unaddr));
+	}
+	else {
+		memset(&inaddr, 0, sizeof(inaddr));
+		inaddr.sin_family = AF_INET;
+		inaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		inaddr.sin_port = htons(atoi(where));
+
+		metrics_sk = socket(AF_INET, SOCK_STREAM, 0);
+		setsockopt(metrics_sk, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		ret = bind(metrics_sk, (struct sockaddr *)&inaddr, sizeof(inaddr));
+	}
+
+	if (ret != 0 || listen(metrics_sk, METRICS_BACKLOG) != 0) {
+		snprintf(line, LINESIZE, "error serving metrics on %s", where);
+		chat_writeln(TRUE, LOG_ERR, line);
+		close(metrics_sk);
+		metrics_sk = -1;
+		return -1;
+	}
+
+	snprintf(line, LINESIZE, "serving metrics on %s", where);
+	chat_writeln(TRUE, LOG_INFO, line);
+
+	pthread_create(&metrics_tid, NULL, metrics_server, NULL);
+	return 0;
+}
+
+int
+metrics_stop(const struct timespec *deadline)
+{
+	if (metrics_sk < 0)
+		return 0;
+
+	/* wakes the server out of accept */
+	shutdown(metrics_sk, SHUT_RDWR);
+	if (metrics_path)
+		unlink(metrics_path);
+
+	if (pthread_timedjoin_np(metrics_tid, NULL, deadline) != 0)
+		return -1;
+	close(metrics_sk);
+	metrics_sk = -1;
+
+	return 0;
+}
@@ -0,0 +1,153 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stdio.h>
+#include <time.h>
+
+#include "histogram.h"
+#include "peers.h"
+
+/*
+ * Metrics registry.  Counters live in a per thread shard and are summed
+ * over shards when read, so bumping one is a plain add to memory no
+ * other thread writes.  Gauges are set by the single thread owning the
+ * value (a peer's reactor), the other shards keep 0 for them.  Latency
+ * goes to histograms, global ones sharded the same way and merged when
+ * read, per peer ones in peer_info_t.
+ *
+ * Everything is exported as prometheus text on an optional local
+ * endpoint, see metrics_serve.
+ */
+
+/* global counters */
+enum {
+	MC_HEARTBEAT_PINGS,
+	MC_CONNS_ACCEPTED,
+	MC_LINES,
+	MC_EXECS,
+	MC_MCAST_SENT,
+	MC_MCAST_RECEIVED,
+	MC_MCAST_NACKS,
+	MC_MCAST_REPAIRS,
+	MC_MCAST_LOST,
+	MC_ROUTE_UPDATES,
+	MC_ROUTE_FORWARDED,
+	MC_ROUTE_DROPPED,
+	MC_HISTORY_INDEXED,
+	MC_HISTORY_DROPPED,
+	METRIC_GLOBALS
+};
+
+/* per peer counters and gauges */
+enum {
+	MP_MSGS_SENT,
+	MP_WRITES,
+	MP_BYTES_SENT,
+	MP_MSGS_RECEIVED,
+	MP_EXECS_RECEIVED,
+	MP_BYTES_RECEIVED,
+	MP_MSGS_DROPPED,
+	MP_EXECS_DROPPED,
+	MP_MSGS_THROTTLED,
+	MP_CONNECTS,
+	MP_PINGS,
+	MP_PINGS_LOST,
+	/* gauges */
+	MP_OUTQ_BYTES,
+	MP_PENDING,
+	MP_UNACKED,
+	MP_TRANSPORT,
+	METRIC_PEER
+};
+
+/* global histograms */
+enum {
+	MH_LINE_NS,
+	MH_EXEC_US,
+	METRIC_HISTS
+};
+
+extern __thread unsigned long *metrics_shard;
+extern __thread histogram_t *metrics_hists;
+
+/* sizes the shards, once the peers are loaded */
+void
+metrics_init();
+
+unsigned long *
+metrics_shard_new();
+
+static inline void
+metric_add(int id, unsigned long n)
+{
+	unsigned long *shard = metrics_shard ? metrics_shard : metrics_shard_new();
+
+	__atomic_store_n(&shard[id], shard[id] + n, __ATOMIC_RELAXED);
+}
+
+static inline void
+metric_peer_add(const peer_info_t *peer_info, int id, unsigned long n)
+{
+	metric_add(METRIC_GLOBALS + peer_info->index * METRIC_PEER + id, n);
+}
+
+static inline void
+metric_peer_set(const peer_info_t *peer_info, int id, unsigned long value)
+{
+	unsigned long *shard = metrics_shard ? metrics_shard : metrics_shard_new();
+
+	__atomic_store_n(&shard[METRIC_GLOBALS + peer_info->index * METRIC_PEER + id],
+		value, __ATOMIC_RELAXED);
+}
+
+static inline void
+metric_record(int id, uint64_t value)
+{
+	if (metrics_shard == NULL)
+		metrics_shard_new();
+
+	histogram_record(&metrics_hists[id], value);
+}
+
+unsigned long
+metric_read(int id);
+
+/* every thread's id histogram added up into hist */
+void
+metric_hist_read(int id, histogram_t *hist);
+
+unsigned long
+metric_peer_read(const peer_info_t *peer_info, int id);
+
+/* prometheus text exposition format */
+void
+metrics_write(FILE *out);
+
+/* serves metrics_write over http on a unix socket path or a 127.0.0.1 port */
+int
+metrics_serve(const char *where);
+
+/* waits for the server until deadline, -1 if it didn't stop */
+int
+metrics_stop(const struct timespec *deadline);
+
+#endif /* _METRICS_H */
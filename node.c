@@ -0,0 +1,136 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+#include "node.h"
+
+void
+node_init(node_t *node, int npeers, const node_ops_t *ops, void *data)
+{
+	node->npeers = npeers;
+	node->peers = calloc(npeers ? npeers : 1, sizeof(uint8_t));
+	node->ops = ops;
+	node->data = data;
+
+	node->probe_ms = NODE_PROBE_MS;
+	node->timeout_ms = NODE_TIMEOUT_MS;
+	node->next_probe = 0;
+	node->probed_at = 0;
+}
+
+void
+node_destroy(node_t *node)
+{
+	free(node->peers);
+	node->peers = NULL;
+	node->npeers = 0;
+}
+
+/*
+ * settles peer's probe: alive, or a miss that only counts as not alive
+ * once there were NODE_MISSES in a row (at once for want 0, a leave);
+ * nothing if its flags lack any of want, another thread got there first
+ */
+static void
+node_resolve(node_t *node, int peer, int alive, uint8_t want)
+{
+	uint8_t flags, next;
+	int misses;
+
+	flags = __atomic_load_n(&node->peers[peer], __ATOMIC_RELAXED);
+	do {
+		if ((flags & want) != want)
+			return;
+
+		next = flags & ~(NODE_WAITING | NODE_MISSED);
+		misses = ((flags & NODE_MISSED) >> NODE_MISSED_SHIFT) + 1;
+		if (alive)
+			next |= NODE_ALIVE;
+		else if (want == 0 || misses >= NODE_MISSES)
+			next &= ~NODE_ALIVE;
+		else
+			next |= misses << NODE_MISSED_SHIFT;
+	} while (!__atomic_compare_exchange_n(&node->peers[peer], &flags, next, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	node->ops->status(node, peer, (flags & NODE_ALIVE) != 0, (next & NODE_ALIVE) != 0);
+}
+
+void
+node_probe(node_t *node, int peer)
+{
+	__atomic_or_fetch(&node->peers[peer], NODE_WAITING, __ATOMIC_RELAXED);
+	node->ops->send(node, peer, &(node_msg_t){ .type = NODE_PING });
+}
+
+void
+node_expire(node_t *node, int peer)
+{
+	node_resolve(node, peer, 0, NODE_WAITING);
+}
+
+void
+node_receive(node_t *node, int peer, const node_msg_t *msg)
+{
+	switch (msg->type) {
+	case NODE_PING:
+		node->ops->send(node, peer, &(node_msg_t){ .type = NODE_PONG });
+		break;
+	case NODE_PONG:
+		/* a late pong doesn't resurrect an expired probe */
+		node_resolve(node, peer, 1, NODE_WAITING);
+		break;
+	case NODE_LEAVE:
+		node_resolve(node, peer, 0, 0);
+		break;
+	}
+}
+
+uint64_t
+node_tick(node_t *node, uint64_t now)
+{
+	int i;
+
+	if (node->probed_at && now >= node->probed_at + node->timeout_ms) {
+		for (i = 0; i < node->npeers; i++)
+			node_expire(node, i);
+		node->probed_at = 0;
+	}
+
+	if (now >= node->next_probe) {
+		for (i = 0; i < node->npeers; i++)
+			node_probe(node, i);
+		node->probed_at = now;
+		node->next_probe = now + node->probe_ms;
+	}
+
+	if (node->probed_at)
+		return node->probed_at + node->timeout_ms;
+	return node->next_probe;
+}
+
+void
+node_leave(node_t *node)
+{
+	int i;
+
+	for (i = 0; i < node->npeers; i++)
+		node->ops->send(node, i, &(node_msg_t){ .type = NODE_LEAVE });
+}
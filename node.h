@@ -0,0 +1,123 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NODE_H
+#define _NODE_H
+
+#include <stdint.h>
+
+/*
+ * Membership logic of one node, free of globals and i/o so
+ * that many nodes can live in one process.  Peers are numbered 0..npeers-1
+ * (peers file order, self excluded).  Everything leaving the node goes
+ * through ops->send and everything arriving is fed to node_receive; the
+ * owner supplies the clock.
+ *
+ * Every probe_ms the node pings each peer, a pong within timeout_ms
+ * means alive.  A peer is only given up on after NODE_MISSES probes in a
+ * row went unanswered, so a lost datagram doesn't flap its view; one
+ * that says it leaves is gone at once.
+ *
+ * Per peer state is a byte, so full mesh views of 10k nodes fit in
+ * memory.  Calls touching different peers may run on different threads;
+ * node_tick touches them all.  Calls for the same peer
+ * may race too (a poller probing while the heartbeat thread takes a
+ * leave): flags only change by atomic read-modify-write, and of a pong,
+ * an expiry and a leave resolving the same probe only the first counts.
+ *
+ * Only membership lives here, and it is the code chet2p runs (self_node,
+ * driven by the pollers and the heartbeat thread).  Its address book
+ * (peers_table, peers_by_id, self_info), sockets, reactors and ui stay
+ * process globals, and messages never pass through a node: chet2p-sim
+ * simulates views only.
+ */
+
+#define NODE_PROBE_MS 5000
+#define NODE_TIMEOUT_MS 1000
+/* unanswered probes in a row that make an alive peer not alive, up to 3 */
+#define NODE_MISSES 2
+
+/* per peer flags, plus the misses so far */
+#define NODE_ALIVE 0x01
+#define NODE_WAITING 0x02
+#define NODE_MISSED_SHIFT 2
+#define NODE_MISSED (0x03 << NODE_MISSED_SHIFT)
+
+enum {
+	NODE_PING,
+	NODE_PONG,
+	NODE_LEAVE,
+};
+
+typedef struct {
+	int type;
+} node_msg_t;
+
+struct node;
+
+typedef struct {
+	void (*send)(struct node *node, int peer, const node_msg_t *msg);
+	/* a probe of peer resolved, was is the view it replaced */
+	void (*status)(struct node *node, int peer, int was, int alive);
+} node_ops_t;
+
+typedef struct node {
+	int npeers;
+	uint8_t *peers;
+	const node_ops_t *ops;
+	void *data;
+
+	int probe_ms;
+	int timeout_ms;
+	uint64_t next_probe;
+	uint64_t probed_at;
+} node_t;
+
+void
+node_init(node_t *node, int npeers, const node_ops_t *ops, void *data);
+
+void
+node_destroy(node_t *node);
+
+static inline int
+node_alive(const node_t *node, int peer)
+{
+	return __atomic_load_n(&node->peers[peer], __ATOMIC_RELAXED) & NODE_ALIVE;
+}
+
+/* pings peer and waits for its pong */
+void
+node_probe(node_t *node, int peer);
+
+/* the pong for peer's probe didn't come in time, a miss */
+void
+node_expire(node_t *node, int peer);
+
+void
+node_receive(node_t *node, int peer, const node_msg_t *msg);
+
+/* probes and expires every peer when due, returns the next deadline */
+uint64_t
+node_tick(node_t *node, uint64_t now);
+
+/* tells every peer we are going */
+void
+node_leave(node_t *node);
+
+#endif /* _NODE_H */
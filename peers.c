@@ -17,99 +17,68 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#include "capture.h"
 #include "chatgui.h"
 #include "chet2p.h"
 #include "commands.h"
+#include "mcast.h"
+#include "membership.h"
+#include "metrics.h"
+#include "node.h"
 #include "peers.h"
+#include "reactor.h"
+#include "route.h"
+#include "trace.h"
 
 const static char *ping = "ping\n";
 
+peer_info_t **peers_table;
+int npeers;
+node_t self_node;
+
+/* filled by node_send while leaving, sent at once by peers_leave */
+static struct mmsghdr *leave_msgs;
+static struct sockaddr_in *leave_addrs;
+static int nleave;
+
 void
 exec_command(const char *command)
 {
+	uint64_t start;
 	pid_t pid;
+
+	start = delivery_clock();
+	TRACE_BEGIN(fork);
 	pid = fork();
 	if (pid == 0) {
 		execlp(command, command, NULL);
 		exit(EXIT_SUCCESS);
 	}
-}
-
-void *
-peer_connect(void *data)
-{
-	int sockfd;
-	struct sockaddr_in peeraddr;
-	char buffer[BUFFSIZE], input[BUFFSIZE], *command;
-	peer_info_t *peer_info;
-	ssize_t nbytes;
-
-	peer_info = data;
-
-	sockfd = socket(PF_INET, SOCK_STREAM, 0);
-
-	peeraddr.sin_family = AF_INET;
-	peeraddr.sin_addr.s_addr = peer_info->in_addr;
-	peeraddr.sin_port = peer_info->tcp_port;
-
-	if (!connect(sockfd, (struct sockaddr *)&peeraddr,
-		sizeof(peeraddr)) == 0) {
-		snprintf(buffer, BUFFSIZE, "error connecting to peer %s@%s:%d",
-			peer_info->id,
-			inet_ntoa(peeraddr.sin_addr),
-			htons(peeraddr.sin_port));
-		chat_writeln(TRUE, LOG_ERR, buffer);
-		return NULL;
-	}
-#ifdef DEBUG
-	snprintf(buffer, BUFFSIZE, "connected to peer %s@%s:%d, sending id",
-		peer_info->id,
-		inet_ntoa(peeraddr.sin_addr),
-		htons(peeraddr.sin_port));
-	chat_writeln(TRUE, LOG_DEBUG, buffer);
-#endif
-	peer_info->sockfd_tcp = sockfd;
-
-	snprintf(buffer, BUFFSIZE, "id %s\n", self_info->id);
-	write(sockfd, buffer, strlen(buffer));
-
-	while ((nbytes = read(sockfd, input, BUFFSIZE)) > 0) {
-		input[nbytes] = '\0';
-
-		if (input[nbytes - 1] == '\n')
-			input[nbytes - 1] = '\0';
-
-		if (strstr(input, "leave") == input) {
-			shutdown(sockfd, 2);
-			update_peer_status(peer_info, FALSE);
-			break;
-		}
-		else if (strstr(input, "exec") == input) {
-			command = input + 5;
-			chat_writeln(TRUE, LOG_INFO, command);
-			exec_command(command);
-		}
-		else {
-			chat_message(MSGDIR_IN, peer_info->id, input);
-		}
-	}
+	TRACE_END(fork);
 
-	return NULL;
+	metric_record(MH_EXEC_US, delivery_clock() - start);
+	metric_add(MC_EXECS, 1);
 }
 
 void
 update_peer_status(peer_info_t *peer_info, int status) {
 	char line[LINESIZE];
+	int prev_status;
 
-	int prev_status = peer_info->alive;
-	peer_info->alive = status;
+	membership_write_begin();
+	prev_status = peer_info->alive;
+	MEMBERSHIP_SET(peer_info->alive, status);
+	membership_write_end();
 
 	if (prev_status != status) {
 		snprintf(line, LINESIZE, "%s changed status to %s", peer_info->id,
@@ -117,18 +86,67 @@ update_peer_status(peer_info_t *peer_info, int status) {
 		chat_writeln(TRUE, LOG_NOTICE, line);
 	}
 
-	if (peer_info->alive) {
-		if (!peer_info->connect_tid || pthread_kill(peer_info->connect_tid, 0) != 0) {
-			pthread_create(&peer_info->connect_tid, NULL, peer_connect, peer_info);
-#ifdef DEBUG
-			snprintf(line, LINESIZE, "started connect thread %lu for client %s",
-				peer_info->connect_tid, peer_info->id);
-			chat_writeln(TRUE, LOG_DEBUG, line);
-#endif
-		}
+	/* the owning reactor ignores it while a connection is up */
+	if (status)
+		reactor_connect(peer_info);
+}
+
+static void
+node_send(node_t *node, int peer, const node_msg_t *msg)
+{
+	peer_info_t *peer_info = peers_table[peer];
+	struct sockaddr_in peeraddr;
+
+	/* our multicast heartbeat pings everybody at once, and says leave */
+	if (mcast_enabled)
+		return;
+
+	if (msg->type == NODE_LEAVE && leave_msgs) {
+		leave_addrs[nleave].sin_family = AF_INET;
+		leave_addrs[nleave].sin_addr.s_addr = peer_info->in_addr;
+		leave_addrs[nleave].sin_port = peer_info->udp_port;
+		leave_msgs[nleave].msg_hdr.msg_name = &leave_addrs[nleave];
+		leave_msgs[nleave].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		nleave++;
+		capture(CAP_UDP_OUT, peer, "leave", 5);
+		return;
 	}
+
+	/* pongs are answered by the heartbeat thread */
+	if (msg->type != NODE_PING)
+		return;
+
+	peeraddr.sin_family = AF_INET;
+	peeraddr.sin_addr.s_addr = peer_info->in_addr;
+	peeraddr.sin_port = peer_info->udp_port;
+
+	sendto(peer_info->sockfd_udp, ping, strlen(ping), 0,
+		(struct sockaddr *)&peeraddr,
+		 sizeof(struct sockaddr_in));
+	capture(CAP_UDP_OUT, peer, ping, strlen(ping) - 1);
 }
 
+static void
+node_status(node_t *node, int peer, int was, int alive)
+{
+	peer_info_t *peer_info = peers_table[peer];
+
+	__atomic_store_n(&peer_info->warm, FALSE, __ATOMIC_RELAXED);
+
+	/* a probe never answered yet doesn't outvote a live connection */
+	if (!was && !alive &&
+	    (__atomic_load_n(&peer_info->connected, __ATOMIC_RELAXED) ||
+	     __atomic_load_n(&peer_info->connected_in, __ATOMIC_RELAXED)))
+		return;
+
+	update_peer_status(peer_info, alive);
+}
+
+static const node_ops_t node_ops = {
+	.send = node_send,
+	.status = node_status,
+};
+
 void *
 peer_poller(void *data)
 {
@@ -141,8 +159,12 @@ peer_poller(void *data)
 	char buffer[BUFFSIZE];
 	int one, readb, waitsec;
 	time_t sent_at, recv_at;
+	uint64_t ping_at;
+
+	TRACE_THREAD("poll %s", peer_info->id);
 
-	tv.tv_sec = 1;
+	tv.tv_sec = self_node.timeout_ms / 1000;
+	tv.tv_usec = self_node.timeout_ms % 1000 * 1000;
 	one = 1;
 
 	peer_info->sockfd_udp = socket(PF_INET, SOCK_DGRAM, 0);
@@ -164,22 +186,32 @@ peer_poller(void *data)
 	chat_writeln(TRUE, LOG_DEBUG, buffer);
 #endif
 	while (TRUE) {
-		sendto(peer_info->sockfd_udp, ping, strlen(ping), 0,
-			(struct sockaddr *)&peeraddr,
-			 sizeof(struct sockaddr_in));
+		ping_at = delivery_clock();
+		node_probe(&self_node, peer_info->index);
+		metric_peer_add(peer_info, MP_PINGS, 1);
 		sent_at = time(NULL);
+		TRACE_BEGIN(recvfrom);
 		readb = recvfrom(peer_info->sockfd_udp, buffer, BUFFSIZE,
 			0, (struct sockaddr *)&peeraddr, &addrlen);
+		TRACE_END(recvfrom);
 		recv_at = time(NULL);
 
+		if (readb > 0)
+			capture(CAP_UDP_IN, peer_info->index, buffer,
+				buffer[readb - 1] == '\n' ? readb - 1 : readb);
+
 		if (readb > 0 && strstr(buffer, "pong") == buffer) {
-			update_peer_status(peer_info, TRUE);
+			histogram_record(&peer_info->ping_rtt, delivery_clock() - ping_at);
+			route_sample(peer_info, delivery_clock() - ping_at);
+			node_receive(&self_node, peer_info->index,
+				&(node_msg_t){ .type = NODE_PONG });
 		}
 		else {
-			update_peer_status(peer_info, FALSE);
+			metric_peer_add(peer_info, MP_PINGS_LOST, 1);
+			node_expire(&self_node, peer_info->index);
 		}
 
-		waitsec = 5 - (recv_at - sent_at);
+		waitsec = self_node.probe_ms / 1000 - (recv_at - sent_at);
 		if (waitsec < 0)
 		    waitsec = 0;
 
@@ -195,20 +227,91 @@ peer_poller(void *data)
 	return NULL;
 }
 
+/* with multicast a probe is answered by any heartbeat within its window */
+void *
+peer_listener(void *data)
+{
+	peer_info_t *peer_info = data;
+	uint64_t probe_at, rtt;
+
+	TRACE_THREAD("listen %s", peer_info->id);
+
+	while (TRUE) {
+		probe_at = delivery_clock();
+		node_probe(&self_node, peer_info->index);
+		metric_peer_add(peer_info, MP_PINGS, 1);
+
+		usleep((self_node.probe_ms + self_node.timeout_ms) * 1000);
+
+		/* no pings to time, the acks' round trip stands in */
+		rtt = __atomic_load_n(&peer_info->delivery.rtt, __ATOMIC_RELAXED);
+		if (rtt)
+			route_sample(peer_info, rtt);
+
+		if (mcast_heard(peer_info) >= probe_at) {
+			node_receive(&self_node, peer_info->index,
+				&(node_msg_t){ .type = NODE_PONG });
+		}
+		else {
+			metric_peer_add(peer_info, MP_PINGS_LOST, 1);
+			node_expire(&self_node, peer_info->index);
+		}
+	}
+
+	return NULL;
+}
+
 void
 create_peers_poller()
 {
-	GList *peers, *curpeer;
 	peer_info_t *peer_info;
+	int i;
+
+	for (i = 0; i < npeers; i++) {
+		peer_info = peers_table[i];
+		pthread_create(&peer_info->poller_tid, NULL,
+			mcast_enabled ? peer_listener : peer_poller, peer_info);
+	}
+}
+
+void
+peers_leave()
+{
+	char line[LINESIZE];
+	struct iovec iov;
+	int sk, i, sent;
+
+	if (npeers == 0)
+		return;
 
-	peers = g_hash_table_get_values(peers_by_id);
+	iov.iov_base = line;
+	iov.iov_len = snprintf(line, LINESIZE, "leave %s\n", self_info->id);
 
-	curpeer = peers;
-	while (curpeer) {
-		peer_info = curpeer->data;
-		pthread_create(&peer_info->poller_tid, NULL, peer_poller, peer_info);
-		curpeer = curpeer->next;
+	leave_msgs = calloc(npeers, sizeof(struct mmsghdr));
+	leave_addrs = calloc(npeers, sizeof(struct sockaddr_in));
+	for (i = 0; i < npeers; i++) {
+		leave_msgs[i].msg_hdr.msg_iov = &iov;
+		leave_msgs[i].msg_hdr.msg_iovlen = 1;
 	}
+
+	nleave = 0;
+	node_leave(&self_node);
+
+	sk = socket(PF_INET, SOCK_DGRAM, 0);
+	for (i = 0; i < nleave; i += sent) {
+		TRACE_BEGIN(sendmmsg);
+		sent = sendmmsg(sk, leave_msgs + i, nleave - i, 0);
+		TRACE_END(sendmmsg);
+		/* a peer unreachable right away is not worth waiting for */
+		if (sent <= 0)
+			sent = 1;
+	}
+	close(sk);
+
+	free(leave_msgs);
+	free(leave_addrs);
+	leave_msgs = NULL;
+	leave_addrs = NULL;
 }
 
 void
@@ -241,6 +344,19 @@ load_peers(char *filename, const char *self_id)
 		if (buffer[read - 1] == '\n')
 			buffer[read - 1] = '\0';
 
+		/* @mcast <group> <port> [ttl] */
+		if (buffer[0] == '@') {
+			for (i=0; i<4; i++)
+				tokens[i] = strtok(i == 0 ? buffer : NULL, " \t");
+
+			if (strcmp(tokens[0], "@mcast") != 0 ||
+			    mcast_config(tokens[1], tokens[2], tokens[3]) != 0) {
+				fprintf(stderr, "Bad line in %s: %s\n", filename, buffer);
+				exit(EXIT_FAILURE);
+			}
+			continue;
+		}
+
 		for (i=0; i<4; i++)
 			tokens[i] = strtok(i == 0 ? buffer : NULL, " ");
 
@@ -254,10 +370,16 @@ load_peers(char *filename, const char *self_id)
 		peer_info->in_addr = in_addr;
 		peer_info->udp_port = htons(atoi(tokens[2]));
 		peer_info->tcp_port = htons(atoi(tokens[3]));
-		peer_info->sockfd_tcp = -1;
+		peer_info->connected = FALSE;
+		peer_info->connected_in = FALSE;
+		peer_info->sockfd_udp = -1;
 		peer_info->alive = FALSE;
 
 		if (strcmp(peer_info->id, self_id)) {
+			peer_info->index = npeers;
+			peers_table = realloc(peers_table,
+				(npeers + 1) * sizeof(peer_info_t *));
+			peers_table[npeers++] = peer_info;
 			g_hash_table_insert(peers_by_id, id, peer_info);
 		}
 		else {
@@ -269,4 +391,7 @@ load_peers(char *filename, const char *self_id)
 			buffer = NULL;
 		}
 	}
+
+	node_init(&self_node, npeers, &node_ops, NULL);
+	route_init();
 }
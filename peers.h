@@ -24,37 +24,60 @@
 #include <netinet/in.h>
 #include <pthread.h>
 
+#include "delivery.h"
+#include "node.h"
+#include "ratelimit.h"
+
+struct conn;
+
 typedef struct {
 	char *id;
+	int index;
 	in_addr_t in_addr;
 	uint16_t udp_port;
 	uint16_t tcp_port;
-	int sockfd_tcp;
-	int sockfd_tcp_in;
+	/* a tcp connection to and from the peer is up, its fd stays with the reactor */
+	int connected;
+	int connected_in;
 	int sockfd_udp;
 	int alive;
+	/* alive on a snapshot's word until a probe or connect confirms it */
+	int warm;
 	pthread_t poller_tid;
-	pthread_t connect_tid;
-	pthread_t client_tid;
+	/* owned by the peer's reactor, see reactor.h */
+	struct conn *conn_out;
+	struct conn *conn_in;
+	/* inbound limits, also owned by the peer's reactor */
+	ratelimit_t msg_limit;
+	ratelimit_t exec_limit;
+	/* heartbeat round trips, recorded by the poller */
+	histogram_t ping_rtt;
+	/* sequencing, acks and latency, owned by the peer's reactor */
+	delivery_t delivery;
 } peer_info_t;
 
 GHashTable *peers_by_id;
 peer_info_t *self_info;
 
+/* peers in peers file order, self excluded; peer_info->index is the slot */
+extern peer_info_t **peers_table;
+extern int npeers;
+
+/* membership logic for this process, driven by the pollers */
+extern node_t self_node;
+
 void
 exec_command(const char *command);
 
 void
 update_peer_status(peer_info_t *peer_info, int status);
 
-void *
-peer_connect(void *data);
-
 void
-create_peers_connect();
+create_peers_poller();
 
+/* tells every peer we are going, one batch of datagrams */
 void
-create_peers_poller();
+peers_leave();
 
 void
 load_peers(char *filename, const char *self_id);
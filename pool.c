@@ -0,0 +1,248 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+pool_t *pools[POOL_MAX];
+int npools;
+
+static __thread pool_cache_t *thread_caches[POOL_MAX];
+
+static pool_t buf_pool;
+
+void
+pool_init(pool_t *pool, const char *name, size_t objsize)
+{
+	memset(pool, 0, sizeof(pool_t));
+	pool->name = name;
+
+	/* room for the free list link, keep objects 16 byte aligned */
+	if (objsize < sizeof(void *))
+		objsize = sizeof(void *);
+	pool->objsize = (objsize + 15) & ~15UL;
+	pthread_mutex_init(&pool->mutex, NULL);
+
+	pool->id = npools;
+	pools[npools++] = pool;
+}
+
+static pool_cache_t *
+pool_cache(pool_t *pool)
+{
+	pool_cache_t *cache = thread_caches[pool->id];
+
+	if (cache)
+		return cache;
+
+	cache = calloc(1, sizeof(pool_cache_t));
+
+	pthread_mutex_lock(&pool->mutex);
+	cache->next = pool->caches;
+	pool->caches = cache;
+	pthread_mutex_unlock(&pool->mutex);
+
+	thread_caches[pool->id] = cache;
+	return cache;
+}
+
+static void
+pool_refill(pool_t *pool, pool_cache_t *cache)
+{
+	char *slab;
+	void *obj;
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	if (pool->free == NULL) {
+		slab = malloc(POOL_SLAB * pool->objsize);
+		pool->slabs++;
+
+		for (i = POOL_SLAB - 1; i >= 0; i--) {
+			obj = slab + i * pool->objsize;
+			*(void **)obj = pool->free;
+			pool->free = obj;
+		}
+	}
+
+	for (i = 0; i < POOL_CACHE / 2 && pool->free; i++) {
+		obj = pool->free;
+		pool->free = *(void **)obj;
+
+		*(void **)obj = cache->free;
+		cache->free = obj;
+		cache->nfree++;
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void
+pool_spill(pool_t *pool, pool_cache_t *cache)
+{
+	void *obj;
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	for (i = 0; i < POOL_CACHE / 2; i++) {
+		obj = cache->free;
+		cache->free = *(void **)obj;
+		cache->nfree--;
+
+		*(void **)obj = pool->free;
+		pool->free = obj;
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+void *
+pool_alloc(pool_t *pool)
+{
+	pool_cache_t *cache = pool_cache(pool);
+	void *obj;
+
+	if (cache->free == NULL)
+		pool_refill(pool, cache);
+
+	obj = cache->free;
+	cache->free = *(void **)obj;
+	cache->nfree--;
+	__atomic_store_n(&cache->allocs, cache->allocs + 1, __ATOMIC_RELAXED);
+
+	return obj;
+}
+
+void
+pool_free(pool_t *pool, void *obj)
+{
+	pool_cache_t *cache = pool_cache(pool);
+
+	*(void **)obj = cache->free;
+	cache->free = obj;
+	cache->nfree++;
+	__atomic_store_n(&cache->frees, cache->frees + 1, __ATOMIC_RELAXED);
+
+	if (cache->nfree > POOL_CACHE)
+		pool_spill(pool, cache);
+}
+
+void
+pool_stats(pool_t *pool, pool_stats_t *stats)
+{
+	pool_cache_t *cache;
+
+	memset(stats, 0, sizeof(pool_stats_t));
+
+	pthread_mutex_lock(&pool->mutex);
+	for (cache = pool->caches; cache; cache = cache->next) {
+		stats->allocs += __atomic_load_n(&cache->allocs, __ATOMIC_RELAXED);
+		stats->frees += __atomic_load_n(&cache->frees, __ATOMIC_RELAXED);
+	}
+	stats->slabs = pool->slabs;
+	stats->capacity = pool->slabs * POOL_SLAB;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+void
+bufs_init()
+{
+	pool_init(&buf_pool, "buf", sizeof(buf_t));
+}
+
+buf_t *
+buf_new()
+{
+	buf_t *buf = pool_alloc(&buf_pool);
+
+	buf->refcount = 1;
+	buf->frame = 0;
+	buf->len = 0;
+	buf->next = NULL;
+
+	return buf;
+}
+
+buf_t *
+buf_from(const char *data, size_t len)
+{
+	buf_t *head, *buf;
+	size_t chunk;
+
+	head = buf = buf_new();
+	for (;;) {
+		chunk = len < BUF_DATA ? len : BUF_DATA;
+		memcpy(buf->data, data, chunk);
+		buf->len = chunk;
+		data += chunk;
+		len -= chunk;
+
+		if (len == 0)
+			break;
+
+		buf->next = buf_new();
+		buf = buf->next;
+	}
+
+	return head;
+}
+
+buf_t *
+buf_line(const char *line)
+{
+	buf_t *buf = buf_new();
+	size_t len;
+
+	len = strlen(line);
+	if (len > BUFFSIZE - 1)
+		len = BUFFSIZE - 1;
+
+	memcpy(buf->data, line, len);
+	buf->data[len++] = '\n';
+	buf->len = len;
+
+	return buf;
+}
+
+buf_t *
+buf_ref(buf_t *buf)
+{
+	__atomic_add_fetch(&buf->refcount, 1, __ATOMIC_RELAXED);
+	return buf;
+}
+
+void
+buf_unref(buf_t *buf)
+{
+	buf_t *next;
+
+	if (__atomic_sub_fetch(&buf->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	/* the rest of the chain belongs to the head */
+	while (buf) {
+		next = buf->next;
+		pool_free(&buf_pool, buf);
+		buf = next;
+	}
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "chet2p.h"
+
+/*
+ * Fixed size object pools.  Objects come from slabs of POOL_SLAB objects,
+ * the only time a pool touches the heap.  Every thread keeps a small cache
+ * per pool so the common alloc/free is a couple of pointer moves; caches
+ * refill from and spill to the shared free list in batches.  Objects may
+ * be freed from any thread.
+ */
+
+#define POOL_SLAB 64
+#define POOL_CACHE 32
+#define POOL_MAX 8
+
+typedef struct pool_cache {
+	void *free;
+	int nfree;
+	unsigned long allocs;
+	unsigned long frees;
+	struct pool_cache *next;
+} pool_cache_t;
+
+typedef struct {
+	const char *name;
+	size_t objsize;
+	int id;
+	pthread_mutex_t mutex;
+	void *free;
+	unsigned long slabs;
+	pool_cache_t *caches;
+} pool_t;
+
+typedef struct {
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long slabs;
+	unsigned long capacity;
+} pool_stats_t;
+
+extern pool_t *pools[POOL_MAX];
+extern int npools;
+
+void
+pool_init(pool_t *pool, const char *name, size_t objsize);
+
+void *
+pool_alloc(pool_t *pool);
+
+void
+pool_free(pool_t *pool, void *obj);
+
+void
+pool_stats(pool_t *pool, pool_stats_t *stats);
+
+/*
+ * Reference counted message buffers.  A message is built once and the
+ * same buffer is queued on every connection it goes to; longer payloads
+ * are chained through next, the head owning the rest of the chain.
+ */
+
+#define BUF_DATA (BUFFSIZE + 1)
+
+typedef struct buf {
+	int refcount;
+	/* a chan, fwd or exec frame built by us; chat when 0 */
+	int frame;
+	size_t len;
+	struct buf *next;
+	char data[BUF_DATA];
+} buf_t;
+
+void
+bufs_init();
+
+buf_t *
+buf_new();
+
+/* copies data into a new chain */
+buf_t *
+buf_from(const char *data, size_t len);
+
+/* line plus its newline, truncated to BUFFSIZE */
+buf_t *
+buf_line(const char *line);
+
+buf_t *
+buf_ref(buf_t *buf);
+
+void
+buf_unref(buf_t *buf);
+
+#endif /* _POOL_H */
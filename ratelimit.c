@@ -0,0 +1,68 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+
+#include "ratelimit.h"
+
+void
+ratelimit_init(ratelimit_t *rl, double rate)
+{
+	rl->rate = rate;
+	rl->burst = rate < 0.5 ? 1 : 2 * rate;
+	rl->tokens = rl->burst;
+	clock_gettime(CLOCK_MONOTONIC, &rl->last);
+}
+
+static void
+ratelimit_refill(ratelimit_t *rl)
+{
+	struct timespec now;
+	double elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - rl->last.tv_sec) +
+		(now.tv_nsec - rl->last.tv_nsec) / 1e9;
+	rl->last = now;
+
+	rl->tokens += elapsed * rl->rate;
+	if (rl->tokens > rl->burst)
+		rl->tokens = rl->burst;
+}
+
+int
+ratelimit_take(ratelimit_t *rl)
+{
+	return ratelimit_take_upto(rl, 1) == 1 ? 0 : -1;
+}
+
+int
+ratelimit_take_upto(ratelimit_t *rl, int n)
+{
+	if (rl->rate == 0)
+		return n;
+
+	ratelimit_refill(rl);
+
+	if (rl->tokens < n)
+		n = (int)rl->tokens;
+	rl->tokens -= n;
+
+	return n;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RATELIMIT_H
+#define _RATELIMIT_H
+
+#include <time.h>
+
+/*
+ * Token bucket.  Tokens accumulate at rate per second up to burst; a
+ * rate of 0 means unlimited.  Not thread safe, each bucket is used by a
+ * single thread.
+ */
+typedef struct {
+	double rate;
+	double burst;
+	double tokens;
+	struct timespec last;
+} ratelimit_t;
+
+void
+ratelimit_init(ratelimit_t *rl, double rate);
+
+/* takes one token, -1 when the bucket is empty */
+int
+ratelimit_take(ratelimit_t *rl);
+
+/* takes up to n tokens, returns how many */
+int
+ratelimit_take_upto(ratelimit_t *rl, int n);
+
+#endif /* _RATELIMIT_H */
@@ -0,0 +1,2065 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "channels.h"
+#include "chatgui.h"
+#include "chet2p.h"
+#include "mcast.h"
+#include "membership.h"
+#include "metrics.h"
+#include "peers.h"
+#include "reactor.h"
+#include "route.h"
+#include "scan.h"
+#include "trace.h"
+
+typedef enum {
+	LINE_OK,
+	LINE_CLOSE,
+	LINE_ADOPT
+} line_action_t;
+
+/* protocol lines by their first word, anything else is a message */
+typedef enum {
+	VERB_NONE,
+	VERB_ACK,
+	VERB_CHAN,
+	VERB_CREDIT,
+	VERB_EXEC,
+	VERB_FWD,
+	VERB_ID,
+	VERB_LEAVE,
+	VERB_LINK,
+	VERB_MCAST,
+	VERB_MSG,
+	VERB_NACK,
+	VERB_PROTO,
+	VERB_SEQ,
+	VERB_SHM,
+	VERB_SUB,
+	VERB_SYNC,
+	VERB_UNSUB
+} verb_t;
+
+reactor_t *reactors;
+int nreactors;
+
+double rate_msgs = RATE_MSGS;
+double rate_execs = RATE_EXECS;
+
+int coalesce_usec = COALESCE_USEC;
+size_t coalesce_bytes = COALESCE_BYTES;
+
+uint64_t self_epoch;
+
+transport_t transport = TRANSPORT_SHM;
+
+static pool_t conn_pool;
+static pool_t rmsg_node_pool;
+
+static __thread reactor_t *current_reactor;
+
+reactor_t *
+peer_reactor(const peer_info_t *peer_info)
+{
+	return &reactors[peer_info->index % nreactors];
+}
+
+static void
+reactor_wake(reactor_t *reactor)
+{
+	uint64_t one = 1;
+
+	/* pairs with the fence in reactor_run before going to sleep */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&reactor->sleeping, __ATOMIC_RELAXED))
+		write(reactor->evfd, &one, sizeof(one));
+}
+
+static void
+reactor_post(reactor_t *reactor, const rmsg_t *msg)
+{
+	rmsg_node_t *node, **last;
+
+	if (current_reactor) {
+		/* a full queue never blocks a reactor, park it and retry later */
+		if (current_reactor->backlog ||
+		    spsc_push(&reactor->inbox[current_reactor->id], msg) != 0) {
+			node = pool_alloc(&rmsg_node_pool);
+			node->dst = reactor->id;
+			node->msg = *msg;
+			node->next = NULL;
+
+			last = &current_reactor->backlog;
+			while (*last)
+				last = &(*last)->next;
+			*last = node;
+			return;
+		}
+	}
+	else {
+		pthread_mutex_lock(&reactor->external_mutex);
+		while (spsc_push(&reactor->external, msg) != 0) {
+			pthread_mutex_unlock(&reactor->external_mutex);
+			reactor_wake(reactor);
+			sched_yield();
+			pthread_mutex_lock(&reactor->external_mutex);
+		}
+		pthread_mutex_unlock(&reactor->external_mutex);
+	}
+
+	reactor_wake(reactor);
+}
+
+static void
+reactor_flush_backlog(reactor_t *reactor)
+{
+	rmsg_node_t *node;
+
+	while ((node = reactor->backlog)) {
+		if (spsc_push(&reactors[node->dst].inbox[reactor->id], &node->msg) != 0)
+			break;
+
+		reactor_wake(&reactors[node->dst]);
+		reactor->backlog = node->next;
+		pool_free(&rmsg_node_pool, node);
+	}
+}
+
+static int
+reactor_pending(reactor_t *reactor)
+{
+	int i;
+
+	for (i = 0; i < nreactors; i++)
+		if (!spsc_empty(&reactor->inbox[i]))
+			return TRUE;
+
+	return !spsc_empty(&reactor->external);
+}
+
+static void
+conn_link(reactor_t *reactor, conn_t *conn)
+{
+	conn->reactor = reactor;
+	conn->prev = NULL;
+	conn->next = reactor->conns;
+	if (reactor->conns)
+		reactor->conns->prev = conn;
+	reactor->conns = conn;
+}
+
+static void
+conn_unlink(reactor_t *reactor, conn_t *conn)
+{
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		reactor->conns = conn->next;
+
+	if (conn->next)
+		conn->next->prev = conn->prev;
+
+	conn->prev = conn->next = NULL;
+}
+
+static uint64_t
+reactor_clock()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* wakes the reactor when the oldest corked conn is due */
+static void
+reactor_arm(reactor_t *reactor)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = reactor->corked_head->deadline / 1000000000ULL;
+	its.it_value.tv_nsec = reactor->corked_head->deadline % 1000000000ULL;
+	timerfd_settime(reactor->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void
+conn_cork(reactor_t *reactor, conn_t *conn)
+{
+	if (conn->corked)
+		return;
+
+	conn->corked = TRUE;
+	conn->deadline = reactor_clock() + coalesce_usec * 1000ULL;
+	conn->cork_next = NULL;
+	conn->cork_prev = reactor->corked_tail;
+
+	if (reactor->corked_tail) {
+		reactor->corked_tail->cork_next = conn;
+	}
+	else {
+		reactor->corked_head = conn;
+		reactor_arm(reactor);
+	}
+	reactor->corked_tail = conn;
+}
+
+/* a stale timer firing afterwards is harmless */
+static void
+conn_uncork(reactor_t *reactor, conn_t *conn)
+{
+	if (!conn->corked)
+		return;
+
+	if (conn->cork_prev)
+		conn->cork_prev->cork_next = conn->cork_next;
+	else
+		reactor->corked_head = conn->cork_next;
+
+	if (conn->cork_next)
+		conn->cork_next->cork_prev = conn->cork_prev;
+	else
+		reactor->corked_tail = conn->cork_prev;
+
+	conn->corked = FALSE;
+	conn->cork_prev = conn->cork_next = NULL;
+}
+
+static int
+conn_flush(reactor_t *reactor, conn_t *conn)
+{
+	int ret;
+
+	TRACE_BEGIN(flush);
+	conn_uncork(reactor, conn);
+	ret = reactor->backend->flush(reactor, conn);
+	TRACE_END(flush);
+
+	return ret;
+}
+
+static conn_t *
+conn_new(reactor_t *reactor, int fd, peer_info_t *peer_info, int outbound)
+{
+	conn_t *conn;
+	int one = 1;
+
+	/* latency is up to our own coalescing, not Nagle's */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	conn = pool_alloc(&conn_pool);
+	memset(conn, 0, sizeof(conn_t));
+	conn->fd = fd;
+	conn->peer = peer_info;
+	conn->outbound = outbound;
+	conn_link(reactor, conn);
+
+	return conn;
+}
+
+void
+conn_free(conn_t *conn)
+{
+	int i;
+
+	if (conn->shm)
+		shm_destroy(conn->shm);
+	if (conn->offer)
+		shm_destroy(conn->offer);
+	for (i = 0; i < conn->nfds; i++)
+		close(conn->fds[i]);
+
+	while (conn->outq_head != conn->outq_tail)
+		buf_unref(conn->outq[conn->outq_head++ % conn->outq_size].head);
+	free(conn->outq);
+	for (i = 0; i < LANES; i++) {
+		while (conn->lanes[i].head != conn->lanes[i].tail)
+			buf_unref(conn->lanes[i].refs[conn->lanes[i].head++ % conn->lanes[i].size].head);
+		free(conn->lanes[i].refs);
+	}
+	while (conn->pending_head != conn->pending_tail)
+		buf_unref(conn->pending[conn->pending_head++ % CONN_PENDING]);
+
+	pool_free(&conn_pool, conn);
+}
+
+/* queue depths of a peer, published by its reactor */
+static void
+peer_gauges(const peer_info_t *peer_info)
+{
+	const conn_t *conn = peer_info->conn_out;
+	const delivery_t *delivery = &peer_info->delivery;
+
+	metric_peer_set(peer_info, MP_OUTQ_BYTES, conn ? conn->wlen +
+		conn->lanes[LANE_CONTROL].bytes + conn->lanes[LANE_CHAT].bytes +
+		conn->lanes[LANE_BULK].bytes : 0);
+	metric_peer_set(peer_info, MP_PENDING,
+		conn ? conn->pending_tail - conn->pending_head : 0);
+	metric_peer_set(peer_info, MP_UNACKED, delivery->next_seq - delivery->una);
+	metric_peer_set(peer_info, MP_TRANSPORT, conn == NULL ? TRANSPORT_TCP :
+		conn->shm ? TRANSPORT_SHM : conn->local ? TRANSPORT_UNIX : TRANSPORT_TCP);
+}
+
+/* room for n more refs between head and tail, -1 past CONN_OUTQ */
+static int
+ring_reserve(outref_t **refs, unsigned int *size, unsigned int head, unsigned int tail,
+	unsigned int n)
+{
+	unsigned int used = tail - head, grown, i;
+	outref_t *bigger;
+
+	if (used + n <= *size)
+		return 0;
+
+	if (used + n > CONN_OUTQ) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	/* powers of two, the free running indexes keep mapping */
+	for (grown = *size ? *size : CONN_RING; grown < used + n; grown *= 2)
+		;
+	bigger = malloc(grown * sizeof(outref_t));
+	if (bigger == NULL)
+		return -1;
+
+	for (i = head; i != tail; i++)
+		bigger[i % grown] = (*refs)[i % *size];
+	free(*refs);
+	*refs = bigger;
+	*size = grown;
+
+	return 0;
+}
+
+static void
+lane_push(lane_t *lane, buf_t *head, buf_t *cur, size_t off, size_t len, int more)
+{
+	outref_t *ref = &lane->refs[lane->tail++ % lane->size];
+
+	ref->head = buf_ref(head);
+	ref->cur = cur;
+	ref->off = off;
+	ref->len = len;
+	ref->more = more;
+	lane->bytes += len;
+}
+
+/* bulk in chunks ending at a line boundary, so other lanes can get in between */
+static void
+lane_chunks(lane_t *lane, buf_t *buf)
+{
+	buf_t *b, *cur = buf;
+	size_t off = 0, len = 0, from;
+	char *nl;
+
+	for (b = buf; b; b = b->next) {
+		from = b == cur ? off : 0;
+		while ((nl = memchr(b->data + from, '\n', b->len - from))) {
+			len += nl + 1 - (b->data + from);
+			from = nl + 1 - b->data;
+			if (len < LANE_CHUNK)
+				continue;
+
+			lane_push(lane, buf, cur, off, len, FALSE);
+			len = 0;
+			cur = from < b->len ? b : b->next;
+			off = from < b->len ? from : 0;
+		}
+		len += b->len - from;
+	}
+
+	if (len)
+		lane_push(lane, buf, cur, off, len, FALSE);
+}
+
+/* queues a reference to buf on lane, -1 if the lane is full */
+static int
+conn_queue(conn_t *conn, int id, buf_t *buf, int more)
+{
+	lane_t *lane = &conn->lanes[id];
+	lane_t *other = &conn->lanes[LANE_CHAT + LANE_BULK - id];
+	size_t len = 0;
+	buf_t *b;
+
+	for (b = buf; b; b = b->next)
+		len += b->len;
+	if (len == 0)
+		return 0;
+
+	if (ring_reserve(&lane->refs, &lane->size, lane->head, lane->tail,
+			 id == LANE_BULK ? len / LANE_CHUNK + 1 : 1) != 0)
+		return -1;
+
+	/* an idle lane doesn't bank its share */
+	if (id != LANE_CONTROL && lane->head == lane->tail && lane->vtime < other->vtime)
+		lane->vtime = other->vtime;
+
+	if (id == LANE_BULK)
+		lane_chunks(lane, buf);
+	else
+		lane_push(lane, buf, buf, 0, len, more);
+
+	return 0;
+}
+
+/* control first, then chat or bulk, whichever is further behind its share */
+static int
+conn_pick(conn_t *conn)
+{
+	lane_t *chat = &conn->lanes[LANE_CHAT], *bulk = &conn->lanes[LANE_BULK];
+
+	if (conn->lanes[LANE_CONTROL].head != conn->lanes[LANE_CONTROL].tail)
+		return LANE_CONTROL;
+	if (chat->head == chat->tail)
+		return bulk->head == bulk->tail ? -1 : LANE_BULK;
+	if (bulk->head == bulk->tail)
+		return LANE_CHAT;
+
+	return chat->vtime <= bulk->vtime ? LANE_CHAT : LANE_BULK;
+}
+
+/* moves whole frames from the lanes to outq while it is under CONN_COMMIT */
+static void
+conn_schedule(conn_t *conn)
+{
+	static const int weight[LANES] = { 1, LANE_CHAT_WEIGHT, LANE_BULK_WEIGHT };
+	outref_t *ref;
+	lane_t *lane;
+	int id;
+
+	while (conn->wlen < CONN_COMMIT && (id = conn_pick(conn)) >= 0) {
+		lane = &conn->lanes[id];
+		/* frames are two refs at most, a header and its payload */
+		if (ring_reserve(&conn->outq, &conn->outq_size, conn->outq_head,
+				 conn->outq_tail, 2) != 0)
+			return;
+
+		do {
+			ref = &lane->refs[lane->head++ % lane->size];
+			conn->outq[conn->outq_tail++ % conn->outq_size] = *ref;
+			conn->wlen += ref->len;
+			lane->bytes -= ref->len;
+			lane->vtime += ref->len * LANE_CHAT_WEIGHT * LANE_BULK_WEIGHT / weight[id];
+		} while (ref->more);
+	}
+}
+
+int
+conn_outq_iov(conn_t *conn, struct iovec *iov, int max, size_t *nbytes)
+{
+	unsigned int i;
+	buf_t *buf;
+	size_t off, left;
+	int n = 0;
+
+	*nbytes = 0;
+
+	for (i = conn->outq_head; i != conn->outq_tail && n < max; i++) {
+		buf = conn->outq[i % conn->outq_size].cur;
+		off = conn->outq[i % conn->outq_size].off;
+		left = conn->outq[i % conn->outq_size].len;
+
+		for (; left && n < max; buf = buf->next, off = 0) {
+			iov[n].iov_base = buf->data + off;
+			iov[n].iov_len = buf->len - off < left ? buf->len - off : left;
+			*nbytes += iov[n].iov_len;
+			left -= iov[n].iov_len;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+void
+conn_outq_consume(conn_t *conn, size_t nbytes)
+{
+	outref_t *ref;
+	size_t left;
+
+	conn->wlen -= nbytes;
+	if (conn->peer) {
+		metric_peer_add(conn->peer, MP_WRITES, 1);
+		metric_peer_add(conn->peer, MP_BYTES_SENT, nbytes);
+		if (conn->peer->conn_out == conn)
+			peer_gauges(conn->peer);
+	}
+
+	while (nbytes) {
+		ref = &conn->outq[conn->outq_head % conn->outq_size];
+		left = ref->cur->len - ref->off;
+		if (left > ref->len)
+			left = ref->len;
+
+		if (nbytes < left) {
+			ref->off += nbytes;
+			ref->len -= nbytes;
+			break;
+		}
+
+		nbytes -= left;
+		ref->len -= left;
+		ref->cur = ref->cur->next;
+		ref->off = 0;
+
+		if (ref->len == 0) {
+			buf_unref(ref->head);
+			conn->outq_head++;
+		}
+	}
+
+	/* room for what waits in the lanes */
+	conn_schedule(conn);
+}
+
+static void
+conn_close(reactor_t *reactor, conn_t *conn, int left)
+{
+	peer_info_t *peer_info = conn->peer;
+	int inbound = FALSE, outbound = FALSE;
+
+	if (peer_info && peer_info->conn_in == conn) {
+		inbound = TRUE;
+		peer_info->conn_in = NULL;
+	}
+	else if (peer_info && peer_info->conn_out == conn) {
+		outbound = TRUE;
+		peer_info->conn_out = NULL;
+	}
+
+	/* unpublished before closing, readers only ever see the flag */
+	if (inbound || outbound) {
+		membership_write_begin();
+		if (inbound)
+			MEMBERSHIP_SET(peer_info->connected_in, FALSE);
+		else
+			MEMBERSHIP_SET(peer_info->connected, FALSE);
+		membership_write_end();
+	}
+
+	if (outbound) {
+		peer_gauges(peer_info);
+		route_link(peer_info, FALSE);
+	}
+
+	conn_uncork(reactor, conn);
+	conn_unlink(reactor, conn);
+	reactor->backend->close(reactor, conn);
+
+	if (inbound || (outbound && left))
+		update_peer_status(peer_info, FALSE);
+}
+
+/* moves what the lanes hold towards the wire */
+static int
+conn_push(reactor_t *reactor, conn_t *conn)
+{
+	conn_schedule(conn);
+	if (conn->peer && conn->peer->conn_out == conn)
+		peer_gauges(conn->peer);
+
+	/* sent once the handshake, and the link offer if any, are done */
+	if (conn->connecting || conn->negotiating)
+		return 0;
+
+	if (coalesce_usec && conn->wlen < coalesce_bytes) {
+		conn_cork(reactor, conn);
+		return 0;
+	}
+
+	return conn_flush(reactor, conn);
+}
+
+/* queues a reference to buf on lane, the caller keeps its own */
+static int
+conn_send_buf(reactor_t *reactor, conn_t *conn, buf_t *buf, int lane)
+{
+	if (conn_queue(conn, lane, buf, FALSE) != 0)
+		return -1;
+
+	return conn_push(reactor, conn);
+}
+
+/* protocol lines go first */
+static int
+conn_write(reactor_t *reactor, conn_t *conn, const char *data, size_t len)
+{
+	buf_t *buf;
+	int ret;
+
+	buf = buf_from(data, len);
+	ret = conn_send_buf(reactor, conn, buf, LANE_CONTROL);
+	buf_unref(buf);
+
+	return ret;
+}
+
+/* execs are not held up by chat */
+static int
+msg_lane(const buf_t *buf)
+{
+	return strncmp(buf->data, "exec ", 5) == 0 ? LANE_CONTROL : LANE_CHAT;
+}
+
+/* sends a message line, sequenced once the peer said it can take it */
+static int
+conn_send_msg(reactor_t *reactor, conn_t *conn, buf_t *buf)
+{
+	peer_info_t *peer_info = conn->peer;
+	lane_t *lane = &conn->lanes[msg_lane(buf)];
+
+	if (conn->seqs) {
+		if (ring_reserve(&lane->refs, &lane->size, lane->head, lane->tail, 2) != 0)
+			return -1;
+
+		conn_queue(conn, msg_lane(buf), delivery_send(&peer_info->delivery, buf), TRUE);
+	}
+
+	metric_peer_add(peer_info, MP_MSGS_SENT, 1);
+	return conn_send_buf(reactor, conn, buf, msg_lane(buf));
+}
+
+/* TRUE while new messages have to wait in pending */
+static int
+conn_blocked(conn_t *conn)
+{
+	return (conn->credited && conn->credit == 0) ||
+		(conn->seqs && delivery_full(&conn->peer->delivery));
+}
+
+/* chan and fwd frames only go to a peer that speaks the protocol */
+static int
+conn_holds(conn_t *conn, const buf_t *buf)
+{
+	return !conn->seqs && buf->frame && msg_lane(buf) != LANE_CONTROL;
+}
+
+static void
+conn_release(reactor_t *reactor, conn_t *conn)
+{
+	buf_t *buf;
+
+	while (!conn_blocked(conn) && conn->pending_head != conn->pending_tail) {
+		buf = conn->pending[conn->pending_head % CONN_PENDING];
+		if (conn_holds(conn, buf) || conn_send_msg(reactor, conn, buf) != 0)
+			break;
+
+		buf_unref(buf);
+		conn->pending_head++;
+		if (conn->credited)
+			conn->credit--;
+	}
+
+	peer_gauges(conn->peer);
+}
+
+/* tops up the credits of an inbound conn, TRUE while it waits for tokens */
+static int
+conn_grant(reactor_t *reactor, conn_t *conn)
+{
+	ratelimit_t *limit = &conn->peer->msg_limit;
+	char line[LINESIZE];
+	int window, n;
+
+	/* legacy peers would take a credit line for chat */
+	if (!conn->synced)
+		return FALSE;
+
+	/* never promise more than the bucket can hold */
+	window = CREDIT_WINDOW;
+	if (limit->rate && limit->burst < window)
+		window = limit->burst;
+
+	if (conn->credit > window / 2)
+		return FALSE;
+
+	n = ratelimit_take_upto(limit, window - conn->credit);
+	if (n > 0) {
+		conn->credit += n;
+		snprintf(line, LINESIZE, "credit %d\n", n);
+		conn_write(reactor, conn, line, strlen(line));
+	}
+
+	return conn->credit <= window / 2;
+}
+
+/* the receiver let us send n more messages */
+static void
+conn_credit(reactor_t *reactor, conn_t *conn, int n)
+{
+	conn->credited = TRUE;
+	conn->credit += n;
+	conn_release(reactor, conn);
+}
+
+/* queues buf if any on lane and drops our reference */
+static int
+conn_announce(reactor_t *reactor, conn_t *conn, buf_t *buf, int lane)
+{
+	int rc;
+
+	if (buf == NULL)
+		return 0;
+
+	rc = conn_send_buf(reactor, conn, buf, lane);
+	buf_unref(buf);
+	return rc;
+}
+
+/* the receiver speaks the protocol, resend whatever it may have missed */
+static void
+conn_proto(reactor_t *reactor, conn_t *conn, int version)
+{
+	delivery_t *delivery = &conn->peer->delivery;
+	unacked_t *entry;
+	char line[LINESIZE];
+	uint64_t seq;
+
+	if (version < PROTO_VERSION || conn->seqs)
+		return;
+
+	conn->seqs = TRUE;
+	snprintf(line, LINESIZE, "sync %lu %lu\n", (unsigned long)self_epoch,
+		(unsigned long)delivery->una);
+	conn_write(reactor, conn, line, strlen(line));
+
+	for (seq = delivery->una; seq < delivery->next_seq; seq++) {
+		entry = &delivery->unacked[seq % SEQ_WINDOW];
+		if (entry->sacked)
+			continue;
+
+		if (conn_queue(conn, msg_lane(entry->payload), entry->header, TRUE) != 0 ||
+		    conn_queue(conn, msg_lane(entry->payload), entry->payload, FALSE) != 0)
+			break;
+		__atomic_add_fetch(&delivery->resent, 1, __ATOMIC_RELAXED);
+	}
+
+	route_link(conn->peer, TRUE);
+
+	/*
+	 * the peer forgot our channels on seeing the id, and learns our links.
+	 * Subscriptions go with the later sub and unsub lines they must not
+	 * overtake; link lines are versioned and can take the bulk lane.
+	 */
+	if (conn_announce(reactor, conn, channel_announce(), LANE_CONTROL) != 0 ||
+	    conn_announce(reactor, conn, route_announce(), LANE_BULK) != 0) {
+		conn_close(reactor, conn, FALSE);
+		return;
+	}
+
+	conn_release(reactor, conn);
+	conn_push(reactor, conn);
+}
+
+/* acks for what we sent, on either of the peer's conns */
+static void
+conn_ack(reactor_t *reactor, conn_t *conn, const char *args)
+{
+	peer_info_t *peer_info = conn->peer;
+	unsigned long epoch;
+	char *end;
+
+	epoch = strtoul(args, &end, 10);
+	if (epoch != self_epoch || *end != ' ')
+		return;
+
+	if (delivery_acked(&peer_info->delivery, end + 1) > 0 && peer_info->conn_out)
+		conn_release(reactor, peer_info->conn_out);
+	else
+		peer_gauges(peer_info);
+}
+
+/* charges an incoming message to its peer, -1 if it has to be dropped */
+static int
+conn_admit(conn_t *conn)
+{
+	peer_info_t *peer_info = conn->peer;
+	char line[LINESIZE];
+
+	if (!conn->outbound && conn->credit > 0) {
+		conn->credit--;
+		conn->dropping = FALSE;
+		return 0;
+	}
+
+	/* beyond its credits, a peer that ignores them or one of our replies */
+	if (ratelimit_take(&peer_info->msg_limit) == 0) {
+		conn->dropping = FALSE;
+		return 0;
+	}
+
+	metric_peer_add(peer_info, MP_MSGS_DROPPED, 1);
+	if (!conn->dropping) {
+		conn->dropping = TRUE;
+		snprintf(line, LINESIZE, "%s is over its rate limit, dropping messages",
+			peer_info->id);
+		chat_writeln(TRUE, LOG_WARNING, line);
+	}
+
+	return -1;
+}
+
+static void
+conn_adopt(reactor_t *reactor, conn_t *conn)
+{
+	peer_info_t *peer_info = conn->peer;
+	char line[LINESIZE];
+
+	conn_link(reactor, conn);
+
+	if (peer_info->conn_in) {
+		snprintf(line, LINESIZE, "%s is already connected\n", peer_info->id);
+		send(conn->fd, line, strlen(line), MSG_NOSIGNAL);
+		conn->peer = NULL;
+		conn_close(reactor, conn, FALSE);
+		return;
+	}
+
+	peer_info->conn_in = conn;
+	/* its sub lines follow the id */
+	channel_forget(peer_info);
+
+	membership_write_begin();
+	MEMBERSHIP_SET(peer_info->connected_in, TRUE);
+	membership_write_end();
+
+	reactor->backend->watch(reactor, conn);
+#ifdef DEBUG
+	snprintf(line, LINESIZE, "tcp connection identified itself as %s, served by reactor %d",
+		peer_info->id, reactor->id);
+	chat_writeln(TRUE, LOG_DEBUG, line);
+#endif
+	update_peer_status(peer_info, TRUE);
+
+	snprintf(line, LINESIZE, "proto %d\n", PROTO_VERSION);
+	conn_write(reactor, conn, line, strlen(line));
+
+	if (conn_grant(reactor, conn))
+		reactor->starved = TRUE;
+
+	/* lines that arrived together with the id */
+	if (conn->rlen)
+		conn_process(reactor, conn);
+}
+
+/* resends the broadcasts a peer missed on the multicast group */
+static void
+conn_repair(reactor_t *reactor, conn_t *conn, const char *args)
+{
+	conn_t *out = conn->peer->conn_out;
+	buf_t *buf;
+
+	buf = mcast_nacked(args);
+	if (buf == NULL)
+		return;
+
+	conn_send_buf(reactor, out && !out->connecting ? out : conn, buf, LANE_BULK);
+	buf_unref(buf);
+}
+
+/* answers a link offer, the fds came along the id line */
+static void
+conn_answer(reactor_t *reactor, conn_t *conn)
+{
+	const char *answer = "shm no\n";
+	shm_link_t *link = NULL;
+
+	if (conn->local && conn->nfds == SHM_FDS &&
+	    transport == TRANSPORT_SHM && reactor->backend->local)
+		link = shm_attach(conn->fds);
+	else
+		while (conn->nfds)
+			close(conn->fds[--conn->nfds]);
+	conn->nfds = 0;
+
+	if (link)
+		answer = "shm ok\n";
+
+	/* not queued, everything after it goes to the rings */
+	if (send(conn->fd, answer, strlen(answer), MSG_NOSIGNAL) != (ssize_t)strlen(answer)) {
+		if (link)
+			shm_destroy(link);
+		return;
+	}
+
+	conn->shm = link;
+}
+
+/* the peer took our link or turned it down, -1 if held output can't go */
+static int
+conn_negotiated(reactor_t *reactor, conn_t *conn, int ok)
+{
+	if (ok)
+		conn->shm = conn->offer;
+	else
+		shm_destroy(conn->offer);
+
+	conn->offer = NULL;
+	conn->negotiating = FALSE;
+	peer_gauges(conn->peer);
+
+	reactor->backend->watch(reactor, conn);
+	return conn->wlen ? conn_flush(reactor, conn) : 0;
+}
+
+/* a message published to a channel, shown only while we are in it */
+static void
+conn_channel(conn_t *conn, char *args)
+{
+	char *message = strchr(args, ' ');
+
+	if (message == NULL)
+		return;
+
+	*message = '\0';
+	if (!channel_joined(args))
+		return;
+
+	*message = ' ';
+	metric_peer_add(conn->peer, MP_MSGS_RECEIVED, 1);
+	chat_message(MSGDIR_IN, conn->peer->id, args);
+}
+
+#define VERB(word, verb) \
+	if (len >= sizeof(word) - 1 && memcmp(line, word, sizeof(word) - 1) == 0) \
+		return verb
+
+/* a switch on the first byte, then at most two compares */
+static verb_t
+line_verb(const char *line, size_t len)
+{
+	switch (line[0]) {
+	case 'a':
+		VERB("ack ", VERB_ACK);
+		break;
+	case 'c':
+		VERB("chan ", VERB_CHAN);
+		VERB("credit ", VERB_CREDIT);
+		break;
+	case 'e':
+		VERB("exec", VERB_EXEC);
+		break;
+	case 'f':
+		VERB("fwd ", VERB_FWD);
+		break;
+	case 'i':
+		VERB("id ", VERB_ID);
+		break;
+	case 'l':
+		VERB("leave", VERB_LEAVE);
+		VERB("link ", VERB_LINK);
+		break;
+	case 'm':
+		VERB("mcast ", VERB_MCAST);
+		VERB("msg ", VERB_MSG);
+		break;
+	case 'n':
+		VERB("nack ", VERB_NACK);
+		break;
+	case 'p':
+		VERB("proto ", VERB_PROTO);
+		break;
+	case 's':
+		VERB("seq ", VERB_SEQ);
+		VERB("shm ", VERB_SHM);
+		VERB("sub ", VERB_SUB);
+		VERB("sync ", VERB_SYNC);
+		break;
+	case 'u':
+		VERB("unsub ", VERB_UNSUB);
+		break;
+	}
+
+	return VERB_NONE;
+}
+
+#undef VERB
+
+/* line is len bytes of rbuf, terminated in place */
+static line_action_t
+conn_line(reactor_t *reactor, conn_t *conn, char *line, size_t len)
+{
+	char reply[LINESIZE];
+	peer_info_t *peer_info;
+	unsigned long seq, ts, epoch, una;
+	char *offer;
+	verb_t verb;
+	int off, negotiated;
+
+	verb = line_verb(line, len);
+
+	if (!conn->outbound && !conn->peer) {
+		if (verb == VERB_ID) {
+			/* id <name> shm, see reactor.h */
+			offer = strchr(line + 3, ' ');
+			if (offer)
+				*offer++ = '\0';
+
+			peer_info = g_hash_table_lookup(peers_by_id, line + 3);
+			if (peer_info) {
+				conn->peer = peer_info;
+				if (offer && strcmp(offer, "shm") == 0)
+					conn_answer(reactor, conn);
+				return LINE_ADOPT;
+			}
+
+			snprintf(reply, LINESIZE, "unregistered id %s\n", line + 3);
+			conn_write(reactor, conn, reply, strlen(reply));
+		}
+
+		snprintf(reply, LINESIZE, "please identify by sending: id <name>\n");
+		conn_write(reactor, conn, reply, strlen(reply));
+		return LINE_OK;
+	}
+
+	/* past the handshake, a legacy peer's lines are all chat */
+	negotiated = conn->outbound ? conn->seqs : conn->synced;
+
+	switch (verb) {
+	case VERB_SHM:
+		if (!conn->outbound || !conn->negotiating)
+			break;
+		if (conn_negotiated(reactor, conn, strcmp(line + 4, "ok") == 0) != 0)
+			return LINE_CLOSE;
+		return LINE_OK;
+	case VERB_LEAVE:
+		return LINE_CLOSE;
+	case VERB_ACK:
+		if (!negotiated)
+			break;
+		conn_ack(reactor, conn, line + 4);
+		return LINE_OK;
+	case VERB_NACK:
+		if (!negotiated)
+			break;
+		conn_repair(reactor, conn, line + 5);
+		return LINE_OK;
+	case VERB_MCAST:
+		if (!negotiated)
+			break;
+		mcast_repaired(conn->peer, line + 6);
+		return LINE_OK;
+	case VERB_LINK:
+		if (!negotiated)
+			break;
+		route_update(conn->peer, line + 5);
+		return LINE_OK;
+	case VERB_SUB:
+	case VERB_UNSUB:
+		if (!negotiated)
+			break;
+		channel_subscribe(conn->peer, strchr(line, ' ') + 1, verb == VERB_SUB);
+		return LINE_OK;
+	case VERB_CREDIT:
+		if (!conn->outbound || !negotiated)
+			break;
+		conn_credit(reactor, conn, atoi(line + 7));
+		return LINE_OK;
+	case VERB_PROTO:
+		if (!conn->outbound)
+			break;
+		conn_proto(reactor, conn, atoi(line + 6));
+		return LINE_OK;
+	case VERB_SYNC:
+		if (conn->outbound)
+			break;
+		/* una is missing from older peers */
+		una = 0;
+		if (sscanf(line + 5, "%lu %lu", &epoch, &una) < 1)
+			return LINE_OK;
+		delivery_sync(&conn->peer->delivery, epoch, una);
+		conn->synced = TRUE;
+		return LINE_OK;
+	default:
+		break;
+	}
+
+	if (conn_admit(conn) != 0)
+		return LINE_OK;
+
+	if (negotiated && verb == VERB_SEQ) {
+		if (sscanf(line + 4, "%lu %lu %n", &seq, &ts, &off) < 2)
+			return LINE_OK;
+
+		reactor->acks_pending = TRUE;
+		if (delivery_receive(&conn->peer->delivery, seq, ts) != 0)
+			return LINE_OK;
+
+		line += 4 + off;
+		len -= 4 + off;
+		verb = line_verb(line, len);
+		capture(CAP_TCP_IN, conn->peer->index, line, len);
+
+		/* the frame says what it is, chat text is never looked into */
+		if (verb == VERB_MSG) {
+			line += 4;
+			len -= 4;
+			verb = VERB_NONE;
+		}
+		else if (verb != VERB_CHAN && verb != VERB_FWD && verb != VERB_EXEC) {
+			return LINE_OK;
+		}
+	}
+	else {
+		/* a legacy line, chat or exec like the first chet2p had */
+		if (negotiated || verb != VERB_EXEC)
+			verb = VERB_NONE;
+		if (capturing) {
+			snprintf(reply, LINESIZE, "%s%.*s", verb == VERB_NONE ? "msg " : "",
+				(int)len, line);
+			capture(CAP_TCP_IN, conn->peer->index, reply, strlen(reply));
+		}
+	}
+
+	switch (verb) {
+	case VERB_CHAN:
+		conn_channel(conn, line + 5);
+		break;
+	case VERB_FWD:
+		route_forward(conn->peer, line + 4);
+		break;
+	case VERB_EXEC:
+		if (ratelimit_take(&conn->peer->exec_limit) != 0) {
+			metric_peer_add(conn->peer, MP_EXECS_DROPPED, 1);
+			snprintf(reply, LINESIZE, "exec from %s dropped, rate limit exceeded",
+				conn->peer->id);
+			chat_writeln(TRUE, LOG_WARNING, reply);
+			return LINE_OK;
+		}
+
+		metric_peer_add(conn->peer, MP_EXECS_RECEIVED, 1);
+		snprintf(reply, LINESIZE, "exec %s", line + 5);
+		chat_writeln(TRUE, LOG_NOTICE, reply);
+		exec_command(line + 5);
+		break;
+	default:
+		/* a view into rbuf, nothing copied on the way to the screen */
+		metric_peer_add(conn->peer, MP_MSGS_RECEIVED, 1);
+		chat_message(MSGDIR_IN, conn->peer->id, line);
+	}
+
+	return LINE_OK;
+}
+
+void
+conn_handoff(reactor_t *reactor, conn_t *conn)
+{
+	reactor_t *owner;
+	rmsg_t msg;
+
+	/* the new owner flushes whatever is still queued */
+	conn->detaching = FALSE;
+	conn_uncork(reactor, conn);
+	conn_unlink(reactor, conn);
+
+	owner = peer_reactor(conn->peer);
+	if (owner == reactor) {
+		conn_adopt(reactor, conn);
+	}
+	else {
+		msg.type = RMSG_ADOPT;
+		msg.peer = conn->peer;
+		msg.conn = conn;
+		msg.buf = NULL;
+		reactor_post(owner, &msg);
+	}
+}
+
+/* an overlong line is delivered in WIRE_LINE pieces, up to end */
+static line_action_t
+conn_pieces(reactor_t *reactor, conn_t *conn, char **line, char *end)
+{
+	line_action_t action = LINE_OK;
+	char saved;
+
+	while (action == LINE_OK && end - *line > WIRE_LINE) {
+		saved = (*line)[WIRE_LINE];
+		(*line)[WIRE_LINE] = '\0';
+		action = conn_line(reactor, conn, *line, WIRE_LINE);
+		(*line)[WIRE_LINE] = saved;
+		*line += WIRE_LINE;
+	}
+
+	return action;
+}
+
+/* dispatches the complete lines in data, used gets the bytes consumed */
+static line_action_t
+conn_lines(reactor_t *reactor, conn_t *conn, char *data, size_t size, size_t *used)
+{
+	uint32_t ends[SCAN_BATCH];
+	char *line, *base, *eol, *end;
+	line_action_t action = LINE_OK;
+	uint64_t start, now;
+	size_t len;
+	int i, n;
+
+	line = data;
+	end = data + size;
+	start = reactor_clock();
+
+	/* every line end of the buffer in one pass, then dispatch them all */
+	while (action == LINE_OK && line < end &&
+	       (n = scan_lines(line, end - line, ends, SCAN_BATCH)) > 0) {
+		base = line;
+		for (i = 0; i < n && action == LINE_OK; i++) {
+			eol = base + ends[i];
+			if ((action = conn_pieces(reactor, conn, &line, eol)) != LINE_OK)
+				break;
+
+			len = eol - line;
+			*eol = '\0';
+			if (len && line[len - 1] == '\r')
+				line[--len] = '\0';
+
+			/* one clock read a line, a line's time starts where the last one's ended */
+			TRACE_BEGIN(line);
+			action = conn_line(reactor, conn, line, len);
+			TRACE_END(line);
+			now = reactor_clock();
+			metric_record(MH_LINE_NS, now - start);
+			start = now;
+			metric_add(MC_LINES, 1);
+			line = eol + 1;
+		}
+	}
+
+	if (action == LINE_OK)
+		action = conn_pieces(reactor, conn, &line, end);
+
+	if (conn->peer)
+		metric_peer_add(conn->peer, MP_BYTES_RECEIVED, line - data);
+
+	*used = line - data;
+	return action;
+}
+
+/* acts on the last line's verdict, -1 once conn is no longer ours */
+static int
+conn_settle(reactor_t *reactor, conn_t *conn, line_action_t action)
+{
+	switch (action) {
+	case LINE_OK:
+		if (!conn->outbound && conn->peer && conn_grant(reactor, conn))
+			reactor->starved = TRUE;
+		return 0;
+	case LINE_CLOSE:
+		conn_close(reactor, conn, TRUE);
+		return -1;
+	case LINE_ADOPT:
+		/* wait for the backend to let go of it before moving shards */
+		conn->detaching = TRUE;
+		if (reactor->backend->unwatch(reactor, conn) == 0)
+			conn_handoff(reactor, conn);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* returns -1 once conn is no longer served by this reactor */
+int
+conn_process(reactor_t *reactor, conn_t *conn)
+{
+	line_action_t action;
+	size_t used;
+
+	action = conn_lines(reactor, conn, conn->rbuf, conn->rlen, &used);
+	conn->rlen -= used;
+	memmove(conn->rbuf, conn->rbuf + used, conn->rlen);
+
+	return conn_settle(reactor, conn, action);
+}
+
+void
+conn_received(reactor_t *reactor, conn_t *conn, char *data, size_t len)
+{
+	line_action_t action;
+	size_t chunk, used;
+
+	/* nothing pending: lines are parsed where they landed, only a tail is kept */
+	if (conn->rlen == 0 && len <= CONN_RBUF) {
+		action = conn_lines(reactor, conn, data, len, &used);
+		conn->rlen = len - used;
+		memcpy(conn->rbuf, data + used, conn->rlen);
+		conn_settle(reactor, conn, action);
+		return;
+	}
+
+	while (len) {
+		chunk = CONN_RBUF - conn->rlen;
+		if (chunk > len)
+			chunk = len;
+
+		memcpy(conn->rbuf + conn->rlen, data, chunk);
+		conn->rlen += chunk;
+		data += chunk;
+		len -= chunk;
+
+		if (conn_process(reactor, conn) != 0)
+			return;
+	}
+}
+
+void
+conn_failed(reactor_t *reactor, conn_t *conn)
+{
+	conn_close(reactor, conn, FALSE);
+}
+
+/* on our own address or on loopback, so most likely on this host */
+static int
+peer_local(const peer_info_t *peer_info)
+{
+	return peer_info->in_addr == self_info->in_addr ||
+		(ntohl(peer_info->in_addr) >> 24) == 127;
+}
+
+/* the abstract unix socket a peer listens on, returns its length */
+static socklen_t
+local_addr(struct sockaddr_un *addr, const peer_info_t *peer_info)
+{
+	char host[INET_ADDRSTRLEN];
+	int len;
+
+	inet_ntop(AF_INET, &peer_info->in_addr, host, sizeof(host));
+
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "chet2p-%s:%d",
+		host, ntohs(peer_info->tcp_port));
+
+	return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+static void
+conn_connect_failed(reactor_t *reactor, peer_info_t *peer_info, int local);
+
+static void
+conn_dial(reactor_t *reactor, peer_info_t *peer_info, int local)
+{
+	struct sockaddr_in *sin;
+	conn_t *conn;
+	int sockfd;
+
+	sockfd = socket(local ? PF_UNIX : PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (sockfd == -1) {
+		conn_connect_failed(reactor, peer_info, local);
+		return;
+	}
+
+	conn = conn_new(reactor, sockfd, peer_info, TRUE);
+	conn->connecting = TRUE;
+	conn->local = local;
+	if (local) {
+		conn->addrlen = local_addr((struct sockaddr_un *)&conn->addr, peer_info);
+	}
+	else {
+		sin = (struct sockaddr_in *)&conn->addr;
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = peer_info->in_addr;
+		sin->sin_port = peer_info->tcp_port;
+		conn->addrlen = sizeof(struct sockaddr_in);
+	}
+	peer_info->conn_out = conn;
+
+	reactor->backend->connect(reactor, conn);
+}
+
+/* sends our id offering a shared memory link, 0 once it is out */
+static int
+conn_offer(reactor_t *reactor, conn_t *conn)
+{
+	char control[CMSG_SPACE(SHM_FDS * sizeof(int))];
+	char line[LINESIZE];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	int fds[SHM_FDS];
+	shm_link_t *link;
+	int len;
+
+	link = shm_create(fds);
+	if (link == NULL)
+		return -1;
+
+	len = snprintf(line, LINESIZE, "id %s shm\n", self_info->id);
+	iov.iov_base = line;
+	iov.iov_len = len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	/* the peer gets its own copies, ours stay with the link */
+	if (sendmsg(conn->fd, &msg, MSG_NOSIGNAL) != len) {
+		shm_destroy(link);
+		return -1;
+	}
+
+	conn->offer = link;
+	conn->negotiating = TRUE;
+	return 0;
+}
+
+static void
+conn_connected(reactor_t *reactor, conn_t *conn)
+{
+	peer_info_t *peer_info = conn->peer;
+	char buffer[BUFFSIZE];
+#ifdef DEBUG
+	struct in_addr in_addr;
+
+	in_addr.s_addr = peer_info->in_addr;
+	snprintf(buffer, BUFFSIZE, "connected to peer %s@%s:%d, sending id",
+		peer_info->id,
+		inet_ntoa(in_addr),
+		ntohs(peer_info->tcp_port));
+	chat_writeln(TRUE, LOG_DEBUG, buffer);
+#endif
+	conn->connecting = FALSE;
+	metric_peer_add(peer_info, MP_CONNECTS, 1);
+	__atomic_store_n(&peer_info->warm, FALSE, __ATOMIC_RELAXED);
+
+	membership_write_begin();
+	MEMBERSHIP_SET(peer_info->connected, TRUE);
+	membership_write_end();
+
+	if (conn->local && transport == TRANSPORT_SHM && reactor->backend->local)
+		conn_offer(reactor, conn);
+
+	reactor->backend->watch(reactor, conn);
+	peer_gauges(peer_info);
+
+	if (!conn->negotiating) {
+		snprintf(buffer, BUFFSIZE, "id %s\n", self_info->id);
+		if (conn_write(reactor, conn, buffer, strlen(buffer)) != 0) {
+			conn_close(reactor, conn, FALSE);
+			return;
+		}
+	}
+
+	/* links and subscriptions wait for the peer's proto */
+}
+
+/* the dial is gone by now, either closed or never got a socket */
+static void
+conn_connect_failed(reactor_t *reactor, peer_info_t *peer_info, int local)
+{
+	char buffer[BUFFSIZE];
+	struct in_addr in_addr;
+
+	if (local) {
+		/* nobody on its unix socket, try tcp */
+		conn_dial(reactor, peer_info, FALSE);
+		return;
+	}
+
+	in_addr.s_addr = peer_info->in_addr;
+	snprintf(buffer, BUFFSIZE, "error connecting to peer %s@%s:%d",
+		peer_info->id,
+		inet_ntoa(in_addr),
+		ntohs(peer_info->tcp_port));
+	chat_writeln(TRUE, LOG_ERR, buffer);
+
+	/* the snapshot was wrong, don't wait for the probe to say so */
+	if (__atomic_exchange_n(&peer_info->warm, FALSE, __ATOMIC_RELAXED))
+		update_peer_status(peer_info, FALSE);
+}
+
+void
+conn_connect_done(reactor_t *reactor, conn_t *conn, int error)
+{
+	peer_info_t *peer_info = conn->peer;
+	int local = conn->local;
+
+	if (error) {
+		conn_close(reactor, conn, FALSE);
+		conn_connect_failed(reactor, peer_info, local);
+	}
+	else
+		conn_connected(reactor, conn);
+}
+
+static void
+reactor_do_connect(reactor_t *reactor, peer_info_t *peer_info)
+{
+	if (peer_info->conn_out)
+		return;
+
+	conn_dial(reactor, peer_info, transport != TRANSPORT_TCP &&
+		reactor->backend->local && peer_local(peer_info));
+}
+
+static void
+reactor_do_send(reactor_t *reactor, peer_info_t *peer_info, buf_t *buf, int echo)
+{
+	char buffer[BUF_DATA];
+	conn_t *conn = peer_info->conn_out;
+	int len;
+
+	if (conn == NULL || conn->connecting) {
+		snprintf(buffer, BUFFSIZE, "error sending message: %s not connected",
+			peer_info->id);
+		chat_writeln(TRUE, LOG_ERR, buffer);
+		return;
+	}
+
+	if (conn_blocked(conn) || conn_holds(conn, buf) ||
+	    conn->pending_head != conn->pending_tail) {
+		/* out of credit or window, hold it until the receiver catches up */
+		if (conn->pending_tail - conn->pending_head == CONN_PENDING) {
+			snprintf(buffer, BUFFSIZE, "error sending message: %s is not keeping up",
+				peer_info->id);
+			chat_writeln(TRUE, LOG_ERR, buffer);
+			return;
+		}
+
+		conn->pending[conn->pending_tail++ % CONN_PENDING] = buf_ref(buf);
+		metric_peer_add(peer_info, MP_MSGS_THROTTLED, 1);
+		peer_gauges(peer_info);
+	}
+	else if (conn_send_msg(reactor, conn, buf) == 0) {
+		if (conn->credited)
+			conn->credit--;
+	}
+	else {
+		snprintf(buffer, BUFFSIZE, "error sending message: %s", strerror(errno));
+		chat_writeln(TRUE, LOG_ERR, buffer);
+		conn_close(reactor, conn, FALSE);
+		return;
+	}
+
+	/* recorded as the frame it goes as, see capture.h */
+	if (capturing) {
+		len = snprintf(buffer, BUF_DATA, "%s%.*s", buf->frame ? "" : "msg ",
+			(int)buf->len - 1, buf->data);
+		capture(CAP_TCP_OUT, peer_info->index, buffer, len < BUFFSIZE ? len : BUFFSIZE);
+	}
+	if (!echo)
+		return;
+
+	/* a line buffer, echo it without the newline */
+	memcpy(buffer, buf->data, buf->len - 1);
+	buffer[buf->len - 1] = '\0';
+	chat_message(MSGDIR_OUT, peer_info->id, buffer);
+}
+
+static void
+reactor_do_control(reactor_t *reactor, peer_info_t *peer_info, buf_t *buf)
+{
+	conn_t *conn = peer_info->conn_out;
+
+	/* either way it has to speak the protocol, what it missed is announced then */
+	if (conn == NULL || !conn->seqs)
+		conn = peer_info->conn_in;
+	if (conn && !conn->seqs && !conn->synced)
+		conn = NULL;
+
+	if (conn && conn_send_buf(reactor, conn, buf, LANE_CONTROL) != 0)
+		conn_close(reactor, conn, FALSE);
+}
+
+static void
+reactor_handle(reactor_t *reactor, rmsg_t *msg)
+{
+	switch (msg->type) {
+	case RMSG_SEND:
+		reactor_do_send(reactor, msg->peer, msg->buf, TRUE);
+		buf_unref(msg->buf);
+		break;
+	case RMSG_PUBLISH:
+		reactor_do_send(reactor, msg->peer, msg->buf, FALSE);
+		buf_unref(msg->buf);
+		break;
+	case RMSG_CONTROL:
+		reactor_do_control(reactor, msg->peer, msg->buf);
+		buf_unref(msg->buf);
+		break;
+	case RMSG_CONNECT:
+		reactor_do_connect(reactor, msg->peer);
+		break;
+	case RMSG_ADOPT:
+		conn_adopt(reactor, msg->conn);
+		break;
+	case RMSG_STOP:
+		reactor->running = FALSE;
+		break;
+	}
+}
+
+/* retries the conns that ran out of tokens while granting credits */
+static void
+reactor_grant(reactor_t *reactor)
+{
+	conn_t *conn;
+
+	if (!reactor->starved)
+		return;
+
+	reactor->starved = FALSE;
+	for (conn = reactor->conns; conn; conn = conn->next) {
+		if (!conn->outbound && conn->peer && conn_grant(reactor, conn))
+			reactor->starved = TRUE;
+	}
+}
+
+/* sends the acks we owe, along our own messages to the peer if any wait */
+static void
+reactor_ack(reactor_t *reactor)
+{
+	peer_info_t *peer_info;
+	conn_t *conn, *out;
+	char line[LINESIZE];
+	int len;
+
+	if (!reactor->acks_pending)
+		return;
+
+	reactor->acks_pending = FALSE;
+	for (conn = reactor->conns; conn; conn = conn->next) {
+		peer_info = conn->peer;
+		if (conn->outbound || peer_info == NULL || peer_info->conn_in != conn ||
+		    !peer_info->delivery.ack_pending)
+			continue;
+
+		len = delivery_ack_line(&peer_info->delivery, line, LINESIZE);
+		out = peer_info->conn_out;
+		conn_write(reactor, out && out->corked ? out : conn, line, len);
+	}
+}
+
+/* flushes the corked conns whose latency budget ran out */
+static void
+reactor_expire(reactor_t *reactor)
+{
+	conn_t *conn;
+	uint64_t now;
+
+	if (reactor->corked_head == NULL)
+		return;
+
+	now = reactor_clock();
+	while ((conn = reactor->corked_head) && conn->deadline <= now) {
+		if (conn_flush(reactor, conn) != 0)
+			conn_failed(reactor, conn);
+	}
+
+	if (reactor->corked_head)
+		reactor_arm(reactor);
+}
+
+static void
+reactor_drain(reactor_t *reactor)
+{
+	rmsg_t msg;
+	int i, budget;
+
+	for (i = 0; i < nreactors; i++) {
+		budget = REACTOR_QUEUE;
+		while (budget-- && spsc_pop(&reactor->inbox[i], &msg) == 0)
+			reactor_handle(reactor, &msg);
+	}
+
+	budget = REACTOR_QUEUE;
+	while (budget-- && spsc_pop(&reactor->external, &msg) == 0)
+		reactor_handle(reactor, &msg);
+}
+
+void
+conn_accepted(reactor_t *reactor, int fd, int local)
+{
+	conn_t *conn;
+#ifdef DEBUG
+	struct sockaddr_in peeraddr;
+	socklen_t peeraddrl = sizeof(peeraddr);
+	char line[LINESIZE];
+
+	if (local) {
+		snprintf(line, LINESIZE, "accepted unix connection in reactor %d, waiting for id",
+			reactor->id);
+	}
+	else {
+		getpeername(fd, (struct sockaddr *)&peeraddr, &peeraddrl);
+		snprintf(line, LINESIZE, "accepted tcp connection from anon@%s:%d in reactor %d, waiting for id",
+			inet_ntoa(peeraddr.sin_addr), ntohs(peeraddr.sin_port),
+			reactor->id);
+	}
+	chat_writeln(TRUE, LOG_DEBUG, line);
+#endif
+	metric_add(MC_CONNS_ACCEPTED, 1);
+	conn = conn_new(reactor, fd, NULL, FALSE);
+	conn->local = local;
+	reactor->backend->watch(reactor, conn);
+}
+
+/* co-located peers dial this one first, see reactor.h */
+static void
+reactor_listen_local(reactor_t *reactor)
+{
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	char line[LINESIZE];
+
+	addrlen = local_addr(&addr, self_info);
+	reactor->unixsk = socket(PF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+	if (bind(reactor->unixsk, (struct sockaddr *)&addr, addrlen) != 0) {
+		snprintf(line, LINESIZE, "error binding to unix socket @%s, co-located peers will use tcp",
+			addr.sun_path + 1);
+		chat_writeln(TRUE, LOG_WARNING, line);
+		close(reactor->unixsk);
+		reactor->unixsk = -1;
+		return;
+	}
+
+	/* a refused dial falls back to tcp, leave room for every peer */
+	listen(reactor->unixsk, SOMAXCONN);
+
+	snprintf(line, LINESIZE, "listening for local conns in @%s (%s)",
+		addr.sun_path + 1, transport == TRANSPORT_SHM ? "shm" : "unix");
+	chat_writeln(TRUE, LOG_INFO, line);
+}
+
+static int
+reactor_listen(reactor_t *reactor)
+{
+	struct sockaddr_in srvaddr;
+	char line[LINESIZE];
+	int one = 1;
+
+	/* up before tcp, a peer dialing in between would settle for tcp */
+	if (reactor->id == 0 && transport != TRANSPORT_TCP && reactor->backend->local)
+		reactor_listen_local(reactor);
+
+	reactor->listensk = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	setsockopt(reactor->listensk, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	setsockopt(reactor->listensk, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+	memset(&srvaddr, 0, sizeof(srvaddr));
+	srvaddr.sin_family = AF_INET;
+	srvaddr.sin_addr.s_addr = self_info->in_addr;
+	srvaddr.sin_port = self_info->tcp_port;
+
+	if (bind(reactor->listensk, (struct sockaddr *)&srvaddr, sizeof(srvaddr)) != 0) {
+		snprintf(line, LINESIZE, "error binding to tcp port %d, exiting",
+			ntohs(srvaddr.sin_port));
+		chat_writeln(TRUE, LOG_CRIT, line);
+		return -1;
+	}
+
+	listen(reactor->listensk, SOMAXCONN);
+	reactor->backend->listen(reactor);
+
+	if (reactor->id == 0) {
+		snprintf(line, LINESIZE, "listening for tcp conns in %s:%d (%d %s reactor%s)",
+			inet_ntoa(srvaddr.sin_addr),
+			ntohs(srvaddr.sin_port),
+			nreactors, reactor->backend->name,
+			nreactors > 1 ? "s" : "");
+		chat_writeln(TRUE, LOG_INFO, line);
+	}
+
+	return 0;
+}
+
+static void
+reactor_pin(reactor_t *reactor)
+{
+	cpu_set_t cpuset;
+	long ncpus;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nreactors < 2 || ncpus < 2)
+		return;
+
+	CPU_ZERO(&cpuset);
+	CPU_SET(reactor->id % ncpus, &cpuset);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+}
+
+static void
+reactor_teardown(reactor_t *reactor)
+{
+	conn_t *conn;
+	peer_info_t *peer_info;
+
+	for (conn = reactor->conns; conn; conn = conn->next) {
+		peer_info = conn->peer;
+		if (peer_info && (peer_info->conn_in == conn || peer_info->conn_out == conn)) {
+			membership_write_begin();
+			if (peer_info->conn_in == conn) {
+				peer_info->conn_in = NULL;
+				MEMBERSHIP_SET(peer_info->connected_in, FALSE);
+			}
+			else {
+				peer_info->conn_out = NULL;
+				MEMBERSHIP_SET(peer_info->connected, FALSE);
+			}
+			membership_write_end();
+		}
+	}
+
+	/* drops whatever the backend still has in flight */
+	reactor->backend->destroy(reactor);
+
+	while ((conn = reactor->conns)) {
+		conn_unlink(reactor, conn);
+		close(conn->fd);
+		conn_free(conn);
+	}
+
+	close(reactor->listensk);
+	if (reactor->unixsk >= 0)
+		close(reactor->unixsk);
+	close(reactor->evfd);
+	close(reactor->timerfd);
+}
+
+static void *
+reactor_run(void *data)
+{
+	reactor_t *reactor = data;
+	int timeout;
+
+	current_reactor = reactor;
+	reactor_pin(reactor);
+	TRACE_THREAD("reactor %d", reactor->id);
+
+	if (reactor_listen(reactor) != 0) {
+		sleep(3);
+		pthread_kill(main_tid, SIGINT);
+		return NULL;
+	}
+
+	while (reactor->running) {
+		reactor_flush_backlog(reactor);
+		reactor_drain(reactor);
+		if (!reactor->running)
+			break;
+
+		reactor_grant(reactor);
+		reactor_ack(reactor);
+		reactor_expire(reactor);
+
+		__atomic_store_n(&reactor->sleeping, TRUE, __ATOMIC_SEQ_CST);
+		if (reactor_pending(reactor))
+			timeout = 0;
+		else if (reactor->backlog)
+			timeout = 1;
+		else
+			timeout = reactor->starved ? CREDIT_TICK : -1;
+
+		TRACE_BEGIN(wait);
+		reactor->backend->wait(reactor, timeout);
+		TRACE_END(wait);
+		__atomic_store_n(&reactor->sleeping, FALSE, __ATOMIC_RELAXED);
+	}
+
+	reactor_teardown(reactor);
+	return NULL;
+}
+
+static const backend_t *
+reactor_backend(const char *name)
+{
+	char line[LINESIZE];
+
+	if (name == NULL || strcmp(name, epoll_backend.name) == 0)
+		return &epoll_backend;
+
+	if (strcmp(name, uring_backend.name) == 0) {
+		if (uring_probe() == 0)
+			return &uring_backend;
+
+		snprintf(line, LINESIZE, "%s backend not supported by this kernel, falling back to %s",
+			uring_backend.name, epoll_backend.name);
+	}
+	else {
+		snprintf(line, LINESIZE, "unknown backend %s, falling back to %s",
+			name, epoll_backend.name);
+	}
+
+	chat_writeln(TRUE, LOG_WARNING, line);
+	return &epoll_backend;
+}
+
+void
+reactors_start(int count, const char *backend)
+{
+	const backend_t *reactor_backend_ops;
+	reactor_t *reactor;
+	struct timespec now;
+	int i, j;
+#ifdef DEBUG
+	char line[LINESIZE];
+#endif
+
+	reactor_backend_ops = reactor_backend(backend);
+
+	bufs_init();
+	pool_init(&conn_pool, "conn", sizeof(conn_t));
+	pool_init(&rmsg_node_pool, "rmsg", sizeof(rmsg_node_t));
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	self_epoch = now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+
+	for (i = 0; i < npeers; i++) {
+		ratelimit_init(&peers_table[i]->msg_limit, rate_msgs);
+		ratelimit_init(&peers_table[i]->exec_limit, rate_execs);
+		delivery_init(&peers_table[i]->delivery);
+	}
+
+	nreactors = count;
+	reactors = calloc(nreactors, sizeof(reactor_t));
+
+	for (i = 0; i < nreactors; i++) {
+		reactor = &reactors[i];
+		reactor->id = i;
+		reactor->running = TRUE;
+		reactor->listensk = -1;
+		reactor->unixsk = -1;
+		reactor->evfd = eventfd(0, EFD_NONBLOCK);
+		reactor->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+
+		reactor->inbox = calloc(nreactors, sizeof(spsc_t));
+		for (j = 0; j < nreactors; j++)
+			spsc_init(&reactor->inbox[j], REACTOR_QUEUE, sizeof(rmsg_t));
+		spsc_init(&reactor->external, REACTOR_QUEUE, sizeof(rmsg_t));
+		pthread_mutex_init(&reactor->external_mutex, NULL);
+
+		reactor->backend = reactor_backend_ops;
+		if (reactor->backend->init(reactor) != 0 && reactor->backend != &epoll_backend) {
+			chat_writeln(TRUE, LOG_WARNING, "reactor backend init failed, using epoll");
+			reactor->backend = &epoll_backend;
+			reactor->backend->init(reactor);
+		}
+	}
+
+#ifdef DEBUG
+	snprintf(line, LINESIZE, "%d reactors on %s, scanning lines with %s",
+		nreactors, reactor_backend_ops->name, scan_impl());
+	chat_writeln(TRUE, LOG_DEBUG, line);
+#endif
+	for (i = 0; i < nreactors; i++)
+		pthread_create(&reactors[i].tid, NULL, reactor_run, &reactors[i]);
+}
+
+int
+reactors_stop(const struct timespec *deadline)
+{
+	rmsg_t msg;
+	int i, stuck = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = RMSG_STOP;
+
+	for (i = 0; i < nreactors; i++)
+		reactor_post(&reactors[i], &msg);
+
+	for (i = 0; i < nreactors; i++) {
+		if (pthread_timedjoin_np(reactors[i].tid, NULL, deadline) != 0)
+			stuck++;
+	}
+
+	return stuck;
+}
+
+void
+reactor_connect(peer_info_t *peer_info)
+{
+	rmsg_t msg;
+
+	msg.type = RMSG_CONNECT;
+	msg.peer = peer_info;
+	msg.conn = NULL;
+	msg.buf = NULL;
+
+	reactor_post(peer_reactor(peer_info), &msg);
+}
+
+void
+reactor_send(peer_info_t *peer_info, buf_t *buf)
+{
+	rmsg_t msg;
+
+	msg.type = RMSG_SEND;
+	msg.peer = peer_info;
+	msg.conn = NULL;
+	msg.buf = buf_ref(buf);
+
+	reactor_post(peer_reactor(peer_info), &msg);
+}
+
+void
+reactor_publish(peer_info_t *peer_info, buf_t *buf)
+{
+	rmsg_t msg;
+
+	msg.type = RMSG_PUBLISH;
+	msg.peer = peer_info;
+	msg.conn = NULL;
+	msg.buf = buf_ref(buf);
+
+	reactor_post(peer_reactor(peer_info), &msg);
+}
+
+void
+reactor_control(peer_info_t *peer_info, buf_t *buf)
+{
+	rmsg_t msg;
+
+	msg.type = RMSG_CONTROL;
+	msg.peer = peer_info;
+	msg.conn = NULL;
+	msg.buf = buf_ref(buf);
+
+	reactor_post(peer_reactor(peer_info), &msg);
+}
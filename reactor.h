@@ -0,0 +1,367 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _REACTOR_H
+#define _REACTOR_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "chet2p.h"
+#include "peers.h"
+#include "pool.h"
+#include "shm.h"
+#include "spsc.h"
+
+/*
+ * All tcp traffic is served by a set of reactors, one event loop per
+ * thread.  Every reactor owns a listening socket bound with SO_REUSEPORT
+ * on the chat port, so the kernel spreads accepts among them.  Peers are
+ * sharded by index: only reactor (index % nreactors) touches a peer's
+ * connections.  Anything addressed to another shard goes through a
+ * lock-free single producer, single consumer queue, one per pair of
+ * reactors.  Threads outside the reactors share one extra queue per
+ * reactor, serialized by a mutex.
+ *
+ * How a reactor waits for and performs i/o is up to its backend: the
+ * portable one is readiness based (epoll), the io_uring one is
+ * completion based and batches every send of a loop iteration into a
+ * single submission.
+ */
+
+#define REACTOR_QUEUE 1024
+#define REACTOR_EVENTS 64
+/*
+ * refs a lane or outq holds at most, room for resending a whole window
+ * with header and payload apart; rings start at CONN_RING on first use
+ * and double from there, an idle conn costs none
+ */
+#define CONN_OUTQ (4 * SEQ_WINDOW)
+#define CONN_RING 16
+#define CONN_IOV 64
+/* longest line on the wire, a message plus its sequencing header */
+#define WIRE_LINE (BUFFSIZE + 64)
+/* bytes read at once, room for hundreds of lines per read */
+#define CONN_RBUF (16 * 1024)
+
+/*
+ * Priority lanes.  Output waits in one of three lanes until it is moved
+ * to the queue the backend writes from, which is kept under CONN_COMMIT
+ * bytes so that whatever comes later can still jump ahead:
+ *
+ *     control   protocol lines and execs, always first
+ *     chat      messages
+ *     bulk      the link database and broadcast repairs, cut into
+ *               chunks of about LANE_CHUNK bytes at line boundaries
+ *
+ * Chat and bulk share what control leaves by weighted fair queueing,
+ * LANE_CHAT_WEIGHT bytes of chat for every LANE_BULK_WEIGHT of bulk.
+ * Lines never interleave: a sequenced message's header and payload
+ * move as one frame.
+ */
+enum {
+	LANE_CONTROL,
+	LANE_CHAT,
+	LANE_BULK,
+	LANES
+};
+
+#define CONN_COMMIT (16 * 1024)
+#define LANE_CHUNK 4096
+#define LANE_CHAT_WEIGHT 4
+#define LANE_BULK_WEIGHT 1
+
+/*
+ * Flow control.  A receiver grants credits on the connection a peer
+ * writes to ("credit N"), one per message, paced by its per-peer rate
+ * limit.  Senders that have seen a credit line hold messages back once
+ * they run out; peers that never send one are not limited.  Messages
+ * beyond the granted credits are charged to the rate limit directly and
+ * dropped when it is exhausted.
+ */
+#define CREDIT_WINDOW 64
+#define CREDIT_TICK 20
+#define CONN_PENDING 256
+#define RATE_MSGS 100
+#define RATE_EXECS 1
+
+/*
+ * Negotiation.  A receiver announces "proto N" on identifying its peer,
+ * a sender that speaks it answers with sync (see delivery.h) and from
+ * then on sends nothing but protocol lines and sequenced frames.  Until
+ * that happened either end treats the other as legacy: its lines are
+ * chat, or execs, and it gets no credits, links or subscriptions.
+ */
+#define PROTO_VERSION 2
+
+/*
+ * Send coalescing.  Output is corked until it reaches COALESCE_BYTES or
+ * has waited COALESCE_USEC, so bursts share packets while a lone
+ * message goes out within the latency budget.  Nagle is always off.
+ */
+#define COALESCE_USEC 200
+#define COALESCE_BYTES 4096
+
+/*
+ * Local transports.  A peer on our own address or on loopback is
+ * dialed on its unix socket ("\0chet2p-<addr>:<port>", abstract) first.
+ * Over it the id line can offer a shared memory link (see shm.h):
+ *
+ *     id <name> shm        plus the link's fds
+ *     shm ok | shm no      answer, sent straight on the socket
+ *
+ * and both sides move the conn to the rings once the answer is out.  A
+ * peer without a unix socket gets tcp, one refusing the link the plain
+ * unix stream.  Only backends with local set listen on unix sockets and
+ * offer links.
+ */
+typedef enum {
+	TRANSPORT_TCP,
+	TRANSPORT_UNIX,
+	TRANSPORT_SHM
+} transport_t;
+
+struct reactor;
+
+/* len bytes of a queued buffer chain, from cur at off on */
+typedef struct {
+	buf_t *head;
+	buf_t *cur;
+	size_t off;
+	size_t len;
+	/* the next ref belongs to the same frame */
+	int more;
+} outref_t;
+
+typedef struct {
+	outref_t *refs;
+	unsigned int size;
+	unsigned int head;
+	unsigned int tail;
+	size_t bytes;
+	/* bytes sent over its weight, the lane behind goes next */
+	uint64_t vtime;
+} lane_t;
+
+typedef struct conn {
+	int fd;
+	int outbound;
+	int connecting;
+	int closing;
+	int detaching;
+	peer_info_t *peer;
+	struct reactor *reactor;
+	struct conn *prev, *next;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	/* over a unix socket, and the shared memory link it carries */
+	int local;
+	int negotiating;
+	shm_link_t *shm;
+	shm_link_t *offer;
+	int fds[SHM_FDS];
+	int nfds;
+	char rbuf[CONN_RBUF + 1];
+	size_t rlen;
+	lane_t lanes[LANES];
+	/* what the backend writes, wlen bytes */
+	outref_t *outq;
+	unsigned int outq_size;
+	unsigned int outq_head;
+	unsigned int outq_tail;
+	size_t wlen;
+	/* granted to the peer when inbound, left to spend when outbound */
+	int credit;
+	int credited;
+	int dropping;
+	/* the peer speaks the protocol: proto seen when outbound, sync when inbound */
+	int seqs;
+	int synced;
+	/* corked output, flushed at deadline (monotonic ns) */
+	int corked;
+	uint64_t deadline;
+	struct conn *cork_prev, *cork_next;
+	buf_t *pending[CONN_PENDING];
+	unsigned int pending_head;
+	unsigned int pending_tail;
+
+	/* backend private */
+	unsigned int events;
+	int inflight;
+	int recv_armed;
+	int dirty;
+	size_t sending;
+	struct iovec siov[CONN_IOV];
+	struct msghdr smsg;
+	struct conn *dirty_next;
+} conn_t;
+
+typedef enum {
+	RMSG_SEND,
+	RMSG_PUBLISH,
+	RMSG_CONTROL,
+	RMSG_CONNECT,
+	RMSG_ADOPT,
+	RMSG_STOP
+} rmsg_type_t;
+
+typedef struct {
+	rmsg_type_t type;
+	peer_info_t *peer;
+	conn_t *conn;
+	buf_t *buf;
+} rmsg_t;
+
+typedef struct rmsg_node {
+	int dst;
+	rmsg_t msg;
+	struct rmsg_node *next;
+} rmsg_node_t;
+
+struct reactor;
+
+typedef struct {
+	const char *name;
+	/* serves unix sockets, shared memory links and passed fds */
+	int local;
+	int (*init)(struct reactor *reactor);
+	void (*destroy)(struct reactor *reactor);
+	void (*listen)(struct reactor *reactor);
+	/* start receiving from conn, or refresh its write interest */
+	void (*watch)(struct reactor *reactor, conn_t *conn);
+	/* stop receiving, 0 if conn can be handed off right away */
+	int (*unwatch)(struct reactor *reactor, conn_t *conn);
+	void (*connect)(struct reactor *reactor, conn_t *conn);
+	/* outq got new data, -1 on a hard error */
+	int (*flush)(struct reactor *reactor, conn_t *conn);
+	/* conn is already unlinked, release it once nothing is in flight */
+	void (*close)(struct reactor *reactor, conn_t *conn);
+	void (*wait)(struct reactor *reactor, int timeout);
+} backend_t;
+
+typedef struct reactor {
+	int id;
+	const backend_t *backend;
+	void *backend_data;
+	int epfd;
+	int evfd;
+	int timerfd;
+	int listensk;
+	int unixsk;
+	int running;
+	int sleeping;
+	pthread_t tid;
+	spsc_t *inbox;
+	spsc_t external;
+	pthread_mutex_t external_mutex;
+	rmsg_node_t *backlog;
+	conn_t *conns;
+	int starved;
+	int acks_pending;
+	/* corked conns, in deadline order */
+	conn_t *corked_head;
+	conn_t *corked_tail;
+} reactor_t;
+
+extern reactor_t *reactors;
+extern int nreactors;
+
+/* per peer inbound messages and execs per second, 0 is unlimited */
+extern double rate_msgs;
+extern double rate_execs;
+
+/* tells our sequence numbers apart from a previous run's */
+extern uint64_t self_epoch;
+
+/* the most local transport to try with co-located peers */
+extern transport_t transport;
+
+/* 0 sends right away */
+extern int coalesce_usec;
+extern size_t coalesce_bytes;
+
+extern const backend_t epoll_backend;
+extern const backend_t uring_backend;
+
+/* usable on this kernel, -1 otherwise */
+int
+uring_probe();
+
+void
+reactors_start(int count, const char *backend);
+
+/* waits for them until deadline (CLOCK_REALTIME), returns how many didn't stop */
+int
+reactors_stop(const struct timespec *deadline);
+
+reactor_t *
+peer_reactor(const peer_info_t *peer_info);
+
+void
+reactor_connect(peer_info_t *peer_info);
+
+/* takes its own reference on buf */
+void
+reactor_send(peer_info_t *peer_info, buf_t *buf);
+
+/* like reactor_send, but not echoed: one of many copies of a message */
+void
+reactor_publish(peer_info_t *peer_info, buf_t *buf);
+
+/* protocol lines, neither sequenced nor echoed, dropped while disconnected */
+void
+reactor_control(peer_info_t *peer_info, buf_t *buf);
+
+/* called back by the backends */
+
+void
+conn_accepted(reactor_t *reactor, int fd, int local);
+
+/* data is parsed in place and may be written to */
+void
+conn_received(reactor_t *reactor, conn_t *conn, char *data, size_t len);
+
+int
+conn_process(reactor_t *reactor, conn_t *conn);
+
+void
+conn_connect_done(reactor_t *reactor, conn_t *conn, int error);
+
+void
+conn_failed(reactor_t *reactor, conn_t *conn);
+
+void
+conn_handoff(reactor_t *reactor, conn_t *conn);
+
+void
+conn_free(conn_t *conn);
+
+/* fill iov with queued output, returns the number of entries used */
+int
+conn_outq_iov(conn_t *conn, struct iovec *iov, int max, size_t *nbytes);
+
+/* nbytes of queued output went out */
+void
+conn_outq_consume(conn_t *conn, size_t nbytes);
+
+#endif /* _REACTOR_H */
@@ -0,0 +1,404 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "reactor.h"
+#include "trace.h"
+
+/*
+ * readiness based backend, works on any kernel.  A conn on a shared
+ * memory link is registered twice: its eventfd for input, its socket for
+ * hangups only.  Both can fire in one batch, so such conns are released
+ * or handed off once the batch is done.
+ */
+
+#define SHM_EVENTS EPOLLRDHUP
+
+static __thread conn_t *retired;
+
+static void
+epoll_retire(conn_t *conn)
+{
+	conn->dirty_next = retired;
+	retired = conn;
+}
+
+static void
+epoll_release(reactor_t *reactor)
+{
+	conn_t *conn;
+
+	while ((conn = retired)) {
+		retired = conn->dirty_next;
+		if (conn->closing)
+			conn_free(conn);
+		else
+			conn_handoff(reactor, conn);
+	}
+}
+
+static int
+epoll_init(reactor_t *reactor)
+{
+	struct epoll_event ev;
+
+	reactor->epfd = epoll_create1(0);
+	if (reactor->epfd < 0)
+		return -1;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &reactor->evfd;
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->evfd, &ev) != 0)
+		return -1;
+
+	ev.data.ptr = &reactor->timerfd;
+	return epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->timerfd, &ev);
+}
+
+static void
+epoll_destroy(reactor_t *reactor)
+{
+	close(reactor->epfd);
+	epoll_release(reactor);
+}
+
+static void
+epoll_listen(reactor_t *reactor)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &reactor->listensk;
+	epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->listensk, &ev);
+
+	if (reactor->unixsk < 0)
+		return;
+
+	ev.data.ptr = &reactor->unixsk;
+	epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->unixsk, &ev);
+}
+
+static void
+epoll_watch_shm(reactor_t *reactor, conn_t *conn)
+{
+	struct epoll_event ev;
+
+	if (conn->events == SHM_EVENTS)
+		return;
+
+	ev.events = SHM_EVENTS;
+	ev.data.ptr = conn;
+	epoll_ctl(reactor->epfd, conn->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+		conn->fd, &ev);
+
+	ev.events = EPOLLIN;
+	epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, conn->shm->efd, &ev);
+	conn->events = SHM_EVENTS;
+}
+
+static void
+epoll_watch(reactor_t *reactor, conn_t *conn)
+{
+	struct epoll_event ev;
+
+	if (conn->shm) {
+		epoll_watch_shm(reactor, conn);
+		return;
+	}
+
+	ev.events = EPOLLIN;
+	/* output waits for the answer to a link offer */
+	if ((conn->wlen && !conn->negotiating) || conn->connecting)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = conn;
+
+	if (conn->events == ev.events)
+		return;
+
+	epoll_ctl(reactor->epfd, conn->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+		conn->fd, &ev);
+	conn->events = ev.events;
+}
+
+static int
+epoll_unwatch(reactor_t *reactor, conn_t *conn)
+{
+	int shm = conn->events == SHM_EVENTS;
+
+	epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	if (shm)
+		epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, conn->shm->efd, NULL);
+	conn->events = 0;
+
+	if (shm && conn->detaching) {
+		epoll_retire(conn);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+epoll_connect(reactor_t *reactor, conn_t *conn)
+{
+	if (connect(conn->fd, (struct sockaddr *)&conn->addr, conn->addrlen) == 0)
+		conn_connect_done(reactor, conn, 0);
+	else if (errno == EINPROGRESS)
+		epoll_watch(reactor, conn);
+	else
+		conn_connect_done(reactor, conn, errno);
+}
+
+static int
+epoll_flush(reactor_t *reactor, conn_t *conn)
+{
+	struct iovec iov[CONN_IOV];
+	struct msghdr msg;
+	ssize_t nbytes;
+	size_t len;
+
+	if (conn->shm) {
+		/* a full ring resumes when the peer wakes us for room */
+		while (conn->wlen) {
+			nbytes = shm_write(conn->shm, iov,
+				conn_outq_iov(conn, iov, CONN_IOV, &len));
+			if (nbytes == 0)
+				break;
+
+			conn_outq_consume(conn, nbytes);
+		}
+
+		return 0;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+
+	while (conn->wlen) {
+		msg.msg_iovlen = conn_outq_iov(conn, iov, CONN_IOV, &len);
+		TRACE_BEGIN(sendmsg);
+		nbytes = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+		TRACE_END(sendmsg);
+		if (nbytes < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+
+		conn_outq_consume(conn, nbytes);
+	}
+
+	epoll_watch(reactor, conn);
+	return 0;
+}
+
+static void
+epoll_close(reactor_t *reactor, conn_t *conn)
+{
+	int shm = conn->events == SHM_EVENTS;
+
+	epoll_unwatch(reactor, conn);
+	shutdown(conn->fd, SHUT_RDWR);
+	close(conn->fd);
+
+	if (shm) {
+		conn->closing = TRUE;
+		epoll_retire(conn);
+		return;
+	}
+
+	conn_free(conn);
+}
+
+static void
+epoll_accept(reactor_t *reactor, int sk)
+{
+	int connsk;
+
+	while ((connsk = accept4(sk, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+		conn_accepted(reactor, connsk, sk == reactor->unixsk);
+}
+
+/* reads into rbuf keeping any fds passed along, see reactor.h */
+static ssize_t
+epoll_recvfds(conn_t *conn)
+{
+	char control[CMSG_SPACE(SHM_FDS * sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t nbytes;
+	int i, n, fd;
+
+	iov.iov_base = conn->rbuf + conn->rlen;
+	iov.iov_len = CONN_RBUF - conn->rlen;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	nbytes = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+	if (nbytes < 0)
+		return nbytes;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < n; i++) {
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			if (conn->nfds < SHM_FDS)
+				conn->fds[conn->nfds++] = fd;
+			else
+				close(fd);
+		}
+	}
+
+	return nbytes;
+}
+
+static void
+epoll_shm_readable(reactor_t *reactor, conn_t *conn)
+{
+	size_t nbytes;
+
+	/* consume the wakeup first, anything after it wakes us again */
+	shm_clear(conn->shm);
+
+	if (conn->wlen)
+		epoll_flush(reactor, conn);
+
+	while ((nbytes = shm_read(conn->shm, conn->rbuf + conn->rlen,
+			CONN_RBUF - conn->rlen)) > 0) {
+		conn->rlen += nbytes;
+		if (conn_process(reactor, conn) != 0)
+			return;
+	}
+}
+
+static void
+epoll_readable(reactor_t *reactor, conn_t *conn)
+{
+	ssize_t nbytes;
+
+	/* only the first lines of a local conn may carry fds */
+	if (conn->local && conn->peer == NULL)
+		nbytes = epoll_recvfds(conn);
+	else
+		nbytes = read(conn->fd, conn->rbuf + conn->rlen, CONN_RBUF - conn->rlen);
+	if (nbytes < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	if (nbytes <= 0) {
+		conn_failed(reactor, conn);
+		return;
+	}
+
+	conn->rlen += nbytes;
+	conn_process(reactor, conn);
+}
+
+static void
+epoll_writable(reactor_t *reactor, conn_t *conn)
+{
+	int error = 0;
+	socklen_t errorl = sizeof(error);
+
+	if (conn->connecting) {
+		getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &errorl);
+		conn_connect_done(reactor, conn, error);
+		return;
+	}
+
+	if (epoll_flush(reactor, conn) != 0)
+		conn_failed(reactor, conn);
+}
+
+static void
+epoll_wait_events(reactor_t *reactor, int timeout)
+{
+	struct epoll_event events[REACTOR_EVENTS];
+	uint64_t counter;
+	int nevents, i;
+	void *ptr;
+
+	nevents = epoll_wait(reactor->epfd, events, REACTOR_EVENTS, timeout);
+
+	for (i = 0; i < nevents; i++) {
+		ptr = events[i].data.ptr;
+
+		if (ptr == &reactor->listensk || ptr == &reactor->unixsk) {
+			epoll_accept(reactor, *(int *)ptr);
+		}
+		else if (ptr == &reactor->evfd) {
+			read(reactor->evfd, &counter, sizeof(counter));
+		}
+		else if (ptr == &reactor->timerfd) {
+			read(reactor->timerfd, &counter, sizeof(counter));
+		}
+		else if (((conn_t *)ptr)->closing || ((conn_t *)ptr)->detaching) {
+			/* released below, a second event for it in this batch */
+			continue;
+		}
+		else if (((conn_t *)ptr)->shm && ((conn_t *)ptr)->events == SHM_EVENTS) {
+			if (events[i].events & EPOLLIN)
+				epoll_shm_readable(reactor, ptr);
+			else
+				conn_failed(reactor, ptr);
+		}
+		else if (events[i].events & EPOLLOUT ||
+			 (events[i].events & (EPOLLERR | EPOLLHUP) &&
+			  ((conn_t *)ptr)->connecting)) {
+			/* a connect completing or a flush, reads come next round */
+			epoll_writable(reactor, ptr);
+		}
+		else {
+			epoll_readable(reactor, ptr);
+		}
+	}
+
+	epoll_release(reactor);
+}
+
+const backend_t epoll_backend = {
+	.name = "epoll",
+	.local = 1,
+	.init = epoll_init,
+	.destroy = epoll_destroy,
+	.listen = epoll_listen,
+	.watch = epoll_watch,
+	.unwatch = epoll_unwatch,
+	.connect = epoll_connect,
+	.flush = epoll_flush,
+	.close = epoll_close,
+	.wait = epoll_wait_events,
+};
@@ -0,0 +1,682 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "reactor.h"
+
+/*
+ * Completion based backend talking to io_uring through the raw syscalls.
+ *
+ * The listener is served by a single multishot accept.  Identified
+ * connections receive through a multishot recv that picks buffers from
+ * a ring registered with the kernel, so one submission keeps delivering
+ * data until the peer goes away.  Sends are not issued when written: the
+ * connection is marked dirty and every dirty connection gets its send
+ * queued right before the reactor waits, all of them (a broadcast
+ * fan-out included) going to the kernel in the same io_uring_enter.
+ *
+ * A connection is released only when none of its requests is in flight.
+ * Needs a 6.0+ kernel, uring_probe checks it at runtime.
+ */
+
+#define URING_ENTRIES 256
+#define URING_BUFS 256
+#define URING_BUFSIZE 2048
+#define URING_BGID 0
+
+typedef enum {
+	OP_ACCEPT = 1,
+	OP_WAKE,
+	OP_RECV,
+	OP_RECV_ONE,
+	OP_SEND,
+	OP_CONNECT,
+	OP_CANCEL
+} uring_op_t;
+
+#define UDATA(ptr, op) ((uint64_t)(uintptr_t)(ptr) | (op))
+#define UDATA_PTR(udata) ((void *)(uintptr_t)((udata) & ~7ULL))
+#define UDATA_OP(udata) ((uring_op_t)((udata) & 7ULL))
+
+typedef struct {
+	int fd;
+	unsigned int sq_entries;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_local_tail;
+	unsigned int to_submit;
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *ring_map;
+	size_t ring_size;
+	size_t sqes_size;
+
+	struct io_uring_buf_ring *buf_ring;
+	char *bufs;
+	unsigned short buf_tail;
+
+	conn_t *dirty;
+} uring_t;
+
+static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+	unsigned int flags, void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		flags, arg, argsz);
+}
+
+static int
+sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+static void
+uring_buf_add(uring_t *ring, unsigned short bid)
+{
+	struct io_uring_buf *buf;
+
+	/* never touch resv, for the first slot it is the ring tail */
+	buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFS - 1)];
+	buf->addr = (uint64_t)(uintptr_t)(ring->bufs + bid * URING_BUFSIZE);
+	buf->len = URING_BUFSIZE;
+	buf->bid = bid;
+
+	ring->buf_tail++;
+	__atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void
+uring_unmap(uring_t *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->ring_map)
+		munmap(ring->ring_map, ring->ring_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	free(ring->buf_ring);
+	free(ring->bufs);
+	memset(ring, 0, sizeof(uring_t));
+	ring->fd = -1;
+}
+
+static int
+uring_setup(uring_t *ring)
+{
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	size_t sq_size, cq_size;
+	char *map;
+	int i;
+
+	memset(ring, 0, sizeof(uring_t));
+	memset(&params, 0, sizeof(params));
+
+	ring->fd = sys_io_uring_setup(URING_ENTRIES, &params);
+	if (ring->fd < 0)
+		return -1;
+
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(params.features & IORING_FEAT_EXT_ARG))
+		goto fail;
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+
+	map = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (map == MAP_FAILED)
+		goto fail;
+	ring->ring_map = map;
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto fail;
+	}
+
+	ring->sq_entries = params.sq_entries;
+	ring->sq_head = (unsigned int *)(map + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)(map + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(map + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(map + params.sq_off.array);
+	ring->sq_local_tail = *ring->sq_tail;
+
+	ring->cq_head = (unsigned int *)(map + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)(map + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(map + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(map + params.cq_off.cqes);
+
+	/* provided buffers for multishot recv */
+	if (posix_memalign((void **)&ring->buf_ring, sysconf(_SC_PAGESIZE),
+			URING_BUFS * sizeof(struct io_uring_buf)) != 0) {
+		ring->buf_ring = NULL;
+		goto fail;
+	}
+	memset(ring->buf_ring, 0, URING_BUFS * sizeof(struct io_uring_buf));
+	ring->bufs = malloc(URING_BUFS * URING_BUFSIZE);
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+		goto fail;
+
+	for (i = 0; i < URING_BUFS; i++)
+		uring_buf_add(ring, i);
+
+	return 0;
+
+fail:
+	uring_unmap(ring);
+	return -1;
+}
+
+static int
+uring_enter(uring_t *ring, unsigned int min_complete, int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int flags = 0, submit;
+	int rc;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	submit = ring->to_submit;
+	ring->to_submit = 0;
+
+	if (min_complete)
+		flags |= IORING_ENTER_GETEVENTS;
+
+	if (min_complete && timeout > 0) {
+		memset(&arg, 0, sizeof(arg));
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+
+		rc = sys_io_uring_enter(ring->fd, submit, min_complete,
+			flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	}
+	else {
+		rc = sys_io_uring_enter(ring->fd, submit, min_complete, flags, NULL, 0);
+	}
+
+	return rc < 0 && errno != EINTR && errno != ETIME ? -1 : 0;
+}
+
+static struct io_uring_sqe *
+uring_sqe(uring_t *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int index;
+
+	/* the kernel consumes the whole queue on enter, so this frees it up */
+	while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)
+			>= ring->sq_entries)
+		uring_enter(ring, 0, 0);
+
+	index = ring->sq_local_tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sq_array[index] = index;
+
+	ring->sq_local_tail++;
+	ring->to_submit++;
+
+	return sqe;
+}
+
+static void
+uring_prep_recv_multishot(uring_t *ring, conn_t *conn)
+{
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = UDATA(conn, OP_RECV);
+}
+
+static void
+uring_prep_send(uring_t *ring, conn_t *conn)
+{
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+
+	memset(&conn->smsg, 0, sizeof(conn->smsg));
+	conn->smsg.msg_iov = conn->siov;
+	conn->smsg.msg_iovlen = conn_outq_iov(conn, conn->siov, CONN_IOV, &conn->sending);
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = conn->fd;
+	sqe->addr = (uint64_t)(uintptr_t)&conn->smsg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = UDATA(conn, OP_SEND);
+	conn->inflight++;
+}
+
+/* tagged with the reactor for the eventfd, with the ring for the timerfd */
+static void
+uring_prep_wake(reactor_t *reactor, void *tag)
+{
+	struct io_uring_sqe *sqe = uring_sqe(reactor->backend_data);
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = tag == reactor ? reactor->evfd : reactor->timerfd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = UDATA(tag, OP_WAKE);
+}
+
+static void
+uring_dirty_remove(uring_t *ring, conn_t *conn)
+{
+	conn_t **pconn;
+
+	if (!conn->dirty)
+		return;
+
+	for (pconn = &ring->dirty; *pconn; pconn = &(*pconn)->dirty_next) {
+		if (*pconn == conn) {
+			*pconn = conn->dirty_next;
+			break;
+		}
+	}
+
+	conn->dirty = FALSE;
+	conn->dirty_next = NULL;
+}
+
+static void
+uring_release(reactor_t *reactor, conn_t *conn)
+{
+	if (conn->inflight)
+		return;
+
+	if (conn->closing) {
+		close(conn->fd);
+		conn_free(conn);
+	}
+	else if (conn->detaching) {
+		conn_handoff(reactor, conn);
+	}
+}
+
+static int
+uring_init(reactor_t *reactor)
+{
+	uring_t *ring;
+
+	ring = malloc(sizeof(uring_t));
+	if (uring_setup(ring) != 0) {
+		free(ring);
+		return -1;
+	}
+
+	reactor->backend_data = ring;
+	uring_prep_wake(reactor, reactor);
+	uring_prep_wake(reactor, ring);
+
+	return 0;
+}
+
+static void
+uring_destroy(reactor_t *reactor)
+{
+	uring_t *ring = reactor->backend_data;
+
+	uring_unmap(ring);
+	free(ring);
+	reactor->backend_data = NULL;
+}
+
+static void
+uring_listen(reactor_t *reactor)
+{
+	struct io_uring_sqe *sqe = uring_sqe(reactor->backend_data);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = reactor->listensk;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK;
+	sqe->user_data = UDATA(reactor, OP_ACCEPT);
+}
+
+static void
+uring_watch(reactor_t *reactor, conn_t *conn)
+{
+	uring_t *ring = reactor->backend_data;
+	struct io_uring_sqe *sqe;
+
+	if (conn->closing || conn->detaching || conn->connecting)
+		return;
+
+	if (!conn->recv_armed) {
+		conn->recv_armed = TRUE;
+		conn->inflight++;
+
+		if (conn->peer) {
+			uring_prep_recv_multishot(ring, conn);
+		}
+		else {
+			/*
+			 * until it identifies, read straight into rbuf one
+			 * chunk at a time, nothing may be left in the kernel
+			 * when the conn moves to another reactor
+			 */
+			sqe = uring_sqe(ring);
+			sqe->opcode = IORING_OP_RECV;
+			sqe->fd = conn->fd;
+			sqe->addr = (uint64_t)(uintptr_t)(conn->rbuf + conn->rlen);
+			sqe->len = CONN_RBUF - conn->rlen;
+			sqe->user_data = UDATA(conn, OP_RECV_ONE);
+		}
+	}
+
+	if (conn->wlen && !conn->sending && !conn->dirty) {
+		conn->dirty = TRUE;
+		conn->dirty_next = ring->dirty;
+		ring->dirty = conn;
+	}
+}
+
+static int
+uring_unwatch(reactor_t *reactor, conn_t *conn)
+{
+	uring_dirty_remove(reactor->backend_data, conn);
+
+	/*
+	 * only the one-shot recv being completed right now is armed on a
+	 * conn that identifies itself, uring_complete hands it off once
+	 * that and any reply still being sent are done
+	 */
+	return conn->inflight ? -1 : 0;
+}
+
+static void
+uring_connect(reactor_t *reactor, conn_t *conn)
+{
+	struct io_uring_sqe *sqe = uring_sqe(reactor->backend_data);
+
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->fd = conn->fd;
+	sqe->addr = (uint64_t)(uintptr_t)&conn->addr;
+	sqe->off = conn->addrlen;
+	sqe->user_data = UDATA(conn, OP_CONNECT);
+	conn->inflight++;
+}
+
+static int
+uring_flush(reactor_t *reactor, conn_t *conn)
+{
+	uring_watch(reactor, conn);
+	return 0;
+}
+
+static void
+uring_close(reactor_t *reactor, conn_t *conn)
+{
+	uring_t *ring = reactor->backend_data;
+	struct io_uring_sqe *sqe;
+
+	conn->closing = TRUE;
+	uring_dirty_remove(ring, conn);
+
+	if (conn->inflight) {
+		sqe = uring_sqe(ring);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = conn->fd;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+		sqe->user_data = UDATA(NULL, OP_CANCEL);
+		shutdown(conn->fd, SHUT_RDWR);
+	}
+
+	uring_release(reactor, conn);
+}
+
+static void
+uring_submit_sends(uring_t *ring)
+{
+	conn_t *conn;
+
+	while ((conn = ring->dirty)) {
+		ring->dirty = conn->dirty_next;
+		conn->dirty = FALSE;
+		conn->dirty_next = NULL;
+
+		/* one send in flight per conn, the rest waits in outq */
+		if (conn->sending || !conn->wlen)
+			continue;
+
+		uring_prep_send(ring, conn);
+	}
+}
+
+static void
+uring_complete_recv(reactor_t *reactor, conn_t *conn, struct io_uring_cqe *cqe)
+{
+	uring_t *ring = reactor->backend_data;
+	unsigned short bid;
+	int more = cqe->flags & IORING_CQE_F_MORE;
+
+	if (!more)
+		conn->recv_armed = FALSE;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if (cqe->res > 0 && !conn->closing)
+			conn_received(reactor, conn, ring->bufs + bid * URING_BUFSIZE,
+				cqe->res);
+		uring_buf_add(ring, bid);
+	}
+
+	if (conn->closing || more)
+		return;
+
+	if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS))
+		conn_failed(reactor, conn);
+	else
+		uring_watch(reactor, conn);
+}
+
+static void
+uring_complete_recv_one(reactor_t *reactor, conn_t *conn, struct io_uring_cqe *cqe)
+{
+	conn->recv_armed = FALSE;
+
+	if (conn->closing)
+		return;
+
+	if (cqe->res <= 0) {
+		conn_failed(reactor, conn);
+		return;
+	}
+
+	conn->rlen += cqe->res;
+	if (conn_process(reactor, conn) == 0)
+		uring_watch(reactor, conn);
+}
+
+static void
+uring_complete_send(reactor_t *reactor, conn_t *conn, struct io_uring_cqe *cqe)
+{
+	if (conn->closing)
+		return;
+
+	if (cqe->res < 0) {
+		conn_failed(reactor, conn);
+		return;
+	}
+
+	/* buffers are released as they go out, a short send resumes mid chain */
+	conn_outq_consume(conn, cqe->res);
+	conn->sending = 0;
+	uring_watch(reactor, conn);
+}
+
+static void
+uring_complete(reactor_t *reactor, struct io_uring_cqe *cqe)
+{
+	void *ptr = UDATA_PTR(cqe->user_data);
+	conn_t *conn = ptr;
+	uint64_t counter;
+
+	/*
+	 * the request being completed stays counted in inflight while its
+	 * handler runs, so a conn closed or handed off from inside the
+	 * handler is only released below
+	 */
+	switch (UDATA_OP(cqe->user_data)) {
+	case OP_ACCEPT:
+		if (cqe->res >= 0)
+			conn_accepted(reactor, cqe->res, FALSE);
+		if (!(cqe->flags & IORING_CQE_F_MORE) && reactor->running)
+			uring_listen(reactor);
+		return;
+	case OP_WAKE:
+		read(ptr == reactor ? reactor->evfd : reactor->timerfd,
+			&counter, sizeof(counter));
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			uring_prep_wake(reactor, ptr);
+		return;
+	case OP_CANCEL:
+		return;
+	case OP_RECV:
+		uring_complete_recv(reactor, conn, cqe);
+		break;
+	case OP_RECV_ONE:
+		uring_complete_recv_one(reactor, conn, cqe);
+		break;
+	case OP_SEND:
+		uring_complete_send(reactor, conn, cqe);
+		break;
+	case OP_CONNECT:
+		if (!conn->closing)
+			conn_connect_done(reactor, conn, cqe->res < 0 ? -cqe->res : 0);
+		break;
+	}
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		conn->inflight--;
+	uring_release(reactor, conn);
+}
+
+static void
+uring_wait(reactor_t *reactor, int timeout)
+{
+	uring_t *ring = reactor->backend_data;
+	struct io_uring_cqe cqe;
+	unsigned int head;
+
+	uring_submit_sends(ring);
+	uring_enter(ring, timeout ? 1 : 0, timeout);
+
+	head = *ring->cq_head;
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = ring->cqes[head & *ring->cq_mask];
+		head++;
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+		uring_complete(reactor, &cqe);
+	}
+}
+
+int
+uring_probe()
+{
+	static int probed = 0, supported = -1;
+	struct io_uring_cqe *cqe;
+	uring_t ring;
+	conn_t conn;
+	int sv[2];
+
+	if (probed)
+		return supported;
+	probed = TRUE;
+
+	if (uring_setup(&ring) != 0)
+		return supported;
+
+	/* multishot recv with provided buffers is the newest thing we use */
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0) {
+		memset(&conn, 0, sizeof(conn));
+		conn.fd = sv[0];
+		uring_prep_recv_multishot(&ring, &conn);
+		write(sv[1], "x", 1);
+		uring_enter(&ring, 1, 1000);
+
+		if (*ring.cq_head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &ring.cqes[*ring.cq_head & *ring.cq_mask];
+			if (cqe->res == 1 && cqe->flags & IORING_CQE_F_MORE)
+				supported = 0;
+		}
+
+		close(sv[0]);
+		close(sv[1]);
+	}
+
+	uring_unmap(&ring);
+	return supported;
+}
+
+const backend_t uring_backend = {
+	.name = "uring",
+	.init = uring_init,
+	.destroy = uring_destroy,
+	.listen = uring_listen,
+	.watch = uring_watch,
+	.unwatch = uring_unwatch,
+	.connect = uring_connect,
+	.flush = uring_flush,
+	.close = uring_close,
+	.wait = uring_wait,
+};
@@ -0,0 +1,312 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * chet2p-replay: plays a capture (see capture.h) back against a running
+ * node, or dumps it as text.
+ *
+ * What the captured node received is sent to the target again, on the
+ * original schedule scaled by -s: every peer that talked to it connects
+ * to the target's tcp port under its own id and sends its messages,
+ * sequenced anew from 1, heartbeat pings go to the target's udp port.  What the captured node
+ * sent itself is skipped, chet2p-bench -T replays both directions.
+ *
+ * Run the target with the peers file of the capture and -l 0, and with
+ * none of the captured peers up: their ids are ours for the replay.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+#define REPLAY_LINE 512
+
+typedef struct {
+	struct sockaddr_in udp;
+	struct sockaddr_in tcp;
+} target_t;
+
+static double speed = 1;
+
+static uint64_t
+replay_clock()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+static void
+dump(capture_reader_t *reader)
+{
+	capture_record_t record;
+
+	printf("# %s, %d peers\n", reader->self, reader->nids);
+	while (capture_next(reader, &record) == 0) {
+		printf("%llu.%06llu %-7s %-12s %s\n",
+			(unsigned long long)record.ts / 1000000,
+			(unsigned long long)record.ts % 1000000,
+			capture_type(record.type),
+			record.peer >= 0 ? reader->ids[record.peer] : "-",
+			record.data);
+	}
+}
+
+/* target's addresses from a peers file line: <id> <addr> <udp> <tcp> */
+static int
+find_target(const char *path, const char *id, target_t *target)
+{
+	char line[REPLAY_LINE], name[REPLAY_LINE], addr[64];
+	int udp, tcp, found = -1;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+
+	while (found != 0 && fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || line[0] == '@')
+			continue;
+		if (sscanf(line, "%s %63s %d %d", name, addr, &udp, &tcp) != 4 ||
+		    strcmp(name, id) != 0)
+			continue;
+
+		memset(target, 0, sizeof(*target));
+		target->udp.sin_family = target->tcp.sin_family = AF_INET;
+		target->udp.sin_addr.s_addr = target->tcp.sin_addr.s_addr = inet_addr(addr);
+		target->udp.sin_port = htons(udp);
+		target->tcp.sin_port = htons(tcp);
+		found = 0;
+	}
+
+	fclose(f);
+	return found;
+}
+
+/* traces from before frames have chat bare */
+static const char *
+frame_prefix(const char *data)
+{
+	static const char *frames[] = { "msg ", "chan ", "fwd ", "exec " };
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		if (strncmp(data, frames[i], strlen(frames[i])) == 0)
+			return "";
+	}
+
+	return "msg ";
+}
+
+/* drops whatever the target said, we only care that it keeps reading */
+static void
+drain(int *socks, int n)
+{
+	char buffer[4096];
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (socks[i] >= 0)
+			while (recv(socks[i], buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+				;
+	}
+}
+
+/* a connection to the target as peer, -1 if it failed */
+static int
+peer_socket(const target_t *target, const char *id)
+{
+	char line[REPLAY_LINE];
+	int sk, len;
+
+	sk = socket(PF_INET, SOCK_STREAM, 0);
+	if (sk < 0)
+		return -1;
+
+	if (connect(sk, (const struct sockaddr *)&target->tcp, sizeof(target->tcp)) != 0) {
+		close(sk);
+		return -1;
+	}
+
+	/* a new epoch every time, the target starts counting over */
+	len = snprintf(line, sizeof(line), "id %s\nsync %lu 0\n", id,
+		(unsigned long)replay_clock());
+	if (write(sk, line, len) != len) {
+		close(sk);
+		return -1;
+	}
+
+	return sk;
+}
+
+static int
+replay(capture_reader_t *reader, const target_t *target)
+{
+	unsigned long msgs = 0, pings = 0, pongs = 0, skipped = 0, failed = 0;
+	uint64_t start, due, now, lag = 0;
+	capture_record_t record;
+	char line[CAPTURE_DATA + 64];
+	unsigned long *seqs;
+	int *socks, udpsk, i, len;
+
+	socks = malloc(reader->nids * sizeof(int));
+	seqs = calloc(reader->nids, sizeof(unsigned long));
+	for (i = 0; i < reader->nids; i++)
+		socks[i] = -1;
+
+	udpsk = socket(PF_INET, SOCK_DGRAM, 0);
+	fcntl(udpsk, F_SETFL, O_NONBLOCK);
+
+	start = replay_clock();
+	while (capture_next(reader, &record) == 0) {
+		if (speed > 0) {
+			due = start + record.ts / speed;
+			while ((now = replay_clock()) < due) {
+				drain(socks, reader->nids);
+				usleep(due - now > 1000 ? 1000 : due - now);
+			}
+			if (now - due > lag)
+				lag = now - due;
+		}
+
+		if (record.type == CAP_TCP_IN && record.peer >= 0) {
+			if (socks[record.peer] < 0) {
+				socks[record.peer] = peer_socket(target, reader->ids[record.peer]);
+				seqs[record.peer] = 0;
+			}
+
+			len = snprintf(line, sizeof(line), "seq %lu 0 %s%s\n", ++seqs[record.peer],
+				frame_prefix(record.data), record.data);
+			if (socks[record.peer] >= 0 && write(socks[record.peer], line, len) == len) {
+				msgs++;
+			}
+			else {
+				failed++;
+				if (socks[record.peer] >= 0)
+					close(socks[record.peer]);
+				socks[record.peer] = -1;
+			}
+		}
+		else if (record.type == CAP_UDP_IN && strcmp(record.data, "ping") == 0) {
+			sendto(udpsk, "ping\n", 5, 0, (const struct sockaddr *)&target->udp,
+				sizeof(target->udp));
+			pings++;
+		}
+		else {
+			skipped++;
+		}
+
+		while (recv(udpsk, line, sizeof(line), 0) > 0)
+			pongs++;
+	}
+
+	/* the last pongs and whatever the target still has to say */
+	usleep(100000);
+	while (recv(udpsk, line, sizeof(line), 0) > 0)
+		pongs++;
+	drain(socks, reader->nids);
+	now = replay_clock();
+
+	for (i = 0; i < reader->nids; i++) {
+		if (socks[i] >= 0)
+			close(socks[i]);
+	}
+	free(socks);
+	free(seqs);
+	close(udpsk);
+
+	printf("{\n");
+	printf("  \"capture\": \"%s\",\n", reader->self);
+	printf("  \"speed\": %g,\n", speed);
+	printf("  \"elapsed_s\": %.3f,\n", (now - start) / 1e6);
+	printf("  \"msgs\": %lu,\n", msgs);
+	printf("  \"msgs_failed\": %lu,\n", failed);
+	printf("  \"pings\": %lu,\n", pings);
+	printf("  \"pongs\": %lu,\n", pongs);
+	printf("  \"skipped\": %lu,\n", skipped);
+	printf("  \"max_lag_us\": %lu\n", (unsigned long)lag);
+	printf("}\n");
+
+	return failed ? -1 : 0;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-s speed] <capture> <peers_file> <target_id>\n"
+		"       %s -d <capture>\n", name, name);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	capture_reader_t reader;
+	target_t target;
+	int opt, dumping = 0, rc;
+
+	while ((opt = getopt(argc, argv, "ds:")) != -1) {
+		switch (opt) {
+		case 'd': dumping = 1; break;
+		/* 0 is as fast as possible */
+		case 's': speed = atof(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (speed < 0 || argc - optind < (dumping ? 1 : 3))
+		usage(argv[0]);
+
+	if (capture_read_open(&reader, argv[optind]) != 0) {
+		fprintf(stderr, "%s is not a capture\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (dumping) {
+		dump(&reader);
+		capture_read_close(&reader);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (find_target(argv[optind + 1], argv[optind + 2], &target) != 0) {
+		fprintf(stderr, "Can't find id %s in %s.\n", argv[optind + 2], argv[optind + 1]);
+		exit(EXIT_FAILURE);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	rc = replay(&reader, &target);
+	capture_read_close(&reader);
+
+	exit(rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
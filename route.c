@@ -0,0 +1,503 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "chatgui.h"
+#include "chet2p.h"
+#include "metrics.h"
+#include "reactor.h"
+#include "route.h"
+
+typedef struct {
+	int to;
+	/* usec, 0 while down */
+	uint32_t rtt;
+	uint64_t version;
+} route_link_t;
+
+typedef struct {
+	route_link_t *links;
+	int nlinks;
+	/* shortest path from us: its cost, last and first hop */
+	uint64_t dist;
+	int prev;
+	int next;
+} route_node_t;
+
+typedef struct {
+	uint64_t dist;
+	int node;
+} route_entry_t;
+
+/* peers by index, us at [self] */
+static route_node_t *nodes;
+static int self;
+/* over all nodes, bounds the dijkstra heap */
+static int nlinks;
+static int dirty;
+static uint64_t last_version;
+
+/* our own links by peer index: up, and the rtt measured (ewma) */
+static int *links_up;
+static uint32_t *measured;
+
+static pthread_mutex_t route_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void
+route_init()
+{
+	self = npeers;
+	nodes = calloc(npeers + 1, sizeof(route_node_t));
+	links_up = calloc(npeers + 1, sizeof(int));
+	measured = calloc(npeers + 1, sizeof(uint32_t));
+}
+
+static const char *
+route_name(int i)
+{
+	return i == self ? self_info->id : peers_table[i]->id;
+}
+
+static int
+route_index(const char *id)
+{
+	peer_info_t *peer_info;
+
+	if (strcmp(id, self_info->id) == 0)
+		return self;
+
+	peer_info = g_hash_table_lookup(peers_by_id, id);
+	return peer_info ? peer_info->index : -1;
+}
+
+/* lock held from here on */
+
+static route_link_t *
+route_find(int origin, int to)
+{
+	route_node_t *node = &nodes[origin];
+	int i;
+
+	for (i = 0; i < node->nlinks; i++) {
+		if (node->links[i].to == to)
+			return &node->links[i];
+	}
+
+	return NULL;
+}
+
+/* 0 if we already knew as much */
+static int
+route_set(int origin, int to, uint32_t rtt, uint64_t version)
+{
+	route_node_t *node = &nodes[origin];
+	route_link_t *link;
+
+	link = route_find(origin, to);
+	if (link && link->version >= version)
+		return 0;
+
+	if (link == NULL) {
+		node->links = realloc(node->links,
+			(node->nlinks + 1) * sizeof(route_link_t));
+		link = &node->links[node->nlinks++];
+		link->to = to;
+		link->rtt = 0;
+		nlinks++;
+	}
+
+	if (link->rtt != rtt)
+		dirty = TRUE;
+
+	link->rtt = rtt;
+	link->version = version;
+	return 1;
+}
+
+/* wall clock usec, so a restarted node still supersedes its old links */
+static uint64_t
+route_version()
+{
+	struct timeval now;
+	uint64_t version;
+
+	gettimeofday(&now, NULL);
+	version = now.tv_sec * 1000000ULL + now.tv_usec;
+	if (version <= last_version)
+		version = last_version + 1;
+
+	return last_version = version;
+}
+
+/* sets our link to peer i, line gets it for flooding */
+static void
+route_own(int i, uint32_t rtt, char *line)
+{
+	uint64_t version = route_version();
+
+	route_set(self, i, rtt, version);
+	snprintf(line, LINESIZE, "link %s %lu %s %u", self_info->id,
+		(unsigned long)version, peers_table[i]->id, rtt);
+}
+
+static void
+heap_push(route_entry_t *heap, int *n, uint64_t dist, int node)
+{
+	int i = (*n)++;
+
+	while (i > 0 && heap[(i - 1) / 2].dist > dist) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i].dist = dist;
+	heap[i].node = node;
+}
+
+static route_entry_t
+heap_pop(route_entry_t *heap, int *n)
+{
+	route_entry_t top = heap[0], last = heap[--(*n)];
+	int i = 0, child;
+
+	while ((child = 2 * i + 1) < *n) {
+		if (child + 1 < *n && heap[child + 1].dist < heap[child].dist)
+			child++;
+		if (last.dist <= heap[child].dist)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = last;
+
+	return top;
+}
+
+/* dijkstra from us, a heap entry per improvement so at most one per link */
+static void
+route_compute()
+{
+	route_entry_t *heap, entry;
+	route_node_t *node, *to;
+	route_link_t *link;
+	uint64_t dist;
+	int i, n = 0;
+
+	for (i = 0; i <= self; i++) {
+		nodes[i].dist = UINT64_MAX;
+		nodes[i].prev = nodes[i].next = -1;
+	}
+
+	heap = malloc((nlinks + 1) * sizeof(route_entry_t));
+	nodes[self].dist = 0;
+	heap_push(heap, &n, 0, self);
+
+	while (n) {
+		entry = heap_pop(heap, &n);
+		node = &nodes[entry.node];
+		if (entry.dist > node->dist)
+			continue;
+
+		for (i = 0; i < node->nlinks; i++) {
+			link = &node->links[i];
+			to = &nodes[link->to];
+			dist = entry.dist + link->rtt;
+			if (link->rtt == 0 || dist >= to->dist)
+				continue;
+
+			to->dist = dist;
+			to->prev = entry.node;
+			to->next = entry.node == self ? link->to : node->next;
+			heap_push(heap, &n, dist, link->to);
+		}
+	}
+
+	free(heap);
+	dirty = FALSE;
+}
+
+/* first hop towards peer i and the path's cost, -1 if unreachable */
+static int
+route_choose(int i, uint64_t *cost)
+{
+	route_link_t *direct;
+
+	if (dirty)
+		route_compute();
+
+	if (nodes[i].next < 0)
+		return -1;
+
+	/* stick to a working direct link unless a detour really pays */
+	direct = route_find(self, i);
+	if (direct && direct->rtt && direct->rtt <= ROUTE_DETOUR * nodes[i].dist) {
+		*cost = direct->rtt;
+		return i;
+	}
+
+	*cost = nodes[i].dist;
+	return nodes[i].next;
+}
+
+/* lock not held from here on */
+
+static void
+route_flood(const char *line, peer_info_t *except)
+{
+	buf_t *buf;
+	int i;
+
+	buf = buf_line(line);
+	for (i = 0; i < npeers; i++) {
+		if (__atomic_load_n(&links_up[i], __ATOMIC_RELAXED) &&
+		    peers_table[i] != except)
+			reactor_control(peers_table[i], buf);
+	}
+	buf_unref(buf);
+}
+
+void
+route_link(peer_info_t *peer_info, int up)
+{
+	char line[LINESIZE];
+	int i = peer_info->index;
+
+	pthread_mutex_lock(&route_mutex);
+	if (links_up[i] == up) {
+		pthread_mutex_unlock(&route_mutex);
+		return;
+	}
+
+	__atomic_store_n(&links_up[i], up, __ATOMIC_RELAXED);
+	route_own(i, up ? (measured[i] ? measured[i] : ROUTE_RTT) : 0, line);
+	pthread_mutex_unlock(&route_mutex);
+
+	route_flood(line, NULL);
+}
+
+void
+route_sample(peer_info_t *peer_info, uint64_t rtt)
+{
+	char line[LINESIZE];
+	route_link_t *link;
+	uint32_t m, reported, diff;
+	int i = peer_info->index, flood = FALSE;
+
+	if (rtt == 0)
+		rtt = 1;
+
+	pthread_mutex_lock(&route_mutex);
+	m = measured[i] = measured[i] ? (7 * (uint64_t)measured[i] + rtt) / 8 : rtt;
+
+	link = route_find(self, i);
+	reported = link ? link->rtt : 0;
+	diff = m > reported ? m - reported : reported - m;
+	if (links_up[i] && reported &&
+	    (uint64_t)diff * 100 > (uint64_t)reported * ROUTE_CHANGE) {
+		route_own(i, m, line);
+		flood = TRUE;
+	}
+	pthread_mutex_unlock(&route_mutex);
+
+	if (flood)
+		route_flood(line, NULL);
+}
+
+uint32_t
+route_rtt(const peer_info_t *peer_info)
+{
+	return __atomic_load_n(&measured[peer_info->index], __ATOMIC_RELAXED);
+}
+
+peer_info_t *
+route_next(peer_info_t *target)
+{
+	uint64_t cost;
+	int next;
+
+	pthread_mutex_lock(&route_mutex);
+	next = route_choose(target->index, &cost);
+	pthread_mutex_unlock(&route_mutex);
+
+	return next < 0 ? NULL : peers_table[next];
+}
+
+int
+route_path(peer_info_t *target, peer_info_t **path, int max, uint64_t *rtt)
+{
+	int hops = 0, i, next;
+
+	pthread_mutex_lock(&route_mutex);
+	next = route_choose(target->index, rtt);
+	if (next == target->index) {
+		hops = 1;
+	}
+	else if (next >= 0) {
+		for (i = target->index; i != self; i = nodes[i].prev)
+			hops++;
+	}
+
+	if (next < 0 || hops > max) {
+		pthread_mutex_unlock(&route_mutex);
+		return -1;
+	}
+
+	/* walked backwards from the target */
+	path[hops - 1] = target;
+	for (i = hops - 2, next = nodes[target->index].prev; i >= 0; i--) {
+		path[i] = peers_table[next];
+		next = nodes[next].prev;
+	}
+	pthread_mutex_unlock(&route_mutex);
+
+	return hops;
+}
+
+void
+route_send(peer_info_t *target, peer_info_t *next, const char *message)
+{
+	char line[LINESIZE];
+	buf_t *buf;
+
+	snprintf(line, LINESIZE, "fwd %s %s %d %s", self_info->id, target->id,
+		ROUTE_TTL, message);
+	buf = buf_line(line);
+	buf->frame = TRUE;
+	reactor_publish(next, buf);
+	buf_unref(buf);
+}
+
+buf_t *
+route_announce()
+{
+	route_link_t *link;
+	buf_t *buf = NULL;
+	FILE *out;
+	char *data;
+	size_t len;
+	int i, j;
+
+	out = open_memstream(&data, &len);
+	if (out == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&route_mutex);
+	for (i = 0; i <= self; i++) {
+		for (j = 0; j < nodes[i].nlinks; j++) {
+			link = &nodes[i].links[j];
+			fprintf(out, "link %s %lu %s %u\n", route_name(i),
+				(unsigned long)link->version, route_name(link->to),
+				link->rtt);
+		}
+	}
+	pthread_mutex_unlock(&route_mutex);
+
+	fclose(out);
+	if (len)
+		buf = buf_from(data, len);
+	free(data);
+
+	return buf;
+}
+
+void
+route_update(peer_info_t *peer_info, const char *args)
+{
+	char origin[BUFFSIZE], to[BUFFSIZE], line[LINESIZE];
+	unsigned long version;
+	unsigned int rtt;
+	int o, t, news, oend = 0, tend = 0;
+
+	/* ids longer than a token can be are nobody's, drop the line */
+	if (sscanf(args, "%254s%n %lu %254s%n %u", origin, &oend, &version, to, &tend,
+		   &rtt) < 4 || args[oend] != ' ' || args[tend] != ' ')
+		return;
+
+	/* our own links only we can tell */
+	o = route_index(origin);
+	t = route_index(to);
+	if (o < 0 || t < 0 || o == self || o == t)
+		return;
+
+	pthread_mutex_lock(&route_mutex);
+	news = route_set(o, t, rtt, version);
+	pthread_mutex_unlock(&route_mutex);
+
+	if (!news)
+		return;
+
+	metric_add(MC_ROUTE_UPDATES, 1);
+	snprintf(line, LINESIZE, "link %s", args);
+	route_flood(line, peer_info);
+}
+
+void
+route_forward(peer_info_t *peer_info, const char *args)
+{
+	char origin[BUFFSIZE], target[BUFFSIZE], line[LINESIZE];
+	peer_info_t *target_info, *next = NULL;
+	buf_t *buf;
+	int ttl, at, off = 0, oend = 0, tend = 0;
+
+	if (sscanf(args, "%254s%n %254s%n %n%d %n", origin, &oend, target, &tend, &at,
+		   &ttl, &off) < 3 || args[oend] != ' ' || args[tend] != ' ' || off == 0)
+		return;
+
+	/* only messages of other nodes we know, with hops left */
+	if (ttl <= 0 || g_hash_table_lookup(peers_by_id, origin) == NULL) {
+		metric_add(MC_ROUTE_DROPPED, 1);
+		return;
+	}
+
+	if (strcmp(target, self_info->id) == 0) {
+		metric_peer_add(peer_info, MP_MSGS_RECEIVED, 1);
+		chat_message(MSGDIR_IN, origin, args + off);
+		return;
+	}
+
+	target_info = g_hash_table_lookup(peers_by_id, target);
+	if (target_info && ttl > 1)
+		next = route_next(target_info);
+
+	/* never straight back, the sender's view is newer than ours */
+	if (next == NULL || next == peer_info) {
+		metric_add(MC_ROUTE_DROPPED, 1);
+#ifdef DEBUG
+		snprintf(line, LINESIZE, "no route to %s, dropped a message from %s",
+			target, origin);
+		chat_writeln(TRUE, LOG_DEBUG, line);
+#endif
+		return;
+	}
+
+	/* the same line, one hop less */
+	snprintf(line, LINESIZE, "fwd %.*s%d %s", at, args, ttl - 1, args + off);
+	buf = buf_line(line);
+	buf->frame = TRUE;
+	reactor_publish(next, buf);
+	buf_unref(buf);
+
+	metric_add(MC_ROUTE_FORWARDED, 1);
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ROUTE_H
+#define _ROUTE_H
+
+#include <stdint.h>
+
+#include "peers.h"
+#include "pool.h"
+
+/*
+ * Overlay routing.  A node's links are the peers it holds an outgoing
+ * tcp connection to, weighted by their heartbeat round trip.  Links are
+ * flooded to the whole cluster as protocol lines, newest version wins:
+ *
+ *     link <origin> <version> <to> <rtt_us>   rtt 0 is a link gone down
+ *
+ * sent on a link's change (up, down, or its rtt moving by ROUTE_CHANGE
+ * percent) and, for the whole database, to every peer we connect to.
+ * Shortest paths from us are recomputed (dijkstra) the first time one
+ * is needed after the database changed.
+ *
+ * Messages for a peer we can't reach directly, or only over a much
+ * slower link than a relay path, travel hop by hop as
+ *
+ *     fwd <origin> <target> <ttl> <message>
+ *
+ * sequenced and acked on every hop, never end to end.
+ */
+
+/* hops a relayed message may take */
+#define ROUTE_TTL 16
+/* cost of a link until its rtt is measured, usec */
+#define ROUTE_RTT 1000
+/* rtt change worth flooding, percent */
+#define ROUTE_CHANGE 25
+/* a direct link is used unless a relay path is this many times faster */
+#define ROUTE_DETOUR 2
+
+void
+route_init();
+
+/* our outgoing connection to peer_info went up or down */
+void
+route_link(peer_info_t *peer_info, int up);
+
+/* a heartbeat round trip to peer_info, usec */
+void
+route_sample(peer_info_t *peer_info, uint64_t rtt);
+
+/* smoothed round trip to peer_info, usec, 0 until measured */
+uint32_t
+route_rtt(const peer_info_t *peer_info);
+
+/* next hop towards target, target itself if direct, NULL if unreachable */
+peer_info_t *
+route_next(peer_info_t *target);
+
+/* hops from us to target into path (target last), -1 if unreachable */
+int
+route_path(peer_info_t *target, peer_info_t **path, int max, uint64_t *rtt);
+
+/* relays message to target through next, see route_next */
+void
+route_send(peer_info_t *target, peer_info_t *next, const char *message);
+
+/* the whole database as link lines, NULL if empty */
+buf_t *
+route_announce();
+
+/* called by the reactors */
+
+/* a link line from peer_info, flooded on if news */
+void
+route_update(peer_info_t *peer_info, const char *args);
+
+/* a fwd line from peer_info, delivered or passed on */
+void
+route_forward(peer_info_t *peer_info, const char *args);
+
+#endif /* _ROUTE_H */
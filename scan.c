@@ -0,0 +1,150 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "scan.h"
+
+typedef int (*scan_fn_t)(const char *data, size_t len, uint32_t *ends, int max);
+
+/* the tail shorter than a vector, and cpus without one */
+static int
+scan_scalar(const char *data, size_t len, uint32_t *ends, int max, size_t from,
+	int n)
+{
+	const char *eol;
+
+	while (n < max && (eol = memchr(data + from, '\n', len - from))) {
+		ends[n++] = eol - data;
+		from = eol - data + 1;
+	}
+
+	return n;
+}
+
+static int
+scan_lines_scalar(const char *data, size_t len, uint32_t *ends, int max)
+{
+	return scan_scalar(data, len, ends, max, 0, 0);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/* adds the newlines in a vector's match mask, returns the new count */
+static inline int
+scan_mask(uint32_t mask, size_t off, uint32_t *ends, int n, int max)
+{
+	while (mask && n < max) {
+		ends[n++] = off + __builtin_ctz(mask);
+		mask &= mask - 1;
+	}
+
+	return n;
+}
+
+__attribute__((target("sse2")))
+static int
+scan_lines_sse2(const char *data, size_t len, uint32_t *ends, int max)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	__m128i chunk;
+	size_t off = 0;
+	int n = 0;
+
+	for (; off + 16 <= len && n < max; off += 16) {
+		chunk = _mm_loadu_si128((const __m128i *)(data + off));
+		n = scan_mask(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl)), off,
+			ends, n, max);
+	}
+
+	/* a full ends may have stopped mid vector */
+	if (n == max)
+		return n;
+
+	return scan_scalar(data, len, ends, max, off, n);
+}
+
+__attribute__((target("avx2")))
+static int
+scan_lines_avx2(const char *data, size_t len, uint32_t *ends, int max)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	__m256i chunk;
+	size_t off = 0;
+	int n = 0;
+
+	for (; off + 32 <= len && n < max; off += 32) {
+		chunk = _mm256_loadu_si256((const __m256i *)(data + off));
+		n = scan_mask(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, nl)), off,
+			ends, n, max);
+	}
+
+	if (n == max)
+		return n;
+
+	return scan_scalar(data, len, ends, max, off, n);
+}
+
+#endif
+
+static int
+scan_resolve(const char *data, size_t len, uint32_t *ends, int max);
+
+static scan_fn_t scan_fn = scan_resolve;
+static const char *scan_name = "scalar";
+
+/* first call picks the implementation, racing callers pick the same */
+static int
+scan_resolve(const char *data, size_t len, uint32_t *ends, int max)
+{
+	scan_fn_t fn = scan_lines_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		fn = scan_lines_avx2;
+		scan_name = "avx2";
+	}
+	else if (__builtin_cpu_supports("sse2")) {
+		fn = scan_lines_sse2;
+		scan_name = "sse2";
+	}
+#endif
+	__atomic_store_n(&scan_fn, fn, __ATOMIC_RELAXED);
+
+	return fn(data, len, ends, max);
+}
+
+int
+scan_lines(const char *data, size_t len, uint32_t *ends, int max)
+{
+	return __atomic_load_n(&scan_fn, __ATOMIC_RELAXED)(data, len, ends, max);
+}
+
+const char *
+scan_impl()
+{
+	if (__atomic_load_n(&scan_fn, __ATOMIC_RELAXED) == scan_resolve)
+		scan_resolve("", 0, NULL, 0);
+
+	return scan_name;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SCAN_H
+#define _SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Newline scanning for the receive path.  A whole receive buffer is
+ * compared against '\n' a vector at a time (32 bytes with AVX2, 16 with
+ * SSE2, picked at run time) and every match of a vector is collected
+ * from its bitmask, so a buffer of short lines costs one pass instead of
+ * a memchr call per line.  Other cpus fall back to memchr.
+ */
+
+/* line ends handed out per scan */
+#define SCAN_BATCH 256
+
+/* offsets of the first (at most max) newlines in data, returns how many */
+int
+scan_lines(const char *data, size_t len, uint32_t *ends, int max);
+
+/* the implementation in use: avx2, sse2 or scalar */
+const char *
+scan_impl();
+
+#endif /* _SCAN_H */
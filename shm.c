@@ -0,0 +1,204 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shm.h"
+
+static shm_link_t *
+shm_map(int memfd, int efd, int peer_efd, int creator)
+{
+	shm_ring_t *rings;
+	shm_link_t *link;
+
+	rings = mmap(NULL, 2 * sizeof(shm_ring_t), PROT_READ | PROT_WRITE,
+		MAP_SHARED, memfd, 0);
+	if (rings == MAP_FAILED)
+		return NULL;
+
+	link = malloc(sizeof(shm_link_t));
+	link->memfd = memfd;
+	link->efd = efd;
+	link->peer_efd = peer_efd;
+	link->tx = &rings[creator ? 0 : 1];
+	link->rx = &rings[creator ? 1 : 0];
+
+	return link;
+}
+
+shm_link_t *
+shm_create(int fds[SHM_FDS])
+{
+	shm_link_t *link = NULL;
+	int memfd, efd, peer_efd;
+
+	memfd = memfd_create("chet2p", MFD_CLOEXEC);
+	efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	peer_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (memfd >= 0 && efd >= 0 && peer_efd >= 0 &&
+	    ftruncate(memfd, 2 * sizeof(shm_ring_t)) == 0)
+		link = shm_map(memfd, efd, peer_efd, 1);
+
+	if (link == NULL) {
+		close(memfd);
+		close(efd);
+		close(peer_efd);
+		return NULL;
+	}
+
+	fds[0] = memfd;
+	fds[1] = peer_efd;
+	fds[2] = efd;
+
+	return link;
+}
+
+shm_link_t *
+shm_attach(const int fds[SHM_FDS])
+{
+	struct stat st;
+	shm_link_t *link = NULL;
+
+	/* a peer handing us a short file would make us fault */
+	if (fstat(fds[0], &st) == 0 && st.st_size >= 2 * sizeof(shm_ring_t))
+		link = shm_map(fds[0], fds[1], fds[2], 0);
+
+	if (link == NULL) {
+		close(fds[0]);
+		close(fds[1]);
+		close(fds[2]);
+	}
+
+	return link;
+}
+
+void
+shm_destroy(shm_link_t *link)
+{
+	munmap(link->tx < link->rx ? link->tx : link->rx, 2 * sizeof(shm_ring_t));
+	close(link->memfd);
+	close(link->efd);
+	close(link->peer_efd);
+	free(link);
+}
+
+static void
+shm_wake(shm_link_t *link)
+{
+	uint64_t one = 1;
+
+	write(link->peer_efd, &one, sizeof(one));
+}
+
+size_t
+shm_write(shm_link_t *link, const struct iovec *iov, int iovcnt)
+{
+	shm_ring_t *ring = link->tx;
+	uint64_t tail = ring->tail, head;
+	size_t room, chunk, off, done = 0;
+	int i;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	room = SHM_RING - (tail - head);
+
+	if (room == 0) {
+		/* ask for a wakeup, unless the consumer made room meanwhile */
+		__atomic_store_n(&ring->full, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		room = SHM_RING - (tail - head);
+		if (room == 0)
+			return 0;
+		__atomic_store_n(&ring->full, 0, __ATOMIC_RELAXED);
+	}
+
+	for (i = 0; i < iovcnt && room; i++) {
+		for (off = 0; off < iov[i].iov_len && room; off += chunk) {
+			chunk = iov[i].iov_len - off;
+			if (chunk > room)
+				chunk = room;
+			if (chunk > SHM_RING - (tail % SHM_RING))
+				chunk = SHM_RING - (tail % SHM_RING);
+
+			memcpy(ring->data + tail % SHM_RING,
+				(char *)iov[i].iov_base + off, chunk);
+			tail += chunk;
+			room -= chunk;
+			done += chunk;
+		}
+	}
+
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	shm_wake(link);
+
+	return done;
+}
+
+size_t
+shm_read(shm_link_t *link, char *data, size_t len)
+{
+	shm_ring_t *ring = link->rx;
+	uint64_t head = ring->head, tail;
+	size_t avail, chunk, done = 0;
+
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	avail = tail - head;
+	if (avail == 0)
+		return 0;
+
+	if (len > avail)
+		len = avail;
+
+	while (done < len) {
+		chunk = len - done;
+		if (chunk > SHM_RING - (head % SHM_RING))
+			chunk = SHM_RING - (head % SHM_RING);
+
+		memcpy(data + done, ring->data + head % SHM_RING, chunk);
+		head += chunk;
+		done += chunk;
+	}
+
+	__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+	/* pairs with the producer's fence between setting full and rereading head */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->full, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&ring->full, 0, __ATOMIC_RELAXED);
+		shm_wake(link);
+	}
+
+	return done;
+}
+
+void
+shm_clear(shm_link_t *link)
+{
+	uint64_t counter;
+
+	read(link->efd, &counter, sizeof(counter));
+}
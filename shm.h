@@ -0,0 +1,86 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SHM_H
+#define _SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "spsc.h"
+
+/*
+ * Shared memory link between two processes on the same host.  A memfd
+ * holds a byte ring per direction, each with a single producer and a
+ * single consumer; an eventfd per side wakes it up when the other one
+ * wrote data or made room.  The side creating the link passes the memfd
+ * and both eventfds over a unix socket (SCM_RIGHTS), which then stays
+ * open so that either side notices the other going away.
+ */
+
+#define SHM_RING (64 * 1024)
+/* memfd, the receiver's eventfd, the creator's eventfd */
+#define SHM_FDS 3
+
+typedef struct {
+	/* consumer side */
+	uint64_t head __attribute__((aligned(CACHELINE)));
+
+	/* producer side */
+	uint64_t tail __attribute__((aligned(CACHELINE)));
+	/* the producer ran out of room, the consumer has to wake it */
+	int full;
+
+	char data[SHM_RING] __attribute__((aligned(CACHELINE)));
+} shm_ring_t;
+
+typedef struct {
+	int memfd;
+	/* ours, the peer signals it; and the peer's */
+	int efd;
+	int peer_efd;
+	shm_ring_t *tx;
+	shm_ring_t *rx;
+} shm_link_t;
+
+/* a new link, fds gets what goes to the peer; NULL on failure */
+shm_link_t *
+shm_create(int fds[SHM_FDS]);
+
+/* the peer's end of a link, takes ownership of fds */
+shm_link_t *
+shm_attach(const int fds[SHM_FDS]);
+
+void
+shm_destroy(shm_link_t *link);
+
+/* copies as much of iov as fits and wakes the peer, returns bytes copied */
+size_t
+shm_write(shm_link_t *link, const struct iovec *iov, int iovcnt);
+
+/* up to len bytes, waking the peer if it waits for room */
+size_t
+shm_read(shm_link_t *link, char *data, size_t len);
+
+/* consumes a wakeup */
+void
+shm_clear(shm_link_t *link);
+
+#endif /* _SHM_H */
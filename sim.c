@@ -0,0 +1,450 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * chet2p-sim: runs thousands of nodes (node.h, the membership code
+ * chet2p runs) in one process over a virtual network with latency, loss
+ * and partitions, and reports how long membership views take to
+ * converge and how accurate they stay.  Messages are not simulated.
+ *
+ * Time is virtual and advances a millisecond at a time.  Heartbeats are
+ * datagrams, lost ones are gone.  Nothing crosses a partition and a
+ * crashed node's in flight messages die with it.  With loss some views
+ * are always wrong for a while, so views count as converged once at
+ * most a tolerance of all pairs is.
+ */
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "node.h"
+
+#define SIM_WHEEL 8192
+#define SIM_CONVERGENCES 64
+#define SIM_TOLERANCE 0.001
+
+typedef struct {
+	uint32_t to;
+	uint32_t from;
+	uint16_t gen;
+	uint8_t type;
+} event_t;
+
+typedef struct {
+	event_t *events;
+	size_t n;
+	size_t cap;
+} slot_t;
+
+typedef struct {
+	node_t node;
+	uint32_t index;
+	uint16_t gen;
+	int up;
+	int side;
+	uint64_t deadline;
+} sim_node_t;
+
+typedef struct {
+	uint64_t at;
+	const char *reason;
+	long ms;
+} convergence_t;
+
+static int nnodes = 1000;
+static int duration = 30;
+static double loss;
+static int latency = 1;
+static int jitter;
+static double part_at = -1;
+static double part_len;
+static double part_frac = 0.5;
+static double tolerance = SIM_TOLERANCE;
+static int crash_every;
+static uint64_t seed;
+
+static sim_node_t *nodes;
+static slot_t wheel[SIM_WHEEL];
+static uint64_t now;
+static int partitioned;
+
+/* pairs (up node, peer) whose view differs from the truth */
+static long wrong;
+static int converged;
+static uint64_t changed_at;
+static const char *changed_why;
+static convergence_t convergences[SIM_CONVERGENCES];
+static int nconvergences;
+
+static unsigned long msgs_sent, msgs_lost, msgs_cut;
+static unsigned long false_dead, false_alive;
+static double wrong_sum;
+/* from the first convergence after start on */
+static double steady_sum;
+static uint64_t steady_since;
+
+static uint64_t
+rnd()
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+static double
+rnd_unit()
+{
+	return (rnd() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static inline uint32_t
+peer_to_node(uint32_t self, int peer)
+{
+	return peer < self ? peer : peer + 1;
+}
+
+static inline int
+node_to_peer(uint32_t self, uint32_t other)
+{
+	return other < self ? other : other - 1;
+}
+
+static inline int
+truth(uint32_t i, uint32_t j)
+{
+	return nodes[j].up && (!partitioned || nodes[i].side == nodes[j].side);
+}
+
+static void
+schedule(uint64_t at, const event_t *ev)
+{
+	slot_t *slot = &wheel[at % SIM_WHEEL];
+
+	if (slot->n == slot->cap) {
+		slot->cap = slot->cap ? slot->cap * 2 : 64;
+		slot->events = realloc(slot->events, slot->cap * sizeof(event_t));
+	}
+	slot->events[slot->n++] = *ev;
+}
+
+static void
+sim_send(node_t *node, int peer, const node_msg_t *msg)
+{
+	sim_node_t *from = node->data;
+	event_t ev;
+	uint64_t delay;
+
+	ev.from = from->index;
+	ev.to = peer_to_node(from->index, peer);
+	ev.gen = from->gen;
+	ev.type = msg->type;
+	msgs_sent++;
+
+	if (partitioned && from->side != nodes[ev.to].side) {
+		msgs_cut++;
+		return;
+	}
+
+	delay = latency + (jitter ? rnd() % (jitter + 1) : 0);
+
+	if (rnd_unit() < loss) {
+		msgs_lost++;
+		return;
+	}
+
+	schedule(now + (delay ? delay : 1), &ev);
+}
+
+static void
+sim_status(node_t *node, int peer, int was, int alive)
+{
+	sim_node_t *self = node->data;
+	uint32_t other = peer_to_node(self->index, peer);
+	int real = truth(self->index, other);
+
+	if (was == alive)
+		return;
+
+	wrong += (alive != real) - (was != real);
+	if (alive && !real)
+		false_alive++;
+	else if (!alive && real)
+		false_dead++;
+}
+
+static const node_ops_t sim_ops = {
+	.send = sim_send,
+	.status = sim_status,
+};
+
+static void
+truth_changed(const char *why)
+{
+	changed_at = now;
+	changed_why = why;
+	converged = 0;
+}
+
+/* adds (sign 1) or removes (sign -1) node k's own view */
+static void
+count_row(uint32_t k, int sign)
+{
+	uint32_t j;
+
+	for (j = 0; j < nnodes; j++) {
+		if (j != k && (node_alive(&nodes[k].node, node_to_peer(k, j)) != 0) != truth(k, j))
+			wrong += sign;
+	}
+}
+
+/* adds or removes every other up node's view of k */
+static void
+count_column(uint32_t k, int sign)
+{
+	uint32_t i;
+
+	for (i = 0; i < nnodes; i++) {
+		if (i != k && nodes[i].up &&
+		    (node_alive(&nodes[i].node, node_to_peer(i, k)) != 0) != truth(i, k))
+			wrong += sign;
+	}
+}
+
+static void
+count_all()
+{
+	uint32_t i;
+
+	wrong = 0;
+	for (i = 0; i < nnodes; i++) {
+		if (nodes[i].up)
+			count_row(i, 1);
+	}
+}
+
+static void
+node_start(sim_node_t *sn)
+{
+	node_init(&sn->node, nnodes - 1, &sim_ops, sn);
+	/* processes don't start in lockstep, neither do their heartbeats */
+	sn->node.next_probe = now + rnd() % sn->node.probe_ms;
+	sn->deadline = sn->node.next_probe;
+	sn->up = 1;
+}
+
+static void
+crash_one()
+{
+	sim_node_t *sn = &nodes[rnd() % nnodes];
+
+	if (!sn->up)
+		return;
+
+	count_column(sn->index, -1);
+	count_row(sn->index, -1);
+	sn->up = 0;
+	sn->gen++;
+	node_destroy(&sn->node);
+	count_column(sn->index, 1);
+	truth_changed("crash");
+}
+
+static void
+restart_down()
+{
+	uint32_t i;
+
+	for (i = 0; i < nnodes; i++) {
+		if (nodes[i].up)
+			continue;
+
+		count_column(i, -1);
+		node_start(&nodes[i]);
+		count_row(i, 1);
+		count_column(i, 1);
+		truth_changed("restart");
+	}
+}
+
+static void
+partition(int on)
+{
+	uint32_t i;
+
+	partitioned = on;
+	if (on) {
+		for (i = 0; i < nnodes; i++)
+			nodes[i].side = rnd_unit() < part_frac;
+	}
+	count_all();
+	truth_changed(on ? "partition" : "heal");
+}
+
+static void
+deliver_slot()
+{
+	slot_t *slot = &wheel[now % SIM_WHEEL];
+	sim_node_t *to, *from;
+	node_msg_t msg;
+	size_t i;
+
+	for (i = 0; i < slot->n; i++) {
+		to = &nodes[slot->events[i].to];
+		from = &nodes[slot->events[i].from];
+
+		if (!to->up || from->gen != slot->events[i].gen)
+			continue;
+
+		msg.type = slot->events[i].type;
+		node_receive(&to->node, node_to_peer(to->index, from->index), &msg);
+	}
+	slot->n = 0;
+}
+
+static void
+report(double wall)
+{
+	double pairs = (double)nnodes * (nnodes - 1);
+	int i;
+
+	printf("{\n");
+	printf("  \"config\": {\"nodes\": %d, \"duration_s\": %d, \"loss\": %g, "
+		"\"latency_ms\": %d, \"jitter_ms\": %d, \"misses\": %d, "
+		"\"tolerance\": %g, \"crash_every_s\": %d, \"partition\": [%g, %g, %g]},\n",
+		nnodes, duration, loss, latency, jitter, NODE_MISSES, tolerance,
+		crash_every, part_at, part_len, part_frac);
+	printf("  \"wall_s\": %.2f,\n", wall);
+	printf("  \"messages\": {\"sent\": %lu, \"lost\": %lu, \"cut\": %lu},\n",
+		msgs_sent, msgs_lost, msgs_cut);
+	printf("  \"views\": {\"accuracy\": %.4f, \"steady_accuracy\": %.4f, "
+		"\"wrong_at_end\": %ld, \"false_dead\": %lu, \"false_alive\": %lu},\n",
+		1 - wrong_sum / now / pairs,
+		nconvergences ? 1 - steady_sum / (now - steady_since) / pairs : 0,
+		wrong, false_dead, false_alive);
+	printf("  \"convergence\": [");
+	for (i = 0; i < nconvergences; i++)
+		printf("%s{\"at_ms\": %lu, \"after\": \"%s\", \"ms\": %ld}", i ? ", " : "",
+			(unsigned long)convergences[i].at, convergences[i].reason,
+			convergences[i].ms);
+	printf("]\n");
+	printf("}\n");
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-n nodes] [-t seconds] [-l loss] [-L latency_ms] "
+		"[-j jitter_ms] [-p at:len[:fraction]] [-e tolerance] [-C crash_every_s] [-s seed]\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct timespec start, end;
+	uint64_t end_ms;
+	uint32_t i;
+	int opt;
+
+	seed = time(NULL);
+
+	while ((opt = getopt(argc, argv, "n:t:l:L:j:p:e:C:s:")) != -1) {
+		switch (opt) {
+		case 'n': nnodes = atoi(optarg); break;
+		case 't': duration = atoi(optarg); break;
+		case 'l': loss = atof(optarg); break;
+		case 'L': latency = atoi(optarg); break;
+		case 'j': jitter = atoi(optarg); break;
+		case 'p':
+			if (sscanf(optarg, "%lf:%lf:%lf", &part_at, &part_len, &part_frac) < 2)
+				usage(argv[0]);
+			break;
+		case 'e': tolerance = atof(optarg); break;
+		case 'C': crash_every = atoi(optarg); break;
+		case 's': seed = strtoull(optarg, NULL, 10); break;
+		default: usage(argv[0]);
+		}
+	}
+
+	/* the longest trip has to fit in the wheel */
+	if (nnodes < 2 || duration < 1 || loss < 0 || loss > 1 || latency < 0 ||
+	    jitter < 0 || latency + jitter >= SIM_WHEEL ||
+	    part_frac <= 0 || part_frac >= 1 || tolerance < 0 || crash_every < 0)
+		usage(argv[0]);
+
+	if (seed == 0)
+		seed = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	nodes = calloc(nnodes, sizeof(sim_node_t));
+	for (i = 0; i < nnodes; i++) {
+		nodes[i].index = i;
+		node_start(&nodes[i]);
+	}
+	count_all();
+	truth_changed("start");
+
+	end_ms = duration * 1000ULL;
+	for (now = 0; now < end_ms; now++) {
+		if (part_at >= 0 && now == (uint64_t)(part_at * 1000))
+			partition(1);
+		if (part_at >= 0 && now == (uint64_t)((part_at + part_len) * 1000))
+			partition(0);
+
+		/* crashed nodes stay down for a heartbeat round */
+		if (crash_every && now % (crash_every * 1000ULL) == 0 && now) {
+			restart_down();
+			crash_one();
+		}
+
+		deliver_slot();
+
+		for (i = 0; i < nnodes; i++) {
+			if (nodes[i].up && nodes[i].deadline <= now)
+				nodes[i].deadline = node_tick(&nodes[i].node, now);
+		}
+
+		wrong_sum += wrong;
+		if (nconvergences)
+			steady_sum += wrong;
+		if (!converged && wrong <= tolerance * nnodes * (nnodes - 1)) {
+			converged = 1;
+			if (nconvergences == 0)
+				steady_since = now;
+			if (nconvergences < SIM_CONVERGENCES) {
+				convergences[nconvergences].at = now;
+				convergences[nconvergences].reason = changed_why;
+				convergences[nconvergences].ms = now - changed_at;
+				nconvergences++;
+			}
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	report(end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+	exit(EXIT_SUCCESS);
+}
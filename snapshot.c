@@ -0,0 +1,194 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chatgui.h"
+#include "chet2p.h"
+#include "membership.h"
+#include "peers.h"
+#include "route.h"
+#include "snapshot.h"
+
+static const char *snapshot_path;
+static pthread_t snapshot_tid;
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snapshot_cond = PTHREAD_COND_INITIALIZER;
+static int snapshot_running;
+
+static uint64_t
+snapshot_clock()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+int
+snapshot_load(const char *path)
+{
+	char line[LINESIZE], self_id[LINESIZE], id[LINESIZE], addr[LINESIZE];
+	unsigned long long written;
+	peer_info_t *peer_info;
+	int version, udp, tcp, alive, warm = 0;
+	unsigned int rtt;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+
+	if (fgets(line, LINESIZE, f) == NULL ||
+	    sscanf(line, "chet2p-snapshot %d %254s %llu", &version, self_id, &written) != 3 ||
+	    version != SNAPSHOT_VERSION || strcmp(self_id, self_info->id) != 0 ||
+	    snapshot_clock() - written > SNAPSHOT_FRESH_S * 1000000ULL) {
+		fclose(f);
+		return 0;
+	}
+
+	while (fgets(line, LINESIZE, f)) {
+		if (sscanf(line, "%254s %254s %d %d %d %u", id, addr, &udp, &tcp,
+			   &alive, &rtt) != 6)
+			continue;
+
+		/* only peers still where the snapshot saw them */
+		peer_info = g_hash_table_lookup(peers_by_id, id);
+		if (peer_info == NULL || peer_info->in_addr != inet_addr(addr) ||
+		    ntohs(peer_info->udp_port) != udp || ntohs(peer_info->tcp_port) != tcp)
+			continue;
+
+		if (rtt)
+			route_sample(peer_info, rtt);
+		if (alive) {
+			peer_info->warm = TRUE;
+			warm++;
+		}
+	}
+
+	fclose(f);
+	return warm;
+}
+
+static void
+snapshot_write()
+{
+	const membership_t *membership;
+	const member_t *member;
+	char tmp[PATH_MAX];
+	struct in_addr in_addr;
+	FILE *f;
+	int i;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", snapshot_path);
+	f = fopen(tmp, "w");
+	if (f == NULL)
+		return;
+
+	membership = membership_read();
+	fprintf(f, "chet2p-snapshot %d %s %llu\n", SNAPSHOT_VERSION, self_info->id,
+		(unsigned long long)snapshot_clock());
+	for (i = 0; i < membership->nmembers; i++) {
+		member = &membership->members[i];
+		in_addr.s_addr = member->peer->in_addr;
+		fprintf(f, "%s %s %d %d %d %u\n", member->peer->id, inet_ntoa(in_addr),
+			ntohs(member->peer->udp_port), ntohs(member->peer->tcp_port),
+			member->alive, route_rtt(member->peer));
+	}
+
+	/* readers see the previous snapshot or this one, never half of it */
+	if (fclose(f) == 0)
+		rename(tmp, snapshot_path);
+	else
+		remove(tmp);
+}
+
+static void *
+snapshot_writer(void *data)
+{
+	struct timespec deadline;
+
+	pthread_mutex_lock(&snapshot_mutex);
+	while (snapshot_running) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += SNAPSHOT_PERIOD_MS / 1000;
+		deadline.tv_nsec += SNAPSHOT_PERIOD_MS % 1000 * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		if (pthread_cond_timedwait(&snapshot_cond, &snapshot_mutex, &deadline) == ETIMEDOUT)
+			snapshot_write();
+	}
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	return NULL;
+}
+
+void
+snapshot_start(const char *path)
+{
+	char line[LINESIZE];
+	int i, warm = 0;
+
+	/* all dials are posted before any completes */
+	for (i = 0; i < npeers; i++) {
+		if (peers_table[i]->warm) {
+			update_peer_status(peers_table[i], TRUE);
+			warm++;
+		}
+	}
+
+	if (warm) {
+		snprintf(line, LINESIZE, "warm start from %s, %d of %d peers alive",
+			path, warm, npeers);
+		chat_writeln(TRUE, LOG_INFO, line);
+	}
+
+	snapshot_path = path;
+	snapshot_running = TRUE;
+	pthread_create(&snapshot_tid, NULL, snapshot_writer, NULL);
+}
+
+void
+snapshot_stop()
+{
+	if (snapshot_path == NULL)
+		return;
+
+	pthread_mutex_lock(&snapshot_mutex);
+	snapshot_running = FALSE;
+	pthread_cond_signal(&snapshot_cond);
+	pthread_mutex_unlock(&snapshot_mutex);
+	pthread_join(snapshot_tid, NULL);
+
+	snapshot_write();
+	snapshot_path = NULL;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include "peers.h"
+
+/*
+ * Warm restart.  Every SNAPSHOT_PERIOD_MS the membership view is written
+ * to a small text file, replaced atomically:
+ *
+ *     chet2p-snapshot <version> <self_id> <written, unix usec>
+ *     <id> <addr> <udp_port> <tcp_port> <alive> <rtt_us>
+ *
+ * one line per peer, as load_peers built the table.  On startup a
+ * snapshot younger than SNAPSHOT_FRESH_S marks the peers alive in it as
+ * alive right away (warm) and dials them all at once, instead of waiting
+ * for the first heartbeat round.  Peers whose address changed in the
+ * peers file since are left cold.  A warm peer is confirmed by its first
+ * probe or connection; a refused connect marks it not alive again.
+ */
+
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_PERIOD_MS 2000
+#define SNAPSHOT_FRESH_S 60
+
+/* reads path after load_peers, returns the number of warm peers */
+int
+snapshot_load(const char *path);
+
+/* warms the peers read and starts writing snapshots to path */
+void
+snapshot_start(const char *path);
+
+/* writes the last snapshot */
+void
+snapshot_stop();
+
+#endif /* _SNAPSHOT_H */
@@ -0,0 +1,89 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "spsc.h"
+
+int
+spsc_init(spsc_t *queue, unsigned long size, size_t elemsize)
+{
+	unsigned long capacity = 1;
+
+	while (capacity < size)
+		capacity <<= 1;
+
+	memset(queue, 0, sizeof(spsc_t));
+	queue->mask = capacity - 1;
+	queue->elemsize = elemsize;
+	queue->slots = malloc(capacity * elemsize);
+
+	return queue->slots ? 0 : -1;
+}
+
+void
+spsc_destroy(spsc_t *queue)
+{
+	free(queue->slots);
+	queue->slots = NULL;
+}
+
+int
+spsc_push(spsc_t *queue, const void *elem)
+{
+	unsigned long tail = queue->tail;
+
+	if (tail - queue->head_cache > queue->mask) {
+		queue->head_cache = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+		if (tail - queue->head_cache > queue->mask)
+			return -1;
+	}
+
+	memcpy(queue->slots + (tail & queue->mask) * queue->elemsize,
+		elem, queue->elemsize);
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+int
+spsc_pop(spsc_t *queue, void *elem)
+{
+	unsigned long head = queue->head;
+
+	if (head == queue->tail_cache) {
+		queue->tail_cache = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+		if (head == queue->tail_cache)
+			return -1;
+	}
+
+	memcpy(elem, queue->slots + (head & queue->mask) * queue->elemsize,
+		queue->elemsize);
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+int
+spsc_empty(spsc_t *queue)
+{
+	return __atomic_load_n(&queue->head, __ATOMIC_RELAXED) ==
+		__atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SPSC_H
+#define _SPSC_H
+
+#include <stddef.h>
+
+#define CACHELINE 64
+
+/*
+ * Bounded single producer, single consumer ring of fixed size elements.
+ * Exactly one thread may push and exactly one thread may pop, no locks
+ * are taken on either side.
+ */
+typedef struct {
+	/* consumer side */
+	unsigned long head __attribute__((aligned(CACHELINE)));
+	unsigned long tail_cache;
+
+	/* producer side */
+	unsigned long tail __attribute__((aligned(CACHELINE)));
+	unsigned long head_cache;
+
+	unsigned long mask __attribute__((aligned(CACHELINE)));
+	size_t elemsize;
+	char *slots;
+} spsc_t;
+
+/* size is rounded up to a power of two */
+int
+spsc_init(spsc_t *queue, unsigned long size, size_t elemsize);
+
+void
+spsc_destroy(spsc_t *queue);
+
+/* 0 on success, -1 if the ring is full */
+int
+spsc_push(spsc_t *queue, const void *elem);
+
+/* 0 on success, -1 if the ring is empty */
+int
+spsc_pop(spsc_t *queue, void *elem);
+
+int
+spsc_empty(spsc_t *queue);
+
+#endif /* _SPSC_H */
@@ -0,0 +1,149 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *rings;
+
+static __thread trace_ring_t *thread_ring;
+
+static trace_ring_t *
+trace_ring()
+{
+	trace_ring_t *ring = thread_ring;
+
+	if (ring)
+		return ring;
+
+	ring = calloc(1, sizeof(trace_ring_t));
+	ring->tid = syscall(SYS_gettid);
+	snprintf(ring->thread, sizeof(ring->thread), "thread %d", ring->tid);
+
+	pthread_mutex_lock(&rings_mutex);
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&rings_mutex);
+
+	thread_ring = ring;
+	return ring;
+}
+
+void
+trace_record(const char *name, uint64_t start, uint64_t end)
+{
+	trace_ring_t *ring = trace_ring();
+	trace_event_t *event = &ring->events[ring->head % TRACE_RING];
+
+	event->name = name;
+	event->start = start;
+	event->dur = end - start;
+
+	/* publishes the event, readers check head to spot overwrites */
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void
+trace_thread(const char *fmt, ...)
+{
+	trace_ring_t *ring = trace_ring();
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(ring->thread, sizeof(ring->thread), fmt, ap);
+	va_end(ap);
+}
+
+/* copies the events of ring still intact, returns how many */
+static int
+trace_copy(trace_ring_t *ring, trace_event_t *events)
+{
+	uint64_t head, first, last, i;
+	int n = 0;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	first = head > TRACE_RING ? head - TRACE_RING : 0;
+
+	for (i = first; i < head; i++)
+		events[n++] = ring->events[i % TRACE_RING];
+
+	/* the writer may have lapped us meanwhile, and may be writing last */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	last = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	if (last + 1 > first + TRACE_RING) {
+		i = last + 1 - TRACE_RING - first;
+		if (i > n)
+			i = n;
+		memmove(events, events + i, (n - i) * sizeof(trace_event_t));
+		n -= i;
+	}
+
+	return n;
+}
+
+int
+trace_dump(const char *path, int seconds)
+{
+	trace_event_t *events;
+	trace_ring_t *ring;
+	uint64_t since;
+	int pid, n, i, first = 1;
+	FILE *out;
+
+	out = fopen(path, "w");
+	if (out == NULL)
+		return -1;
+
+	since = trace_clock() - seconds * 1000000000ULL;
+	events = malloc(TRACE_RING * sizeof(trace_event_t));
+	pid = getpid();
+
+	fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+
+	pthread_mutex_lock(&rings_mutex);
+	for (ring = rings; ring; ring = ring->next) {
+		fprintf(out, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+			"\"args\": {\"name\": \"%s\"}}", first ? "" : ",\n", pid, ring->tid,
+			ring->thread);
+		first = 0;
+
+		n = trace_copy(ring, events);
+		for (i = 0; i < n; i++) {
+			if (events[i].start < since)
+				continue;
+			fprintf(out, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, "
+				"\"ts\": %.3f, \"dur\": %.3f}", events[i].name, pid, ring->tid,
+				events[i].start / 1000.0, events[i].dur / 1000.0);
+		}
+	}
+	pthread_mutex_unlock(&rings_mutex);
+
+	fprintf(out, "\n]}\n");
+	free(events);
+
+	return fclose(out);
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright © 2012 Maykel Moya <mmoya@mmoya.org>
+ *
+ * This file is part of chet2p
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Hot path tracing.  A tracepoint brackets a piece of work and records
+ * its name, start and duration in nanoseconds into a ring owned by the
+ * calling thread; the writer never locks and the oldest events get
+ * overwritten.  trace_dump copies the rings out and writes the last
+ * seconds in chrome trace event json (chrome://tracing, ui.perfetto.dev).
+ *
+ * Tracepoints only exist in builds with TRACE defined (make T=1), the
+ * macros expand to nothing otherwise.
+ *
+ *     TRACE_BEGIN(fork);
+ *     pid = fork();
+ *     TRACE_END(fork);
+ */
+
+#define TRACE_RING 4096
+/* what trace dump covers by default */
+#define TRACE_SECONDS 10
+
+typedef struct {
+	const char *name;
+	uint64_t start;
+	uint64_t dur;
+} trace_event_t;
+
+typedef struct trace_ring {
+	/* events written so far, the last TRACE_RING are kept */
+	uint64_t head;
+	int tid;
+	char thread[16];
+	struct trace_ring *next;
+	trace_event_t events[TRACE_RING];
+} trace_ring_t;
+
+static inline uint64_t
+trace_clock()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void
+trace_record(const char *name, uint64_t start, uint64_t end);
+
+/* names the calling thread in dumps */
+void
+trace_thread(const char *fmt, ...);
+
+/* writes the events of the last seconds to path, -1 on error */
+int
+trace_dump(const char *path, int seconds);
+
+#ifdef TRACE
+#define TRACE_BEGIN(name) uint64_t _trace_##name = trace_clock()
+#define TRACE_END(name) trace_record(#name, _trace_##name, trace_clock())
+#define TRACE_THREAD(...) trace_thread(__VA_ARGS__)
+#else
+#define TRACE_BEGIN(name) do {} while (0)
+#define TRACE_END(name) do {} while (0)
+#define TRACE_THREAD(...) do {} while (0)
+#endif
+
+#endif /* _TRACE_H */